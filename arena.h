@@ -0,0 +1,242 @@
+#ifndef arena_header_included
+#define arena_header_included
+
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE) // MAP_ANONYMOUS, syscall()
+#define _DEFAULT_SOURCE                             // with -std=c11
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(_MSC_VER) && !defined(__STDC_LIB_EXT1__)
+typedef int errno_t; // C11 Annex K, Microsoft CRT has it
+#endif
+
+// Bump allocator for large long lived blocks (compression contexts).
+// create() reserves virtual memory that the OS zeroes and commits on
+// first touch: blocks that were never handed out before are known to be
+// zero and pages nobody touches never get physical memory. With
+// arena_flag_huge the memory is backed by 2MB pages when the OS allows
+// (MAP_HUGETLB, else transparent huge pages; MEM_LARGE_PAGES on Windows)
+// which cuts TLB misses of tree walks and map probes over 100+ MB.
+// `node` >= 0 prefers that NUMA node, -1 leaves placement to first touch
+// (pages land on the node of the thread that uses them first).
+// attach() uses caller memory instead.
+
+enum {
+    arena_flag_huge = 0x01,
+    arena_huge_page = 2 * 1024 * 1024
+};
+
+typedef struct {
+    uint8_t* base;
+    size_t   size;
+    size_t   used;
+    size_t   high;  // data[0..high) was handed out and may be non-zero
+    uint32_t flags; // arena_flag_*
+    int32_t  node;  // NUMA node or -1
+    bool     owned; // base was reserved by create()
+    bool     huge;  // backed by huge pages (or advised to be)
+} arena_type;
+
+typedef struct {
+    errno_t (*create)(arena_type* a, size_t size, uint32_t flags,
+                      int32_t node);
+    // `zeroed` if caller knows all memory is zero
+    void    (*attach)(arena_type* a, void* memory, size_t size, bool zeroed);
+    // alloc() returns null when there is no room, sets `zeroed` when
+    // the block was never handed out before (all zero)
+    void*   (*alloc)(arena_type* a, size_t bytes, size_t align, bool *zeroed);
+    // free() only returns the last allocation to the arena
+    void    (*free)(arena_type* a, void* p, size_t bytes);
+    void    (*reset)(arena_type* a); // all allocations are freed
+    void    (*dispose)(arena_type* a);
+    // node() NUMA node of the CPU calling thread runs on (or 0)
+    int32_t (*node)(void);
+} arena_interface;
+
+extern arena_interface arena;
+
+#endif // arena_header_included
+
+#if defined(arena_implementation) && !defined(arena_implemented)
+
+#define arena_implemented
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#ifndef null
+#define null ((void*)0)
+#endif
+
+#ifndef assert
+#include <assert.h>
+#endif
+
+static size_t arena_round_up(size_t bytes, size_t align) {
+    return (bytes + align - 1) & ~(align - 1);
+}
+
+#ifdef _WIN32
+
+// reserve() may round `size` up to the huge page size
+
+static void* arena_reserve(arena_type* a, size_t *size) {
+    const DWORD type = MEM_RESERVE | MEM_COMMIT;
+    HANDLE process = GetCurrentProcess();
+    void* p = null;
+    if ((a->flags & arena_flag_huge) && GetLargePageMinimum() > 0) {
+        // needs SeLockMemoryPrivilege, falls back to regular pages
+        const size_t large = arena_round_up(*size, GetLargePageMinimum());
+        p = a->node >= 0 ?
+            VirtualAllocExNuma(process, null, large, type | MEM_LARGE_PAGES,
+                               PAGE_READWRITE, (DWORD)a->node) :
+            VirtualAlloc(null, large, type | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (p != null) { a->huge = true; *size = large; }
+    }
+    if (p == null) {
+        p = a->node >= 0 ?
+            VirtualAllocExNuma(process, null, *size, type, PAGE_READWRITE,
+                               (DWORD)a->node) :
+            VirtualAlloc(null, *size, type, PAGE_READWRITE);
+    }
+    return p;
+}
+
+static void arena_release(arena_type* a) {
+    VirtualFree(a->base, 0, MEM_RELEASE);
+}
+
+static int32_t arena_node(void) {
+    PROCESSOR_NUMBER pn = {0};
+    GetCurrentProcessorNumberEx(&pn);
+    USHORT node = 0;
+    return GetNumaProcessorNodeEx(&pn, &node) ? (int32_t)node : 0;
+}
+
+#else
+
+// reserve() may round `size` up to the huge page size
+
+static void* arena_reserve(arena_type* a, size_t *size) {
+    void* p = MAP_FAILED;
+    #if defined(MAP_HUGETLB)
+        if (a->flags & arena_flag_huge) { // needs reserved hugetlbfs pages
+            const size_t huge = arena_round_up(*size, arena_huge_page);
+            p = mmap(null, huge, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) { a->huge = true; *size = huge; }
+        }
+    #endif
+    if (p == MAP_FAILED) {
+        p = mmap(null, *size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        #if defined(MADV_HUGEPAGE)
+            if (p != MAP_FAILED && (a->flags & arena_flag_huge)) {
+                a->huge = madvise(p, *size, MADV_HUGEPAGE) == 0;
+            }
+        #endif
+    }
+    if (p == MAP_FAILED) { return null; }
+    #if defined(__linux__) && defined(SYS_mbind)
+        if (a->node >= 0 && a->node < 64) { // MPOL_PREFERRED without libnuma
+            enum { mpol_preferred = 1 };
+            const unsigned long mask = 1UL << a->node;
+            (void)syscall(SYS_mbind, p, *size, mpol_preferred, &mask,
+                          sizeof(mask) * 8 + 1, 0);
+        }
+    #endif
+    return p;
+}
+
+static void arena_release(arena_type* a) {
+    munmap(a->base, a->size);
+}
+
+static int32_t arena_node(void) {
+    #if defined(__linux__) && defined(SYS_getcpu)
+        unsigned int cpu = 0;
+        unsigned int node = 0;
+        if (syscall(SYS_getcpu, &cpu, &node, null) == 0) {
+            return (int32_t)node;
+        }
+    #endif
+    return 0;
+}
+
+#endif
+
+static errno_t arena_create(arena_type* a, size_t size, uint32_t flags,
+                            int32_t node) {
+    memset(a, 0x00, sizeof(*a));
+    a->flags = flags;
+    a->node = node;
+    a->base = size == 0 ? null : (uint8_t*)arena_reserve(a, &size);
+    if (a->base == null) { return ENOMEM; }
+    a->size = size;
+    a->owned = true;
+    return 0;
+}
+
+static void arena_attach(arena_type* a, void* memory, size_t size,
+                         bool zeroed) {
+    memset(a, 0x00, sizeof(*a));
+    a->base = (uint8_t*)memory;
+    a->size = size;
+    a->high = zeroed ? 0 : size;
+    a->node = -1;
+}
+
+static void* arena_alloc(arena_type* a, size_t bytes, size_t align,
+                         bool *zeroed) {
+    assert(align > 0 && (align & (align - 1)) == 0);
+    const uintptr_t base = (uintptr_t)a->base;
+    const size_t offset = (size_t)(arena_round_up(base + a->used, align) - base);
+    if (a->base == null || offset > a->size || bytes > a->size - offset) {
+        return null;
+    }
+    if (zeroed != null) { *zeroed = offset >= a->high; }
+    a->used = offset + bytes;
+    if (a->used > a->high) { a->high = a->used; }
+    return a->base + offset;
+}
+
+static void arena_free(arena_type* a, void* p, size_t bytes) {
+    if ((uint8_t*)p + bytes == a->base + a->used) {
+        a->used = (size_t)((uint8_t*)p - a->base);
+    }
+}
+
+static void arena_reset(arena_type* a) {
+    a->used = 0;
+}
+
+static void arena_dispose(arena_type* a) {
+    if (a->owned && a->base != null) { arena_release(a); }
+    memset(a, 0x00, sizeof(*a));
+}
+
+arena_interface arena = {
+    .create  = arena_create,
+    .attach  = arena_attach,
+    .alloc   = arena_alloc,
+    .free    = arena_free,
+    .reset   = arena_reset,
+    .dispose = arena_dispose,
+    .node    = arena_node
+};
+
+#endif // arena_implementation
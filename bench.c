@@ -0,0 +1,908 @@
+#include "rt.h"
+
+#include "bitstream.h"
+#include "file.h"
+#include "squeeze.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi")
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define bench_rdtsc
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_rdtsc
+#endif
+
+// Compress and decompress throughput over the test/ corpus and synthetic
+// data (or files from the command line). Each input is compressed and
+// decompressed `repetitions` times and the fastest run is reported as
+// MB/s, ns/byte and cycles/byte (TSC reference cycles on x86, generic
+// timer ticks on ARM64) with the compression ratio and process peak RSS,
+// as a table on stdout and optionally as JSON.
+
+enum { bench_synthetic_bytes = 1024 * 1024 };
+
+typedef struct {
+    double   seconds;
+    uint64_t cycles;
+} bench_time_type;
+
+typedef struct {
+    char     name[128];
+    uint64_t bytes;
+    uint64_t compressed;
+    bench_time_type compress;   // fastest of the repetitions
+    bench_time_type decompress;
+    uint64_t peak_rss; // bytes, of the process after the input
+    double   stage[squeeze_stages]; // compress seconds by stage (-t)
+    uint8_t  win_bits; // chosen by squeeze.tune() with -A
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    double   tune; // seconds squeeze.tune() took
+} bench_result_type;
+
+typedef struct {
+    uint8_t  win_bits;
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    uint16_t flags;
+    uint32_t options;
+    int32_t  repetitions;
+    const char* json;  // report file name or null
+    const char* trace; // trace file names prefix or null
+    bool arena; // contexts in huge pages arena reused by all repetitions
+    bool tune;  // win_bits, map_bits and len_bits tuned for each input
+    uint64_t memory; // tune budget: context bytes (0 unlimited)
+    double   speed;  // tune budget: compression bytes/s (0 unlimited)
+} bench_parameters_type;
+
+static double bench_seconds(void) {
+    #ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return (double)counter.QuadPart / (double)frequency.QuadPart;
+    #else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    #endif
+}
+
+static uint64_t bench_cycles(void) {
+    #if defined(bench_rdtsc)
+        return __rdtsc();
+    #elif defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+        return ticks;
+    #else
+        return 0; // reported as 0 cycles/byte
+    #endif
+}
+
+static uint64_t bench_peak_rss(void) {
+    #ifdef _WIN32
+        PROCESS_MEMORY_COUNTERS pmc = { .cb = sizeof(pmc) };
+        if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+            return 0;
+        }
+        return (uint64_t)pmc.PeakWorkingSetSize;
+    #else
+        struct rusage ru = {0};
+        if (getrusage(RUSAGE_SELF, &ru) != 0) { return 0; }
+        #ifdef __APPLE__
+            return (uint64_t)ru.ru_maxrss; // bytes
+        #else
+            return (uint64_t)ru.ru_maxrss * 1024; // kilobytes
+        #endif
+    #endif
+}
+
+static uint64_t bench_random(uint64_t* state) { // xorshift64
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// synthetic inputs: 0 zeros, 1 random, 2 text, 3 records
+
+static const char* bench_synthetic_names[] = {
+    "synthetic zeros", "synthetic random", "synthetic text",
+    "synthetic records"
+};
+
+static void bench_synthetic(int32_t kind, uint8_t* data, size_t bytes) {
+    static const char* words[] = {
+        "the", "of", "and", "to", "in", "squeeze", "window", "match",
+        "dictionary", "huffman", "literal", "length", "position", "data",
+        "stream", "compress", "a", "is", "that", "it", "with", "for"
+    };
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    if (kind == 0) {
+        memset(data, 0, bytes);
+    } else if (kind == 1) {
+        for (size_t i = 0; i < bytes; i++) {
+            data[i] = (uint8_t)bench_random(&state);
+        }
+    } else if (kind == 2) { // words with skewed frequencies
+        size_t i = 0;
+        while (i < bytes) {
+            const uint64_t r = bench_random(&state);
+            const size_t w = (size_t)((r % rt_countof(words)) *
+                                      ((r >> 32) % rt_countof(words))) /
+                             rt_countof(words);
+            const char* word = words[w];
+            for (size_t k = 0; word[k] != 0 && i < bytes; k++) {
+                data[i++] = (uint8_t)word[k];
+            }
+            if (i < bytes) { data[i++] = (r >> 20) % 13 == 0 ? '\n' : ' '; }
+        }
+    } else { // 16 byte records: counter, timestamp, small value, padding
+        for (size_t i = 0; i < bytes; i++) {
+            const uint32_t record = (uint32_t)(i / 16);
+            const size_t field = i % 16;
+            uint8_t b = 0;
+            if (field < 4) {
+                b = (uint8_t)(record >> (field * 8));
+            } else if (field < 8) {
+                b = (uint8_t)((record * 1000 + 1700000000U) >> ((field - 4) * 8));
+            } else if (field < 10) {
+                b = (uint8_t)(bench_random(&state) % 4);
+            }
+            data[i] = b;
+        }
+    }
+}
+
+enum { bench_trace_events = 64 * 1024 };
+
+// writes <prefix><name>.<suffix>.json trace of the context and sums
+// stage times of its events into `stage`
+
+static errno_t bench_trace(const bench_parameters_type* p,
+                           const squeeze_type* s, const char* name,
+                           const char* suffix, double stage[]) {
+    const squeeze_trace_type* t = &s->trace;
+    const double rate = t->ns > t->origin && t->ticks > t->origin_ticks ?
+        (double)(t->ticks - t->origin_ticks) / (double)(t->ns - t->origin) : 1;
+    const uint64_t count = atomic_load(&((squeeze_trace_type*)t)->count);
+    const uint64_t n = count < t->capacity ? count : t->capacity;
+    for (uint64_t i = 0; i < n; i++) {
+        for (int32_t k = 0; k < squeeze_stages; k++) {
+            stage[k] += (double)t->event[i].stage[k] / rate * 1e-9;
+        }
+    }
+    char fn[1024];
+    snprintf(fn, sizeof(fn), "%s%s.%s.json", p->trace, name, suffix);
+    for (char* c = fn + strlen(p->trace); *c != 0; c++) {
+        if (*c == ' ' || *c == '/' || *c == '\\') { *c = '_'; }
+    }
+    FILE* f = null;
+    errno_t r = fopen_s(&f, fn, "w");
+    if (r != 0 || f == null) { return r != 0 ? r : EIO; }
+    r = squeeze.trace(s, f);
+    if (fclose(f) != 0 && r == 0) { r = errno; }
+    return r;
+}
+
+static errno_t bench_run(const bench_parameters_type* p, const uint8_t* data,
+                         size_t bytes, bench_result_type* result) {
+    const size_t capacity = bytes * 2 + 4096;
+    uint8_t* compressed = (uint8_t*)malloc(capacity);
+    uint8_t* output = (uint8_t*)malloc(bytes > 0 ? bytes : 1);
+    squeeze_event_type* events = p->trace == null ? null :
+        (squeeze_event_type*)malloc(bench_trace_events *
+                                    sizeof(squeeze_event_type));
+    errno_t r = compressed == null || output == null ||
+                (p->trace != null && events == null) ? ENOMEM : 0;
+    arena_type a = {0};
+    if (r == 0 && p->arena) {
+        const size_t size = squeeze_sizeof_with(p->win_bits, p->map_bits,
+            p->len_bits, p->options | squeeze_option_trace);
+        r = arena.create(&a, size + 4096, arena_flag_huge, -1);
+    }
+    result->bytes = bytes;
+    result->compress.seconds = 0;
+    result->decompress.seconds = 0;
+    for (int32_t i = 0; i < p->repetitions && r == 0; i++) {
+        // only the last repetition is traced
+        const bool traced = p->trace != null && i == p->repetitions - 1;
+        const uint32_t options = p->options |
+                                 (traced ? squeeze_option_trace : 0);
+        bitstream_type bs = { .data = compressed, .capacity = capacity };
+        squeeze.write_header(&bs, bytes, p->win_bits, p->map_bits,
+                             p->len_bits, p->flags, 0);
+        squeeze_type* s = p->arena ?
+            squeeze.new_in(&a, &bs, p->win_bits, p->map_bits, p->len_bits,
+                           options) :
+            squeeze.new(&bs, p->win_bits, p->map_bits, p->len_bits,
+                        options);
+        r = s == null ? ENOMEM : bs.error;
+        if (r == 0) {
+            s->flags = p->flags;
+            s->trace.event = events;
+            s->trace.capacity = bench_trace_events;
+            const uint64_t c = bench_cycles();
+            const double t = bench_seconds();
+            squeeze.compress(s, data, bytes);
+            const bench_time_type e = {
+                .seconds = bench_seconds() - t, .cycles = bench_cycles() - c
+            };
+            r = s->error;
+            if (i == 0 || e.seconds < result->compress.seconds) {
+                result->compress = e;
+            }
+            result->compressed = bs.bytes;
+            if (r == 0 && traced) {
+                r = bench_trace(p, s, result->name, "compress", result->stage);
+            }
+        }
+        if (s != null) { squeeze.delete(s); s = null; }
+        bitstream_type in = { .data = compressed, .bytes = bs.bytes };
+        uint64_t n = 0;
+        uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+        uint16_t flags = 0;
+        uint32_t id = 0;
+        if (r == 0) {
+            squeeze.read_header(&in, &n, &win_bits, &map_bits, &len_bits,
+                                &flags, &id);
+            r = in.error != 0 ? in.error : (n != bytes ? EINVAL : 0);
+        }
+        if (r == 0) {
+            s = p->arena ?
+                squeeze.new_in(&a, &in, win_bits, map_bits, len_bits,
+                               options) :
+                squeeze.new(&in, win_bits, map_bits, len_bits, options);
+        }
+        if (r == 0 && s == null) { r = ENOMEM; }
+        if (r == 0) {
+            s->flags = flags;
+            s->trace.event = events;
+            s->trace.capacity = bench_trace_events;
+            const uint64_t c = bench_cycles();
+            const double t = bench_seconds();
+            squeeze.decompress(s, output, bytes);
+            const bench_time_type e = {
+                .seconds = bench_seconds() - t, .cycles = bench_cycles() - c
+            };
+            r = s->error;
+            if (r == 0 && memcmp(data, output, bytes) != 0) { r = EINVAL; }
+            if (i == 0 || e.seconds < result->decompress.seconds) {
+                result->decompress = e;
+            }
+            if (r == 0 && traced) {
+                double unused[squeeze_stages] = {0};
+                r = bench_trace(p, s, result->name, "decompress", unused);
+            }
+        }
+        if (s != null) { squeeze.delete(s); }
+    }
+    result->peak_rss = bench_peak_rss();
+    if (p->arena) { arena.dispose(&a); }
+    free(events);
+    free(output);
+    free(compressed);
+    return r;
+}
+
+static double bench_mb_per_s(const bench_result_type* r, bench_time_type t) {
+    return t.seconds > 0 ? (double)r->bytes / t.seconds / 1e6 : 0;
+}
+
+static double bench_ns_per_byte(const bench_result_type* r,
+                                bench_time_type t) {
+    return r->bytes > 0 ? t.seconds * 1e9 / (double)r->bytes : 0;
+}
+
+static double bench_cycles_per_byte(const bench_result_type* r,
+                                    bench_time_type t) {
+    return r->bytes > 0 ? (double)t.cycles / (double)r->bytes : 0;
+}
+
+static double bench_ratio(const bench_result_type* r) {
+    return r->bytes > 0 ? (double)r->compressed * 100.0 / (double)r->bytes : 0;
+}
+
+static void bench_table_header(void) {
+    printf("%-24s %9s %9s %6s | %8s %7s %7s | %8s %7s %7s | %7s\n",
+           "input", "bytes", "packed", "ratio",
+           "comp MB/s", "ns/B", "cyc/B", "dec MB/s", "ns/B", "cyc/B",
+           "RSS MB");
+}
+
+static void bench_table_row(const bench_result_type* r) {
+    printf("%-24.24s %9lld %9lld %5.1f%% | %8.2f %7.1f %7.1f | "
+           "%8.2f %7.1f %7.1f | %7.1f\n",
+           r->name, (long long)r->bytes, (long long)r->compressed,
+           bench_ratio(r),
+           bench_mb_per_s(r, r->compress), bench_ns_per_byte(r, r->compress),
+           bench_cycles_per_byte(r, r->compress),
+           bench_mb_per_s(r, r->decompress),
+           bench_ns_per_byte(r, r->decompress),
+           bench_cycles_per_byte(r, r->decompress),
+           (double)r->peak_rss / (1024.0 * 1024.0));
+}
+
+static void bench_stages_row(const bench_result_type* r) {
+    static const char* names[] = { "search", "lookup", "coding", "io" };
+    double total = 0;
+    for (int32_t k = 0; k < squeeze_stages; k++) { total += r->stage[k]; }
+    printf("%-24s", "  stages (sampled)");
+    for (int32_t k = 0; k < squeeze_stages; k++) {
+        printf(" %s %.1f%%", names[k],
+               total > 0 ? r->stage[k] * 100.0 / total : 0);
+    }
+    printf("\n");
+}
+
+static void bench_tune_row(const bench_result_type* r) {
+    printf("%-24s win_bits %d map_bits %d len_bits %d in %.3fs\n",
+           "  tuned", r->win_bits, r->map_bits, r->len_bits, r->tune);
+}
+
+static void bench_json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s != 0; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        } else if ((uint8_t)*s < 0x20) {
+            fprintf(f, "\\u%04x", (uint8_t)*s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void bench_json_time(FILE* f, const char* name,
+                            const bench_result_type* r, bench_time_type t) {
+    fprintf(f, "\"%s\": { \"seconds\": %.9f, \"mb_per_s\": %.3f, "
+               "\"ns_per_byte\": %.3f, \"cycles_per_byte\": %.3f }",
+            name, t.seconds, bench_mb_per_s(r, t), bench_ns_per_byte(r, t),
+            bench_cycles_per_byte(r, t));
+}
+
+static errno_t bench_json(const bench_parameters_type* p,
+                          const bench_result_type results[], int32_t n) {
+    FILE* f = null;
+    errno_t r = fopen_s(&f, p->json, "w");
+    if (r != 0 || f == null) { return r != 0 ? r : EIO; }
+    fprintf(f, "{\n  \"parameters\": { \"win_bits\": %d, \"map_bits\": %d, "
+               "\"len_bits\": %d, \"flags\": %d, \"options\": %d, "
+               "\"repetitions\": %d },\n  \"results\": [\n",
+            p->win_bits, p->map_bits, p->len_bits, p->flags,
+            (int32_t)p->options, p->repetitions);
+    for (int32_t i = 0; i < n; i++) {
+        const bench_result_type* e = &results[i];
+        fprintf(f, "    { \"name\": ");
+        bench_json_string(f, e->name);
+        fprintf(f, ", \"bytes\": %lld, \"compressed\": %lld, "
+                   "\"ratio\": %.3f,\n      ",
+                (long long)e->bytes, (long long)e->compressed,
+                bench_ratio(e));
+        bench_json_time(f, "compress", e, e->compress);
+        fprintf(f, ",\n      ");
+        bench_json_time(f, "decompress", e, e->decompress);
+        fprintf(f, ",\n      \"win_bits\": %d, \"map_bits\": %d, "
+                   "\"len_bits\": %d, \"peak_rss\": %lld }%s\n",
+                e->win_bits, e->map_bits, e->len_bits,
+                (long long)e->peak_rss, i < n - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (fclose(f) != 0) { r = errno; }
+    return r;
+}
+
+// Micro benchmarks of the building blocks (-u): bitstream bits at various
+// widths, 64 bit words through a temporary file by stdio and by the
+// asynchronous double buffered I/O, huffman.inc_frequency() on uniform and
+// skewed symbols (with the tree maintenance counters per operation) and map
+// put/get/best at load factors up to the 75% cap.
+
+enum {
+    bench_micro_max      = 40,
+    bench_micro_bits     = 4 * 1024 * 1024, // bytes of bitstream memory
+    bench_micro_file     = 64 * 1024 * 1024, // bytes of the temporary file
+    bench_micro_values   = 64 * 1024,       // power of 2
+    bench_micro_symbols  = 1024 * 1024,
+    bench_micro_map_n    = 64 * 1024,       // map entries
+    bench_micro_lookups  = 64 * 1024
+};
+
+typedef struct {
+    char     name[32];
+    char     parameter[32];
+    uint64_t ops;
+    bench_time_type time; // fastest of the repetitions
+    double   updates; // huffman stats per operation
+    double   swaps;
+    double   moves;
+} bench_micro_type;
+
+typedef struct {
+    bench_micro_type micro[bench_micro_max];
+    int32_t n;
+    volatile uint64_t sink; // keeps results of measured calls alive
+} bench_micro_results_type;
+
+static bench_micro_type* bench_micro_add(bench_micro_results_type* mr,
+                                         const char* name,
+                                         const char* parameter) {
+    rt_assert(mr->n < bench_micro_max);
+    bench_micro_type* e = &mr->micro[mr->n++];
+    memset(e, 0x00, sizeof(*e));
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    snprintf(e->parameter, sizeof(e->parameter), "%s", parameter);
+    return e;
+}
+
+static void bench_micro_time(bench_micro_type* e, int32_t i, uint64_t ops,
+                             double seconds, uint64_t cycles) {
+    if (i == 0 || seconds < e->time.seconds) {
+        e->time = (bench_time_type){ .seconds = seconds, .cycles = cycles };
+        e->ops = ops;
+    }
+}
+
+static errno_t bench_micro_bitstream(const bench_parameters_type* p,
+                                     bench_micro_results_type* mr) {
+    static const int32_t widths[] = { 1, 5, 8, 13, 24, 32, 57, 64 };
+    uint8_t*  data = (uint8_t*)malloc(bench_micro_bits + 64);
+    uint64_t* values = (uint64_t*)malloc(bench_micro_values * sizeof(uint64_t));
+    errno_t r = data == null || values == null ? ENOMEM : 0;
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    for (int32_t i = 0; i < bench_micro_values && r == 0; i++) {
+        values[i] = bench_random(&state);
+    }
+    for (int32_t w = 0; w < (int32_t)rt_countof(widths) && r == 0; w++) {
+        const int32_t bits = widths[w];
+        const uint64_t ops = (uint64_t)bench_micro_bits * 8 / (uint64_t)bits;
+        char parameter[32];
+        snprintf(parameter, sizeof(parameter), "%d bits", bits);
+        bench_micro_type* wr = bench_micro_add(mr, "bitstream.write_bits",
+                                               parameter);
+        bench_micro_type* rd = bench_micro_add(mr, "bitstream.read_bits",
+                                               parameter);
+        for (int32_t i = 0; i < p->repetitions && r == 0; i++) {
+            bitstream_type* bs = (bitstream_type*)calloc(1, sizeof(*bs));
+            if (bs == null) { r = ENOMEM; break; }
+            bs->data = data;
+            bs->capacity = bench_micro_bits + 64;
+            uint64_t c = bench_cycles();
+            double t = bench_seconds();
+            for (uint64_t k = 0; k < ops; k++) {
+                bitstream.write_bits(bs, values[k & (bench_micro_values - 1)],
+                                     bits);
+            }
+            bitstream.flush(bs);
+            bench_micro_time(wr, i, ops, bench_seconds() - t,
+                             bench_cycles() - c);
+            r = bs->error;
+            const uint64_t written = bs->bytes;
+            memset(bs, 0x00, sizeof(*bs));
+            bs->data = data;
+            bs->bytes = written;
+            uint64_t sum = 0;
+            c = bench_cycles();
+            t = bench_seconds();
+            for (uint64_t k = 0; k < ops && r == 0; k++) {
+                sum += bitstream.read_bits(bs, bits);
+            }
+            bench_micro_time(rd, i, ops, bench_seconds() - t,
+                             bench_cycles() - c);
+            mr->sink += sum;
+            if (r == 0) { r = bs->error; }
+            free(bs);
+        }
+    }
+    free(values);
+    free(data);
+    return r;
+}
+
+static errno_t bench_micro_file_io(const bench_parameters_type* p,
+                                   bench_micro_results_type* mr) {
+    static const char* parameters[] = { "stdio", "io" };
+    const uint64_t ops = bench_micro_file / 8;
+    errno_t r = 0;
+    for (int32_t a = 0; a < (int32_t)rt_countof(parameters) && r == 0; a++) {
+        const bool async = a == 1;
+        bench_micro_type* wr = bench_micro_add(mr, "file.write_bits",
+                                               parameters[a]);
+        bench_micro_type* rd = bench_micro_add(mr, "file.read_bits",
+                                               parameters[a]);
+        for (int32_t i = 0; i < p->repetitions && r == 0; i++) {
+            FILE* f = tmpfile();
+            if (f == null) { r = errno != 0 ? errno : EIO; break; }
+            bitstream_io_type io = {0};
+            bitstream_type bs = { .file = f };
+            uint64_t c = bench_cycles();
+            double t = bench_seconds();
+            if (async) { r = bitstream.open(&bs, &io, f, true, 0); }
+            for (uint64_t k = 0; k < ops && r == 0; k++) {
+                bitstream.write_bits(&bs, k, 64);
+            }
+            if (r == 0 && async) { r = bitstream.close(&bs); }
+            if (r == 0 && !async && fflush(f) != 0) { r = errno; }
+            bench_micro_time(wr, i, ops, bench_seconds() - t,
+                             bench_cycles() - c);
+            if (r == 0) { r = bs.error; }
+            rewind(f);
+            bs = (bitstream_type){ .file = f };
+            uint64_t sum = 0;
+            c = bench_cycles();
+            t = bench_seconds();
+            if (r == 0 && async) { r = bitstream.open(&bs, &io, f, false, 0); }
+            for (uint64_t k = 0; k < ops && r == 0; k++) {
+                sum += bitstream.read_bits(&bs, 64);
+            }
+            if (r == 0) { r = bs.error; }
+            if (async && bs.io != null) { bitstream.close(&bs); }
+            bench_micro_time(rd, i, ops, bench_seconds() - t,
+                             bench_cycles() - c);
+            mr->sink += sum;
+            fclose(f);
+        }
+    }
+    return r;
+}
+
+static errno_t bench_micro_huffman(const bench_parameters_type* p,
+                                   bench_micro_results_type* mr) {
+    enum { n = 256, m = n * 2 - 1 };
+    static huffman_node_type nodes[m];
+    uint8_t* symbols = (uint8_t*)malloc(bench_micro_symbols);
+    if (symbols == null) { return ENOMEM; }
+    for (int32_t skewed = 0; skewed <= 1; skewed++) {
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        for (int32_t i = 0; i < bench_micro_symbols; i++) {
+            const uint64_t x = bench_random(&state) % n;
+            // skewed: cube of uniform [0..1) favors small symbols
+            symbols[i] = (uint8_t)(skewed ? x * x * x / (n * n) : x);
+        }
+        bench_micro_type* e = bench_micro_add(mr, "huffman.inc_frequency",
+                                              skewed ? "skewed" : "uniform");
+        for (int32_t i = 0; i < p->repetitions; i++) {
+            huffman_tree_type t = {0};
+            huffman.init(&t, nodes, m);
+            const uint64_t c = bench_cycles();
+            const double s = bench_seconds();
+            for (int32_t k = 0; k < bench_micro_symbols; k++) {
+                huffman.inc_frequency(&t, symbols[k]);
+            }
+            bench_micro_time(e, i, bench_micro_symbols, bench_seconds() - s,
+                             bench_cycles() - c);
+            e->updates = (double)t.stats.updates / bench_micro_symbols;
+            e->swaps   = (double)t.stats.swaps   / bench_micro_symbols;
+            e->moves   = (double)t.stats.moves   / bench_micro_symbols;
+        }
+    }
+    free(symbols);
+    return 0;
+}
+
+// map words are random slices of 4..64 bytes of synthetic text
+
+static const uint8_t* bench_micro_word(const uint8_t* text, size_t bytes,
+                                       uint64_t* state, uint8_t *length) {
+    const uint64_t x = bench_random(state);
+    *length = (uint8_t)(4 + (x >> 32) % 61);
+    return text + x % (bytes - 64);
+}
+
+static errno_t bench_micro_map(const bench_parameters_type* p,
+                               bench_micro_results_type* mr) {
+    static const int32_t loads[] = { 25, 50, 75 }; // percent
+    const size_t bytes = bench_synthetic_bytes;
+    uint8_t* text = (uint8_t*)malloc(bytes);
+    map_entry_t* entries = (map_entry_t*)
+        malloc(bench_micro_map_n * sizeof(map_entry_t));
+    map_type* m = (map_type*)calloc(1, sizeof(map_type));
+    errno_t r = text == null || entries == null || m == null ? ENOMEM : 0;
+    if (r == 0) { bench_synthetic(2, text, bytes); }
+    for (int32_t l = 0; l < (int32_t)rt_countof(loads) && r == 0; l++) {
+        char parameter[32];
+        snprintf(parameter, sizeof(parameter), "%d%% load", loads[l]);
+        bench_micro_type* put  = bench_micro_add(mr, "map.put",  parameter);
+        bench_micro_type* get  = bench_micro_add(mr, "map.get",  parameter);
+        bench_micro_type* best = bench_micro_add(mr, "map.best", parameter);
+        const int32_t from = bench_micro_map_n * (loads[l] - 25) / 100;
+        const int32_t to   = bench_micro_map_n * loads[l] / 100;
+        for (int32_t i = 0; i < p->repetitions; i++) {
+            map.init(m, entries, bench_micro_map_n);
+            uint64_t state = 0xD1B54A32D192ED03ULL;
+            uint8_t length = 0;
+            while (m->entries < from) {
+                const uint8_t* w = bench_micro_word(text, bytes, &state,
+                                                    &length);
+                map.put(m, w, length);
+            }
+            // put() from the previous load up to this one
+            uint64_t ops = 0;
+            uint64_t c = bench_cycles();
+            double t = bench_seconds();
+            while (m->entries < to) {
+                const uint8_t* w = bench_micro_word(text, bytes, &state,
+                                                    &length);
+                map.put(m, w, length);
+                ops++;
+            }
+            bench_micro_time(put, i, ops, bench_seconds() - t,
+                             bench_cycles() - c);
+            // get() of words: about half were put, the rest are misses
+            uint64_t lookup = 0xD1B54A32D192ED03ULL;
+            int64_t sum = 0;
+            c = bench_cycles();
+            t = bench_seconds();
+            for (int32_t k = 0; k < bench_micro_lookups; k++) {
+                const uint8_t* w = (k & 1) ?
+                    bench_micro_word(text, bytes, &lookup, &length) :
+                    bench_micro_word(text, bytes, &state, &length);
+                sum += map.get(m, w, length);
+            }
+            bench_micro_time(get, i, bench_micro_lookups, bench_seconds() - t,
+                             bench_cycles() - c);
+            // best() at random text positions as compressor does
+            c = bench_cycles();
+            t = bench_seconds();
+            for (int32_t k = 0; k < bench_micro_lookups; k++) {
+                const size_t at = (size_t)(bench_random(&lookup) %
+                                           (bytes - 255));
+                sum += map.best(m, text + at, 255);
+            }
+            bench_micro_time(best, i, bench_micro_lookups,
+                             bench_seconds() - t, bench_cycles() - c);
+            mr->sink += (uint64_t)sum;
+        }
+    }
+    free(m);
+    free(entries);
+    free(text);
+    return r;
+}
+
+static void bench_micro_table(const bench_micro_results_type* mr) {
+    printf("%-22s %-10s %9s %9s %8s %8s | %s\n",
+           "component", "parameter", "ops", "Mops/s", "ns/op", "cyc/op",
+           "updates swaps moves per op");
+    for (int32_t i = 0; i < mr->n; i++) {
+        const bench_micro_type* e = &mr->micro[i];
+        const double ops = (double)(e->ops > 0 ? e->ops : 1);
+        printf("%-22s %-10s %9lld %9.2f %8.2f %8.2f |",
+               e->name, e->parameter, (long long)e->ops,
+               e->time.seconds > 0 ? ops / e->time.seconds / 1e6 : 0,
+               e->time.seconds * 1e9 / ops, (double)e->time.cycles / ops);
+        if (e->updates > 0) {
+            printf(" %7.2f %5.2f %5.2f", e->updates, e->swaps, e->moves);
+        }
+        printf("\n");
+    }
+}
+
+static errno_t bench_micro_json(const bench_parameters_type* p,
+                                const bench_micro_results_type* mr) {
+    FILE* f = null;
+    errno_t r = fopen_s(&f, p->json, "w");
+    if (r != 0 || f == null) { return r != 0 ? r : EIO; }
+    fprintf(f, "{\n  \"parameters\": { \"repetitions\": %d },\n"
+               "  \"micro\": [\n", p->repetitions);
+    for (int32_t i = 0; i < mr->n; i++) {
+        const bench_micro_type* e = &mr->micro[i];
+        const double ops = (double)(e->ops > 0 ? e->ops : 1);
+        fprintf(f, "    { \"name\": ");
+        bench_json_string(f, e->name);
+        fprintf(f, ", \"parameter\": ");
+        bench_json_string(f, e->parameter);
+        fprintf(f, ", \"ops\": %lld, \"seconds\": %.9f,\n"
+                   "      \"mops_per_s\": %.3f, \"ns_per_op\": %.3f, "
+                   "\"cycles_per_op\": %.3f, \"updates_per_op\": %.3f, "
+                   "\"swaps_per_op\": %.3f, \"moves_per_op\": %.3f }%s\n",
+                (long long)e->ops, e->time.seconds,
+                e->time.seconds > 0 ? ops / e->time.seconds / 1e6 : 0,
+                e->time.seconds * 1e9 / ops, (double)e->time.cycles / ops,
+                e->updates, e->swaps, e->moves, i < mr->n - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (fclose(f) != 0) { r = errno; }
+    return r;
+}
+
+static errno_t bench_micro(const bench_parameters_type* p) {
+    bench_micro_results_type* mr = (bench_micro_results_type*)
+        calloc(1, sizeof(bench_micro_results_type));
+    if (mr == null) { return ENOMEM; }
+    errno_t r = bench_micro_bitstream(p, mr);
+    if (r == 0) { r = bench_micro_file_io(p, mr); }
+    if (r == 0) { r = bench_micro_huffman(p, mr); }
+    if (r == 0) { r = bench_micro_map(p, mr); }
+    if (r == 0) { bench_micro_table(mr); }
+    if (r == 0 && p->json != null) {
+        r = bench_micro_json(p, mr);
+        if (r != 0) { printf("%s: %s\n", p->json, strerror(r)); }
+    }
+    if (r != 0) { printf("micro benchmarks: %s\n", strerror(r)); }
+    free(mr);
+    return r;
+}
+
+static void bench_usage(void) {
+    printf("usage: bench [-u] [-a] [-n repetitions] [-w win_bits] [-m map_bits]\n"
+           "             [-l len_bits] [-f flags] [-o options]\n"
+           "             [-j report.json] [-t trace_prefix]\n"
+           "             [-A] [-M memory_mb] [-S mb_per_s] [file ...]\n"
+           "flags and options are squeeze_flag_* and squeeze_option_*\n"
+           "bits (e.g. -f 0x102 long and checksum, -o 0x0A pipeline, long).\n"
+           "Without files: test/ corpus and synthetic data.\n"
+           "-u runs bitstream, file I/O, huffman and map micro benchmarks instead.\n"
+           "-a places contexts into an arena backed by huge pages.\n"
+           "-t writes Chrome trace JSON of the last repetition to\n"
+           "   <trace_prefix><input>.compress.json and .decompress.json\n"
+           "   and prints compression time by stage.\n"
+           "-A tunes win_bits, map_bits and len_bits for each input on a\n"
+           "   sample within -M context memory and -S compression speed.\n");
+}
+
+int main(int argc, const char* argv[]) {
+    static const char* corpus[] = {
+        "test/bible.txt",
+        "test/hhgttg.txt",
+        "test/confucius.txt",
+        "test/laozi.txt",
+        "test/sqlite3.c",
+        "test/arm64.elf",
+        "test/x64.elf",
+        "test/mandrill.bmp",
+        "test/mandrill.png",
+    };
+    bench_parameters_type p = {
+        .win_bits = 12, .map_bits = 19, .len_bits = 4, .repetitions = 3
+    };
+    const char* files[64];
+    int32_t count = 0;
+    bool micro = false;
+    for (int32_t i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if (strcmp(a, "-u") == 0) { micro = true; continue; }
+        if (strcmp(a, "-a") == 0) { p.arena = true; continue; }
+        if (strcmp(a, "-A") == 0) { p.tune = true; continue; }
+        const bool value = a[0] == '-' && a[1] != 0 && a[2] == 0 &&
+                           i + 1 < argc;
+        const unsigned long v = value ? strtoul(argv[i + 1], null, 0) : 0;
+        if (value && a[1] == 'n') {
+            p.repetitions = (int32_t)v;
+        } else if (value && a[1] == 'w') {
+            p.win_bits = (uint8_t)v;
+        } else if (value && a[1] == 'm') {
+            p.map_bits = (uint8_t)v;
+        } else if (value && a[1] == 'l') {
+            p.len_bits = (uint8_t)v;
+        } else if (value && a[1] == 'f') {
+            p.flags = (uint16_t)v;
+        } else if (value && a[1] == 'o') {
+            p.options = (uint32_t)v;
+        } else if (value && a[1] == 'j') {
+            p.json = argv[i + 1];
+        } else if (value && a[1] == 't') {
+            p.trace = argv[i + 1];
+        } else if (value && a[1] == 'M') {
+            p.memory = (uint64_t)v * 1024 * 1024;
+        } else if (value && a[1] == 'S') {
+            p.speed = strtod(argv[i + 1], null) * 1024 * 1024;
+        } else if (a[0] != '-' && count < (int32_t)rt_countof(files)) {
+            files[count++] = a;
+            continue;
+        } else {
+            bench_usage();
+            return EINVAL;
+        }
+        i++; // value
+    }
+    if (p.repetitions < 1 || (p.flags & squeeze_flag_dictionary)) {
+        bench_usage();
+        return EINVAL;
+    }
+    if (micro) { return bench_micro(&p); }
+    const int32_t synthetic = count == 0 ?
+        (int32_t)rt_countof(bench_synthetic_names) : 0;
+    if (count == 0) {
+        for (int32_t i = 0; i < (int32_t)rt_countof(corpus); i++) {
+            if (file.exist(corpus[i])) { files[count++] = corpus[i]; }
+        }
+    }
+    const int32_t n = count + synthetic;
+    bench_result_type* results = (bench_result_type*)
+        calloc((size_t)(n > 0 ? n : 1), sizeof(bench_result_type));
+    if (results == null) { return ENOMEM; }
+    printf("win_bits: %d map_bits: %d len_bits: %d flags: 0x%X "
+           "options: 0x%X repetitions: %d\n", p.win_bits, p.map_bits,
+           p.len_bits, p.flags, (uint32_t)p.options, p.repetitions);
+    bench_table_header();
+    errno_t r = 0;
+    for (int32_t i = 0; i < n && r == 0; i++) {
+        bench_result_type* e = &results[i];
+        uint8_t* data = null;
+        size_t bytes = 0;
+        if (i < count) {
+            const char* name = strrchr(files[i], '/');
+            snprintf(e->name, sizeof(e->name), "%s",
+                     name != null ? name + 1 : files[i]);
+            r = file.read_fully(files[i], &data, &bytes);
+        } else {
+            snprintf(e->name, sizeof(e->name), "%s",
+                     bench_synthetic_names[i - count]);
+            bytes = bench_synthetic_bytes;
+            data = (uint8_t*)malloc(bytes);
+            if (data == null) { r = ENOMEM; }
+            if (r == 0) { bench_synthetic(i - count, data, bytes); }
+        }
+        bench_parameters_type q = p;
+        if (r == 0 && p.tune) {
+            squeeze_tune_type t = {
+                .memory = p.memory, .speed = p.speed,
+                .flags = p.flags, .options = p.options
+            };
+            const double start = bench_seconds();
+            r = squeeze.tune(data, bytes, &t);
+            e->tune = bench_seconds() - start;
+            q.win_bits = t.win_bits;
+            q.map_bits = t.map_bits;
+            q.len_bits = t.len_bits;
+        }
+        e->win_bits = q.win_bits;
+        e->map_bits = q.map_bits;
+        e->len_bits = q.len_bits;
+        if (r == 0) { r = bench_run(&q, data, bytes, e); }
+        if (r == 0) {
+            bench_table_row(e);
+            if (p.tune) { bench_tune_row(e); }
+            if (p.trace != null) { bench_stages_row(e); }
+        } else {
+            printf("%s: %s\n", e->name, strerror(r));
+        }
+        free(data);
+    }
+    if (r == 0 && p.json != null) {
+        r = bench_json(&p, results, n);
+        if (r != 0) { printf("%s: %s\n", p.json, strerror(r)); }
+    }
+    free(results);
+    return r;
+}
+
+#define arena_implementation
+#include "arena.h"
+
+#define map_implementation
+#include "map.h"
+
+#define bitstream_implementation
+#include "bitstream.h"
+
+#define checksum_implementation
+#include "checksum.h"
+
+#define filter_implementation
+#include "filter.h"
+
+#define huffman_implementation
+#include "huffman.h"
+
+#define file_implementation
+#include "file.h"
+
+#define ring_implementation
+#include "ring.h"
+
+#define squeeze_implementation
+#include "squeeze.h"
@@ -5,9 +5,42 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <threads.h>
+#include "file.h"
+
+#if !defined(_MSC_VER) && !defined(__STDC_LIB_EXT1__)
+typedef int errno_t; // C11 Annex K, Microsoft CRT has it
+#endif
+
+// Asynchronous file I/O: the coder fills (or drains) one buffer while
+// a background thread writes (or reads ahead into) the other one, so
+// file I/O overlaps with coding and goes to the file in large calls
+// instead of a call per 8 bytes.
+
+enum { bitstream_io_buffer = 1024 * 1024 }; // default bytes of a buffer
+
+typedef struct {
+    FILE*    file;
+    uint8_t* buffer[2];
+    size_t   capacity;  // bytes of each buffer, multiple of 8
+    size_t   filled[2]; // bytes in the buffer
+    bool     full[2];   // written by the coder or read ahead by the thread
+    int32_t  current;   // buffer of the coder
+    size_t   at;        // coder position in the current buffer
+    bool     held;      // reader: coder holds the current buffer
+    bool     writer;
+    bool     eof;       // reader thread reached the end of the file
+    bool     quit;
+    errno_t  error;     // of the thread
+    mtx_t    lock;
+    cnd_t    changed;
+    thrd_t   thread;
+} bitstream_io_type;
+
+// Writer without file and data (a sink) only counts bytes written.
 
 typedef struct bitstream_struct {
-    FILE*    file; // file and (data,capacity) is exclusive
+    FILE*    file; // file, (data,capacity) and io are exclusive
     uint8_t* data;
     uint64_t capacity; // data[capacity]
     uint64_t bytes; // number of bytes written
@@ -15,6 +48,7 @@ typedef struct bitstream_struct {
     uint64_t b64;   // bit shifting buffer
     int32_t  bits;  // bit count inside b64
     errno_t  error; // sticky error
+    bitstream_io_type* io; // see open()
 } bitstream_type;
 
 typedef struct {
@@ -25,6 +59,15 @@ typedef struct {
     uint64_t (*read_bits)(bitstream_type* bs, int32_t bits);
     void     (*flush)(bitstream_type* bs); // write trailing zeros
     void     (*dispose)(bitstream_type* bs);
+    // open() starts asynchronous I/O of the `file` through `io` with two
+    // buffers of `capacity` bytes (0: bitstream_io_buffer). The reader
+    // reads ahead of the coder. close() writes the rest (after flush()),
+    // stops the thread and frees the buffers, the file stays open.
+    // Reader close() seeks back over the bytes read ahead but not
+    // consumed: the file is left right after the last word read.
+    errno_t  (*open)(bitstream_type* bs, bitstream_io_type* io, FILE* file,
+                     bool writer, size_t capacity);
+    errno_t  (*close)(bitstream_type* bs);
 } bitstream_interface;
 
 extern bitstream_interface bitstream;
@@ -35,81 +78,219 @@ extern bitstream_interface bitstream;
 
 #define bitstream_implemented
 
-static void bitstream_write_bit(bitstream_type* bs, int32_t bit) {
-    if (bs->error == 0) {
-        bs->b64 <<= 1;
-        bs->b64 |= (bit & 1);
-        bs->bits++;
-        if (bs->bits == 64) {
-            if (bs->data != null && bs->capacity > 0) {
-                assert(bs->file == null);
-                for (int i = 0; i < 8 && bs->error == 0; i++) {
-                    if (bs->bytes == bs->capacity) {
-                        bs->error = E2BIG;
-                    } else {
-                        uint8_t b = (uint8_t)(bs->b64 >> ((7 - i) * 8));
-                        bs->data[bs->bytes++] = b;
-                    }
-                }
-            } else {
-                assert(bs->data == null && bs->capacity == 0);
-                size_t written = fwrite(&bs->b64, 1, 8, bs->file);
-                bs->error = written == 8 ? 0 : errno;
-                if (bs->error == 0) { bs->bytes += 8; }
+#include <stdlib.h>
+#include <string.h>
+
+// Bits are accumulated in b64 starting from the least significant bit
+// and serialized as 8 little-endian bytes per 64 bit word. Writing or
+// reading up to 64 bits at once takes at most one word exchange.
+
+// Buffer k of asynchronous I/O belongs to the thread while it is full
+// (writer) or empty (reader) and to the coder otherwise.
+
+static int bitstream_io_thread(void* p) {
+    bitstream_io_type* io = (bitstream_io_type*)p;
+    int32_t k = 0;
+    mtx_lock(&io->lock);
+    for (;;) {
+        while (!io->quit && io->full[k] != io->writer) {
+            cnd_wait(&io->changed, &io->lock);
+        }
+        if (io->quit) { break; }
+        mtx_unlock(&io->lock);
+        size_t n = 0;
+        errno_t r = 0;
+        if (io->writer) {
+            n = fwrite(io->buffer[k], 1, io->filled[k], io->file);
+            if (n != io->filled[k]) { r = errno != 0 ? errno : EIO; }
+        } else {
+            n = fread(io->buffer[k], 1, io->capacity, io->file);
+            if (n != io->capacity && ferror(io->file)) {
+                r = errno != 0 ? errno : EIO;
+            }
+        }
+        mtx_lock(&io->lock);
+        if (r != 0) { io->error = r; }
+        io->full[k] = !io->writer;
+        io->filled[k] = io->writer ? 0 : n;
+        if (!io->writer && n < io->capacity) { io->eof = true; }
+        cnd_broadcast(&io->changed);
+        if (r != 0 || io->eof) { break; }
+        k ^= 1;
+    }
+    mtx_unlock(&io->lock);
+    return 0;
+}
+
+// hands the current buffer to the thread and waits for the other one
+
+static void bitstream_io_next(bitstream_type* bs) {
+    bitstream_io_type* io = bs->io;
+    mtx_lock(&io->lock);
+    if (io->writer) {
+        io->filled[io->current] = io->at;
+        io->full[io->current] = true;
+        io->current ^= 1;
+    } else if (io->held) { // consumed
+        io->full[io->current] = false;
+        io->current ^= 1;
+    }
+    io->at = 0;
+    cnd_broadcast(&io->changed);
+    const int32_t k = io->current;
+    while (io->error == 0 && io->full[k] == io->writer &&
+           !(io->eof && !io->writer)) {
+        cnd_wait(&io->changed, &io->lock);
+    }
+    io->held = io->full[k];
+    if (io->error != 0) {
+        bs->error = io->error;
+    } else if (!io->writer && !io->full[k]) {
+        bs->error = E2BIG; // unexpected end of file
+    }
+    mtx_unlock(&io->lock);
+}
+
+static void bitstream_io_write(bitstream_type* bs, uint64_t b64) {
+    bitstream_io_type* io = bs->io;
+    uint8_t* p = io->buffer[io->current] + io->at;
+    for (int i = 0; i < 8; i++) { p[i] = (uint8_t)(b64 >> (i * 8)); }
+    io->at += 8;
+    bs->bytes += 8;
+    if (io->at == io->capacity) { bitstream_io_next(bs); }
+}
+
+static uint64_t bitstream_io_read(bitstream_type* bs) {
+    bitstream_io_type* io = bs->io;
+    while (bs->error == 0 &&
+           (!io->held || io->at == io->filled[io->current])) {
+        bitstream_io_next(bs);
+    }
+    uint64_t b64 = 0;
+    if (bs->error == 0 && io->filled[io->current] - io->at < 8) {
+        bs->error = E2BIG;
+    } else if (bs->error == 0) {
+        const uint8_t* p = io->buffer[io->current] + io->at;
+        for (int i = 0; i < 8; i++) { b64 |= (uint64_t)p[i] << (i * 8); }
+        io->at += 8;
+        bs->read += 8;
+    }
+    return b64;
+}
+
+static void bitstream_write_word(bitstream_type* bs, uint64_t b64) {
+    if (bs->io != null) {
+        bitstream_io_write(bs, b64);
+    } else if (bs->data != null && bs->capacity > 0) {
+        assert(bs->file == null);
+        if (bs->capacity - bs->bytes < 8) {
+            bs->error = E2BIG;
+        } else {
+            for (int i = 0; i < 8; i++) {
+                bs->data[bs->bytes++] = (uint8_t)(b64 >> (i * 8));
             }
-            bs->bits = 0;
-            bs->b64 = 0;
         }
+    } else if (bs->file == null) {
+        assert(bs->data == null && bs->capacity == 0);
+        bs->bytes += 8; // sink
+    } else {
+        assert(bs->data == null && bs->capacity == 0);
+        uint8_t le[8]; // little-endian independent of host byte order
+        for (int i = 0; i < 8; i++) { le[i] = (uint8_t)(b64 >> (i * 8)); }
+        size_t written = fwrite(le, 1, 8, bs->file);
+        bs->error = written == 8 ? 0 : errno;
+        if (bs->error == 0) { bs->bytes += 8; }
     }
 }
 
 static void bitstream_write_bits(bitstream_type* bs, uint64_t data,
                                  int32_t bits) {
     assert(0 < bits && bits <= 64);
-    while (bits > 0 && bs->error == 0) {
-        bitstream_write_bit(bs, data & 1);
-        bits--;
-        data >>= 1;
+    assert(0 <= bs->bits && bs->bits < 64);
+    if (bs->error == 0) {
+        if (bits < 64) { data &= (1ULL << bits) - 1; }
+        bs->b64 |= data << bs->bits;
+        const int32_t room = 64 - bs->bits;
+        if (bits < room) {
+            bs->bits += bits;
+        } else {
+            bitstream_write_word(bs, bs->b64);
+            bs->b64 = bits == room ? 0 : data >> room;
+            bs->bits = bits - room;
+        }
+    }
+}
+
+static void bitstream_write_bit(bitstream_type* bs, int32_t bit) {
+    bitstream_write_bits(bs, (uint64_t)(bit & 1), 1);
+}
+
+static uint64_t bitstream_read_word(bitstream_type* bs) {
+    uint64_t b64 = 0;
+    if (bs->io != null) {
+        b64 = bitstream_io_read(bs);
+    } else if (bs->data != null && bs->bytes > 0) {
+        assert(bs->file == null);
+        if (bs->bytes - bs->read < 8) {
+            bs->error = E2BIG;
+        } else {
+            for (int i = 0; i < 8; i++) {
+                const uint64_t byte = (bs->data[bs->read] & 0xFF);
+                b64 |= byte << (i * 8);
+                bs->read++;
+            }
+        }
+    } else {
+        assert(bs->data == null && bs->bytes == 0);
+        uint8_t le[8];
+        size_t read = fread(le, 1, 8, bs->file);
+        if (read == 8) {
+            for (int i = 0; i < 8; i++) { b64 |= (uint64_t)le[i] << (i * 8); }
+            bs->read += 8;
+        } else {
+            bs->error = errno != 0 ? errno : E2BIG; // E2BIG: unexpected EOF
+        }
     }
+    return b64;
 }
 
 static bool bitstream_read_bit(bitstream_type* bs) {
     bool bit = false;
     if (bs->error == 0) {
         if (bs->bits == 0) {
-            bs->b64 = 0;
-            if (bs->data != null && bs->bytes > 0) {
-                assert(bs->file == null);
-                for (int i = 0; i < 8 && bs->error == 0; i++) {
-                    if (bs->read == bs->bytes) {
-                        bs->error = E2BIG;
-                    } else {
-                        const uint64_t byte = (bs->data[bs->read] & 0xFF);
-                        bs->b64 |= byte << ((7 - i) * 8);
-                        bs->read++;
-                    }
-                }
-            } else {
-                assert(bs->data == null && bs->bytes == 0);
-                size_t read = fread(&bs->b64, 1, 8, bs->file);
-                bs->error = read == 8 ? 0 : errno;
-                if (bs->error == 0) { bs->read += 8; }
-            }
+            bs->b64 = bitstream_read_word(bs);
+            if (bs->error != 0) { return false; }
             bs->bits = 64;
         }
-        bit = ((int64_t)bs->b64) < 0; // same as (bs->b64 >> 63) & 1;
-        bs->b64 <<= 1;
+        bit = (bs->b64 & 1) != 0;
+        bs->b64 >>= 1;
         bs->bits--;
     }
     return bit;
 }
 
 static uint64_t bitstream_read_bits(bitstream_type* bs, int32_t bits) {
-    uint64_t data = 0;
     assert(0 < bits && bits <= 64);
-    for (int32_t b = 0; b < bits && bs->error == 0; b++) {
-        bool bit = bitstream_read_bit(bs);
-        if (bit) { data |= ((uint64_t)bit) << b; }
+    assert(0 <= bs->bits && bs->bits <= 64);
+    uint64_t data = 0;
+    if (bs->error == 0) {
+        if (bits <= bs->bits) {
+            data = bits == 64 ? bs->b64 : bs->b64 & ((1ULL << bits) - 1);
+            bs->b64 = bits == 64 ? 0 : bs->b64 >> bits;
+            bs->bits -= bits;
+        } else {
+            const int32_t have = bs->bits; // [0..63] remaining bits
+            data = bs->b64;
+            bs->b64 = bitstream_read_word(bs);
+            if (bs->error == 0) {
+                const int32_t need = bits - have; // [1..64]
+                const uint64_t next = need == 64 ?
+                    bs->b64 : bs->b64 & ((1ULL << need) - 1);
+                data |= next << have;
+                bs->b64 = need == 64 ? 0 : bs->b64 >> need;
+                bs->bits = 64 - need;
+            }
+        }
     }
     return data;
 }
@@ -122,7 +303,72 @@ static void bitstream_create(bitstream_type* bs, void* data, size_t capacity) {
 }
 
 static void bitstream_flush(bitstream_type* bs) {
-    while (bs->bits > 0 && bs->error == 0) { bitstream_write_bit(bs, 0); }
+    if (bs->bits > 0 && bs->error == 0) {
+        bitstream_write_bits(bs, 0, 64 - bs->bits);
+    }
+}
+
+static errno_t bitstream_open(bitstream_type* bs, bitstream_io_type* io,
+                              FILE* file, bool writer, size_t capacity) {
+    if (capacity == 0) { capacity = bitstream_io_buffer; }
+    if (file == null || capacity % 8 != 0) { return EINVAL; }
+    memset(bs, 0x00, sizeof(*bs));
+    memset(io, 0x00, sizeof(*io));
+    io->file = file;
+    io->capacity = capacity;
+    io->writer = writer;
+    io->buffer[0] = (uint8_t*)malloc(capacity * 2);
+    if (io->buffer[0] == null) { return ENOMEM; }
+    io->buffer[1] = io->buffer[0] + capacity;
+    errno_t r = 0;
+    const bool locked = mtx_init(&io->lock, mtx_plain) == thrd_success;
+    const bool signal = cnd_init(&io->changed) == thrd_success;
+    if (!locked || !signal ||
+        thrd_create(&io->thread, bitstream_io_thread, io) != thrd_success) {
+        if (locked) { mtx_destroy(&io->lock); }
+        if (signal) { cnd_destroy(&io->changed); }
+        free(io->buffer[0]);
+        memset(io, 0x00, sizeof(*io));
+        r = ENOMEM;
+    } else {
+        bs->io = io;
+    }
+    return r;
+}
+
+static errno_t bitstream_close(bitstream_type* bs) {
+    bitstream_io_type* io = bs->io;
+    if (io == null) { return EINVAL; }
+    mtx_lock(&io->lock);
+    if (io->writer && io->at > 0 && io->error == 0) { // the rest
+        io->filled[io->current] = io->at;
+        io->full[io->current] = true;
+        cnd_broadcast(&io->changed);
+    }
+    while (io->writer && io->error == 0 && (io->full[0] || io->full[1])) {
+        cnd_wait(&io->changed, &io->lock);
+    }
+    io->quit = true;
+    cnd_broadcast(&io->changed);
+    mtx_unlock(&io->lock);
+    thrd_join(io->thread, null);
+    errno_t r = io->error;
+    if (r == 0 && io->writer && fflush(io->file) != 0) { r = errno; }
+    if (r == 0 && !io->writer) { // give back the read ahead
+        int64_t ahead = 0;
+        for (int32_t k = 0; k < 2; k++) {
+            if (io->full[k]) { ahead += (int64_t)io->filled[k]; }
+        }
+        if (io->held) { ahead -= (int64_t)io->at; }
+        if (ahead > 0) { r = file.seek(io->file, -ahead, SEEK_CUR); }
+    }
+    if (bs->error == 0) { bs->error = r; }
+    mtx_destroy(&io->lock);
+    cnd_destroy(&io->changed);
+    free(io->buffer[0]);
+    memset(io, 0x00, sizeof(*io));
+    bs->io = null;
+    return bs->error;
 }
 
 static void bitstream_dispose(bitstream_type* bs) {
@@ -130,13 +376,15 @@ static void bitstream_dispose(bitstream_type* bs) {
 }
 
 bitstream_interface bitstream = {
-    .create     = bitstream_create,
-    .write_bit  = bitstream_write_bit,
-    .write_bits = bitstream_write_bits,
-    .read_bit   = bitstream_read_bit,
-    .read_bits  = bitstream_read_bits,
-    .flush      = bitstream_flush,
-    .dispose    = bitstream_dispose
+    .create        = bitstream_create,
+    .write_bit     = bitstream_write_bit,
+    .write_bits    = bitstream_write_bits,
+    .read_bit      = bitstream_read_bit,
+    .read_bits     = bitstream_read_bits,
+    .flush         = bitstream_flush,
+    .dispose       = bitstream_dispose,
+    .open          = bitstream_open,
+    .close         = bitstream_close
 };
 
 #endif // bitstream_implementation
\ No newline at end of file
@@ -0,0 +1,316 @@
+#ifndef checksum_header_included
+#define checksum_header_included
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli polynomial 0x1EDC6F41, reflected 0x82F63B78) as used
+// by iSCSI, ext4 and SSE4.2/ARMv8 crc32c instructions. Hardware
+// instructions are used when available, otherwise slicing-by-8 tables.
+// crc32c(0, "123456789", 9) == 0xE3069283
+// SHA-256 (FIPS 180-4) names content where collisions must not happen
+// (deduplication), "abc" digest starts with 0xBA 0x78 0x16 0xBF.
+
+enum { checksum_sha256_bytes = 32 };
+
+typedef struct {
+    // `crc` is 0 or the result for the preceding data
+    uint32_t (*crc32c)(uint32_t crc, const void* data, size_t bytes);
+    // combine() returns crc32c() of A followed by B from crc32c() of A
+    // and B and the length of B without reading the data
+    uint32_t (*combine)(uint32_t a, uint32_t b, uint64_t bytes);
+    void (*sha256)(const void* data, size_t bytes,
+                   uint8_t digest[checksum_sha256_bytes]);
+} checksum_interface;
+
+extern checksum_interface checksum;
+
+#endif // checksum_header_included
+
+#if defined(checksum_implementation) && !defined(checksum_implemented)
+
+#define checksum_implemented
+
+#include <stdbool.h>
+#include <string.h>
+#include <threads.h>
+
+#if defined(__SSE4_2__) || defined(__AVX__)
+#include <nmmintrin.h>
+#define checksum_sse42
+#elif (defined(__x86_64__) || defined(__i386__)) && \
+      (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define checksum_sse42_dispatch // compiled for SSE4.2, used if cpu has it
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+#include <intrin.h> // __cpuid()
+#include <nmmintrin.h>
+#define checksum_sse42_dispatch
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define checksum_arm64
+#endif
+
+#if !defined(checksum_sse42) && !defined(checksum_arm64)
+
+enum { checksum_polynomial = 0x82F63B78 }; // reflected
+
+static uint32_t checksum_table[8][256];
+
+static once_flag checksum_once = ONCE_FLAG_INIT;
+
+static void checksum_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int32_t k = 0; k < 8; k++) {
+            c = (c >> 1) ^ ((c & 1) ? checksum_polynomial : 0);
+        }
+        checksum_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = checksum_table[0][i];
+        for (int32_t k = 1; k < 8; k++) {
+            c = (c >> 8) ^ checksum_table[0][c & 0xFF];
+            checksum_table[k][i] = c;
+        }
+    }
+}
+
+static uint32_t checksum_slicing_by_8(uint32_t crc, const uint8_t* p,
+                                      size_t bytes) {
+    call_once(&checksum_once, checksum_init_table);
+    uint32_t c = ~crc;
+    while (bytes > 0 && ((uintptr_t)p & 7) != 0) {
+        c = (c >> 8) ^ checksum_table[0][(c ^ *p++) & 0xFF];
+        bytes--;
+    }
+    while (bytes >= 8) {
+        // little endian words: bytes in the order of the loop above
+        const uint32_t lo = c ^ ((uint32_t)p[0]        | (uint32_t)p[1] <<  8 |
+                                 (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        const uint32_t hi =      (uint32_t)p[4]        | (uint32_t)p[5] <<  8 |
+                                 (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        c = checksum_table[7][ lo        & 0xFF] ^
+            checksum_table[6][(lo >>  8) & 0xFF] ^
+            checksum_table[5][(lo >> 16) & 0xFF] ^
+            checksum_table[4][ lo >> 24        ] ^
+            checksum_table[3][ hi        & 0xFF] ^
+            checksum_table[2][(hi >>  8) & 0xFF] ^
+            checksum_table[1][(hi >> 16) & 0xFF] ^
+            checksum_table[0][ hi >> 24        ];
+        p += 8;
+        bytes -= 8;
+    }
+    while (bytes > 0) {
+        c = (c >> 8) ^ checksum_table[0][(c ^ *p++) & 0xFF];
+        bytes--;
+    }
+    return ~c;
+}
+
+#endif
+
+#if defined(checksum_sse42) || defined(checksum_sse42_dispatch)
+
+#if defined(checksum_sse42_dispatch) && \
+    (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t checksum_crc32c_sse42(uint32_t crc, const uint8_t* p,
+                                      size_t bytes) {
+    uint32_t c = ~crc;
+    while (bytes > 0 && ((uintptr_t)p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        bytes--;
+    }
+    #if defined(__x86_64__) || defined(_M_X64) || defined(_M_AMD64)
+        uint64_t c64 = c;
+        while (bytes >= 8) {
+            uint64_t w;
+            memcpy(&w, p, sizeof(w));
+            c64 = _mm_crc32_u64(c64, w);
+            p += 8;
+            bytes -= 8;
+        }
+        c = (uint32_t)c64;
+    #endif
+    while (bytes >= 4) {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        c = _mm_crc32_u32(c, w);
+        p += 4;
+        bytes -= 4;
+    }
+    while (bytes > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        bytes--;
+    }
+    return ~c;
+}
+
+#endif
+
+#if defined(checksum_sse42_dispatch)
+
+static once_flag checksum_probe_once = ONCE_FLAG_INIT;
+
+static bool checksum_has_sse42; // written once by checksum_probe()
+
+static void checksum_probe(void) {
+    #if defined(_MSC_VER) && !defined(__clang__)
+        int info[4] = {0};
+        __cpuid(info, 1);
+        checksum_has_sse42 = (info[2] & (1 << 20)) != 0; // ECX bit 20
+    #else
+        checksum_has_sse42 = __builtin_cpu_supports("sse4.2") != 0;
+    #endif
+}
+
+#endif
+
+#if defined(checksum_arm64)
+
+static uint32_t checksum_crc32c_arm64(uint32_t crc, const uint8_t* p,
+                                      size_t bytes) {
+    uint32_t c = ~crc;
+    while (bytes >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c = __crc32cd(c, w);
+        p += 8;
+        bytes -= 8;
+    }
+    while (bytes > 0) {
+        c = __crc32cb(c, *p++);
+        bytes--;
+    }
+    return ~c;
+}
+
+#endif
+
+static uint32_t checksum_crc32c(uint32_t crc, const void* data, size_t bytes) {
+    const uint8_t* p = (const uint8_t*)data;
+    #if defined(checksum_sse42)
+        return checksum_crc32c_sse42(crc, p, bytes);
+    #elif defined(checksum_sse42_dispatch)
+        call_once(&checksum_probe_once, checksum_probe);
+        return checksum_has_sse42 ? checksum_crc32c_sse42(crc, p, bytes) :
+                                    checksum_slicing_by_8(crc, p, bytes);
+    #elif defined(checksum_arm64)
+        return checksum_crc32c_arm64(crc, p, bytes);
+    #else
+        return checksum_slicing_by_8(crc, p, bytes);
+    #endif
+}
+
+// Polynomial product modulo the CRC polynomial in reflected bit order
+// (bit 31 is x^0), as crc32_combine() of zlib does it
+
+static uint32_t checksum_multiply(uint32_t a, uint32_t b) {
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) { break; }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82F63B78 : b >> 1;
+    }
+    return p;
+}
+
+static uint32_t checksum_combine(uint32_t a, uint32_t b, uint64_t bytes) {
+    uint32_t p = 1U << 31;  // x^0
+    uint32_t x = 1U << 23;  // x^8 (one byte of zeros)
+    while (bytes > 0) {     // p = x^(8 * bytes)
+        if (bytes & 1) { p = checksum_multiply(x, p); }
+        x = checksum_multiply(x, x);
+        bytes >>= 1;
+    }
+    return checksum_multiply(p, a) ^ b;
+}
+
+static const uint32_t checksum_sha256_k[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+    0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+    0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+    0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+    0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+    0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#define checksum_ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void checksum_sha256_block(uint32_t h[8], const uint8_t* p) {
+    uint32_t w[64];
+    for (int32_t i = 0; i < 16; i++) { // big endian words
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+    }
+    for (int32_t i = 16; i < 64; i++) {
+        const uint32_t s0 = checksum_ror(w[i - 15], 7) ^
+                            checksum_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const uint32_t s1 = checksum_ror(w[i - 2], 17) ^
+                            checksum_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int32_t i = 0; i < 64; i++) {
+        const uint32_t s1 = checksum_ror(e, 6) ^ checksum_ror(e, 11) ^
+                            checksum_ror(e, 25);
+        const uint32_t t1 = k + s1 + ((e & f) ^ (~e & g)) +
+                            checksum_sha256_k[i] + w[i];
+        const uint32_t s0 = checksum_ror(a, 2) ^ checksum_ror(a, 13) ^
+                            checksum_ror(a, 22);
+        const uint32_t t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void checksum_sha256(const void* data, size_t bytes,
+                            uint8_t digest[checksum_sha256_bytes]) {
+    uint32_t h[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    const uint8_t* p = (const uint8_t*)data;
+    size_t n = bytes;
+    while (n >= 64) { checksum_sha256_block(h, p); p += 64; n -= 64; }
+    uint8_t tail[128] = {0}; // rest, 0x80, zeros and 64 bit length in bits
+    memcpy(tail, p, n);
+    tail[n] = 0x80;
+    const size_t end = n < 56 ? 64 : 128;
+    const uint64_t bits = (uint64_t)bytes * 8;
+    for (int32_t i = 0; i < 8; i++) {
+        tail[end - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    checksum_sha256_block(h, tail);
+    if (end == 128) { checksum_sha256_block(h, tail + 64); }
+    for (int32_t i = 0; i < 8; i++) {
+        digest[i * 4]     = (uint8_t)(h[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)h[i];
+    }
+}
+
+#undef checksum_ror
+
+checksum_interface checksum = {
+    .crc32c  = checksum_crc32c,
+    .combine = checksum_combine,
+    .sha256  = checksum_sha256
+};
+
+#endif // checksum_implementation
@@ -0,0 +1,338 @@
+#ifndef dedup_header_included
+#define dedup_header_included
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitstream.h"
+#include "checksum.h"
+#include "file.h"
+#include "squeeze.h"
+
+// Deduplication of large chunks that repeat across files and runs far
+// beyond any window or dictionary (backups). next() cuts content defined
+// chunks with the gear rolling hash (FastCDC): a cut where the top bits
+// of the hash of the last 64 bytes are zero, stricter mask below the
+// average size and looser above it, never before min or after max bytes.
+// An insertion only moves the cuts around it.
+// Each chunk is named by its SHA-256: a chunk that is not in the `store`
+// folder yet is compressed there as a complete squeeze stream in the
+// file named by the hex digest (written to a temporary file and renamed,
+// so an interrupted run leaves no partial chunks), a known chunk is only
+// referenced. The recipe written by compress() is the total bytes,
+// dedup_magic, number of chunks and bytes + SHA-256 of each chunk.
+
+enum {
+    dedup_magic = 0x52515A53, // "SQZR"
+    dedup_min   = 16 * 1024,  // default chunk bytes
+    dedup_avg   = 64 * 1024,  // power of 2
+    dedup_max   = 256 * 1024,
+    dedup_path  = 1024        // chunk file name capacity
+};
+
+typedef struct {
+    const char* store; // folder of chunks
+    uint32_t min;      // chunk bytes, 0: defaults
+    uint32_t avg;
+    uint32_t max;
+    uint8_t  win_bits; // parameters of compressed chunks
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    uint16_t flags;
+    // statistics accumulate over compress() calls
+    uint64_t bytes;      // of input
+    uint64_t chunks;
+    uint64_t duplicates; // chunks found in the store
+    uint64_t unique;     // bytes of chunks compressed
+    uint64_t written;    // bytes written into the store
+    // context reused for all chunks
+    squeeze_type* s;
+    uint8_t  bits[3];    // win_bits, map_bits, len_bits of `s`
+} dedup_type;
+
+typedef struct {
+    // next() returns bytes of the chunk starting at data[0]
+    size_t  (*next)(const dedup_type* d, const uint8_t* data, size_t bytes);
+    errno_t (*compress)(dedup_type* d, bitstream_type* bs,
+                        const uint8_t* data, size_t bytes);
+    errno_t (*read_header)(bitstream_type* bs, uint64_t *bytes,
+                           uint64_t *chunks);
+    // chunk() reads the next entry of the recipe
+    errno_t (*chunk)(bitstream_type* bs, uint32_t *bytes,
+                     uint8_t hash[checksum_sha256_bytes]);
+    // path() of the chunk file in the store
+    errno_t (*path)(const dedup_type* d,
+                    const uint8_t hash[checksum_sha256_bytes],
+                    char* path, size_t capacity);
+    // decompress() reads `chunks` entries after read_header() and
+    // verifies SHA-256 of each chunk (EBADMSG if it does not match)
+    errno_t (*decompress)(dedup_type* d, bitstream_type* bs, uint64_t chunks,
+                          uint8_t* data, size_t bytes);
+    void    (*dispose)(dedup_type* d); // deletes the context
+} dedup_interface;
+
+extern dedup_interface dedup;
+
+#endif // dedup_header_included
+
+#if defined(dedup_implementation) && !defined(dedup_implemented)
+
+#define dedup_implemented
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#ifndef assert
+#include <assert.h>
+#endif
+
+#ifndef null
+#define null ((void*)0)
+#endif
+
+static uint64_t dedup_gear[256];
+
+static once_flag dedup_once = ONCE_FLAG_INIT;
+
+static void dedup_init_gear(void) { // splitmix64: same table everywhere
+    uint64_t x = 0x535A5153;
+    for (int32_t i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        dedup_gear[i] = z ^ (z >> 31);
+    }
+}
+
+static void dedup_sizes(const dedup_type* d, size_t *min, size_t *avg,
+                        size_t *max) {
+    *min = d->min > 0 ? d->min : dedup_min;
+    *avg = d->avg > 0 ? d->avg : dedup_avg;
+    *max = d->max > 0 ? d->max : dedup_max;
+}
+
+static size_t dedup_next(const dedup_type* d, const uint8_t* data,
+                         size_t bytes) {
+    call_once(&dedup_once, dedup_init_gear);
+    size_t min = 0, avg = 0, max = 0;
+    dedup_sizes(d, &min, &avg, &max);
+    assert(0 < min && min < avg && avg < max);
+    if (bytes <= min) { return bytes; }
+    const size_t n = bytes < max ? bytes : max;
+    const size_t normal = avg < n ? avg : n;
+    int32_t bits = 0;
+    while (((size_t)2 << bits) <= avg) { bits++; }
+    const uint64_t strict = ~0ULL << (64 - (bits + 1));
+    const uint64_t loose  = ~0ULL << (64 - (bits - 1));
+    uint64_t fp = 0;
+    size_t i = min;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + dedup_gear[data[i]];
+        if ((fp & strict) == 0) { return i + 1; }
+    }
+    for (; i < n; i++) {
+        fp = (fp << 1) + dedup_gear[data[i]];
+        if ((fp & loose) == 0) { return i + 1; }
+    }
+    return n;
+}
+
+static errno_t dedup_path_of(const dedup_type* d,
+                             const uint8_t hash[checksum_sha256_bytes],
+                             char* path, size_t capacity) {
+    static const char* hex = "0123456789abcdef";
+    char name[checksum_sha256_bytes * 2 + 1];
+    for (int32_t i = 0; i < checksum_sha256_bytes; i++) {
+        name[i * 2]     = hex[hash[i] >> 4];
+        name[i * 2 + 1] = hex[hash[i] & 0xF];
+    }
+    name[checksum_sha256_bytes * 2] = 0;
+    const int n = snprintf(path, capacity, "%s/%s", d->store, name);
+    return n > 0 && (size_t)n < capacity ? 0 : E2BIG;
+}
+
+// context of `bits` ready for the next chunk
+
+static errno_t dedup_context(dedup_type* d, const uint8_t bits[3]) {
+    if (d->s != null && memcmp(d->bits, bits, 3) == 0) {
+        squeeze.clear(d->s);
+        return 0;
+    }
+    if (d->s != null) { squeeze.delete(d->s); }
+    d->s = squeeze.new(null, bits[0], bits[1], bits[2], 0);
+    memcpy(d->bits, bits, 3);
+    return d->s != null ? 0 : ENOMEM;
+}
+
+static errno_t dedup_store(dedup_type* d, const char* path,
+                           const uint8_t* data, size_t bytes) {
+    const uint8_t bits[3] = { d->win_bits, d->map_bits, d->len_bits };
+    char temporary[dedup_path + 8];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    errno_t r = dedup_context(d, bits);
+    FILE* f = null;
+    if (r == 0) { r = fopen_s(&f, temporary, "wb"); }
+    if (r == 0 && f == null) { r = EIO; }
+    if (r == 0) {
+        bitstream_type bs = { .file = f };
+        squeeze.write_header(&bs, bytes, bits[0], bits[1], bits[2],
+                             d->flags, 0);
+        d->s->bs = &bs;
+        d->s->flags = d->flags;
+        if (bs.error == 0) { squeeze.compress(d->s, data, bytes); }
+        r = bs.error != 0 ? bs.error : d->s->error;
+        d->s->bs = null;
+        if (fclose(f) != 0 && r == 0) { r = errno; }
+        if (r == 0) { d->written += bs.bytes; }
+        // rename() fails on Windows when another run stored it meanwhile
+        if (r == 0 && rename(temporary, path) != 0 && !file.exist(path)) {
+            r = errno;
+        }
+        if (r != 0 || file.exist(temporary)) { (void)remove(temporary); }
+    }
+    return r;
+}
+
+static errno_t dedup_compress(dedup_type* d, bitstream_type* bs,
+                              const uint8_t* data, size_t bytes) {
+    size_t min = 0, avg = 0, max = 0;
+    dedup_sizes(d, &min, &avg, &max);
+    if (d->store == null || min >= avg || avg >= max ||
+        (avg & (avg - 1)) != 0 || max > UINT32_MAX ||
+        (d->flags & squeeze_flag_dictionary)) {
+        return EINVAL;
+    }
+    // cuts first: the number of chunks precedes the entries. Every chunk
+    // but the last is at least `min` bytes, which bounds their number.
+    uint32_t* cut = (uint32_t*)malloc((bytes / min + 1) * sizeof(uint32_t));
+    if (cut == null) { return ENOMEM; }
+    size_t n = 0;
+    for (size_t at = 0; at < bytes; at += cut[n], n++) {
+        cut[n] = (uint32_t)dedup_next(d, data + at, bytes - at);
+    }
+    bitstream.write_bits(bs, bytes, 64);
+    bitstream.write_bits(bs, dedup_magic, 32);
+    bitstream.write_bits(bs, n, 32);
+    errno_t r = bs->error;
+    size_t i = 0;
+    for (size_t c = 0; c < n && r == 0; c++) {
+        const size_t k = cut[c];
+        uint8_t hash[checksum_sha256_bytes];
+        checksum.sha256(data + i, k, hash);
+        char path[dedup_path];
+        r = dedup_path_of(d, hash, path, sizeof(path));
+        if (r == 0 && file.exist(path)) {
+            d->duplicates++;
+        } else if (r == 0) {
+            r = dedup_store(d, path, data + i, k);
+            d->unique += k;
+        }
+        bitstream.write_bits(bs, k, 32);
+        for (int32_t j = 0; j < checksum_sha256_bytes; j += 8) {
+            uint64_t word = 0; // little endian: bytes keep their order
+            for (int32_t b = 0; b < 8; b++) {
+                word |= (uint64_t)hash[j + b] << (b * 8);
+            }
+            bitstream.write_bits(bs, word, 64);
+        }
+        if (r == 0) { r = bs->error; }
+        d->chunks++;
+        i += k;
+    }
+    free(cut);
+    if (r == 0) {
+        bitstream.flush(bs);
+        r = bs->error;
+    }
+    d->bytes += bytes;
+    return r;
+}
+
+static errno_t dedup_read_header(bitstream_type* bs, uint64_t *bytes,
+                                 uint64_t *chunks) {
+    *bytes = bitstream.read_bits(bs, 64);
+    const uint64_t magic = bitstream.read_bits(bs, 32);
+    *chunks = bitstream.read_bits(bs, 32);
+    if (bs->error != 0) { return bs->error; }
+    return magic == dedup_magic ? 0 : EINVAL;
+}
+
+static errno_t dedup_chunk(bitstream_type* bs, uint32_t *bytes,
+                           uint8_t hash[checksum_sha256_bytes]) {
+    *bytes = (uint32_t)bitstream.read_bits(bs, 32);
+    for (int32_t j = 0; j < checksum_sha256_bytes; j += 8) {
+        const uint64_t word = bitstream.read_bits(bs, 64);
+        for (int32_t b = 0; b < 8; b++) {
+            hash[j + b] = (uint8_t)(word >> (b * 8));
+        }
+    }
+    return bs->error;
+}
+
+static errno_t dedup_load(dedup_type* d, const char* path, uint8_t* data,
+                          size_t bytes) {
+    uint8_t* stream = null;
+    size_t size = 0;
+    errno_t r = file.read_fully(path, &stream, &size);
+    if (r != 0) { return r; }
+    bitstream_type bs = { .data = stream, .bytes = size };
+    uint64_t n = 0;
+    uint8_t bits[3] = {0};
+    uint16_t flags = 0;
+    uint32_t id = 0;
+    squeeze.read_header(&bs, &n, &bits[0], &bits[1], &bits[2], &flags, &id);
+    r = bs.error != 0 ? bs.error :
+        (n != bytes || (flags & squeeze_flag_dictionary) ? EINVAL : 0);
+    if (r == 0) { r = dedup_context(d, bits); }
+    if (r == 0) {
+        d->s->bs = &bs;
+        d->s->flags = flags;
+        squeeze.decompress(d->s, data, bytes);
+        r = d->s->error;
+        d->s->bs = null;
+    }
+    free(stream);
+    return r;
+}
+
+static errno_t dedup_decompress(dedup_type* d, bitstream_type* bs,
+                                uint64_t chunks, uint8_t* data, size_t bytes) {
+    errno_t r = d->store == null ? EINVAL : 0;
+    size_t i = 0;
+    for (uint64_t c = 0; c < chunks && r == 0; c++) {
+        uint32_t k = 0;
+        uint8_t hash[checksum_sha256_bytes];
+        r = dedup_chunk(bs, &k, hash);
+        if (r == 0 && k > bytes - i) { r = EINVAL; }
+        char path[dedup_path];
+        if (r == 0) { r = dedup_path_of(d, hash, path, sizeof(path)); }
+        if (r == 0) { r = dedup_load(d, path, data + i, k); }
+        if (r == 0) {
+            uint8_t check[checksum_sha256_bytes];
+            checksum.sha256(data + i, k, check);
+            if (memcmp(check, hash, sizeof(check)) != 0) { r = EBADMSG; }
+        }
+        i += k;
+    }
+    if (r == 0 && i != bytes) { r = EINVAL; }
+    return r;
+}
+
+static void dedup_dispose(dedup_type* d) {
+    if (d->s != null) { squeeze.delete(d->s); d->s = null; }
+}
+
+dedup_interface dedup = {
+    .next        = dedup_next,
+    .compress    = dedup_compress,
+    .read_header = dedup_read_header,
+    .chunk       = dedup_chunk,
+    .path        = dedup_path_of,
+    .decompress  = dedup_decompress,
+    .dispose     = dedup_dispose
+};
+
+#endif // dedup_implementation
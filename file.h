@@ -1,14 +1,29 @@
 #ifndef file_header_included
 #define file_header_included
 
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE) // fseeko(), ftello()
+#define _POSIX_C_SOURCE 200809L                     // with -std=c11
+#endif
+
 #include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+
+#if !defined(_MSC_VER) && !defined(__STDC_LIB_EXT1__)
+typedef int errno_t; // C11 Annex K, Microsoft CRT has it
+#endif
 
 typedef struct {
     errno_t (*chdir)(const char* name);
+    errno_t (*mkdir)(const char* name); // 0 if the folder already exists
+    errno_t (*rmdir)(const char* name); // empty folder
     bool    (*exist)(const char* filename);
     errno_t (*size)(FILE* f, size_t* size);
-    errno_t (*read_fully)(const char* fn, const uint8_t* *data, size_t *bytes);
+    // seek() and tell() take 64 bit positions even where long is 32 bit
+    errno_t (*seek)(FILE* f, int64_t offset, int whence);
+    errno_t (*tell)(FILE* f, int64_t* position);
+    errno_t (*read_fully)(const char* fn, uint8_t* *data, size_t *bytes);
 } file_interface;
 
 extern file_interface file;
@@ -22,9 +37,9 @@ extern file_interface file;
 #include <stdio.h>
 #include <sys/stat.h>
 #ifdef _WIN32
-#include <direct.h> // chdir
+#include <direct.h> // chdir, mkdir, rmdir
 #else
-#include <unistd.h> // chdir
+#include <unistd.h> // chdir, rmdir
 #endif
 
 #ifndef assert
@@ -40,20 +55,41 @@ static bool file_exist(const char* filename) {
     return stat(filename, &st) == 0;
 }
 
+// fpos_t is opaque (a struct in glibc) and fseek()/ftell() are limited
+// to 2GB where long is 32 bit (LLP64 Windows), hence 64 bit seek and tell
+
+static errno_t file_seek(FILE* f, int64_t offset, int whence) {
+    #ifdef _MSC_VER
+        if (_fseeki64(f, offset, whence) != 0) { return errno; }
+    #else
+        if (fseeko(f, (off_t)offset, whence) != 0) { return errno; }
+    #endif
+    return 0;
+}
+
+static errno_t file_tell(FILE* f, int64_t* position) {
+    #ifdef _MSC_VER
+        const int64_t p = _ftelli64(f);
+    #else
+        const int64_t p = (int64_t)ftello(f);
+    #endif
+    if (p < 0) { return errno; }
+    *position = p;
+    return 0;
+}
+
 static errno_t file_size(FILE* f, size_t* size) {
-    // on error returns (fpos_t)-1 and sets errno
-    fpos_t pos = 0;
-    if (fgetpos(f, &pos) != 0) { return errno; }
-    if (fseek(f, 0, SEEK_END) != 0) { return errno; }
-    fpos_t eof = 0;
-    if (fgetpos(f, &eof) != 0) { return errno; }
-    if (fseek(f, 0, SEEK_SET) != 0) { return errno; }
+    int64_t eof = 0;
+    errno_t r = file_seek(f, 0, SEEK_END);
+    if (r == 0) { r = file_tell(f, &eof); }
+    if (r == 0) { r = file_seek(f, 0, SEEK_SET); }
+    if (r != 0) { return r; }
     if ((uint64_t)eof > SIZE_MAX) { return E2BIG; }
     *size = (size_t)eof;
     return 0;
 }
 
-static errno_t read_whole_file(FILE* f, const uint8_t* *data, size_t *bytes) {
+static errno_t read_whole_file(FILE* f, uint8_t* *data, size_t *bytes) {
     size_t size = 0;
     errno_t r = file_size(f, &size);
     if (r != 0) { return r; }
@@ -66,7 +102,7 @@ static errno_t read_whole_file(FILE* f, const uint8_t* *data, size_t *bytes) {
     return 0;
 }
 
-static errno_t read_fully(const char* fn, const uint8_t* *data, size_t *bytes) {
+static errno_t read_fully(const char* fn, uint8_t* *data, size_t *bytes) {
     FILE* f = null;
     errno_t r = fopen_s(&f, fn, "rb");
     if (r != 0) {
@@ -87,10 +123,33 @@ static errno_t file_chdir(const char* name) {
     return 0;
 }
 
+static errno_t file_mkdir(const char* name) {
+    #ifdef _WIN32
+        const int r = _mkdir(name);
+    #else
+        const int r = mkdir(name, 0777);
+    #endif
+    if (r != 0 && !(errno == EEXIST && file_exist(name))) { return errno; }
+    return 0;
+}
+
+static errno_t file_rmdir(const char* name) {
+    #ifdef _WIN32
+        if (_rmdir(name) != 0) { return errno; }
+    #else
+        if (rmdir(name) != 0) { return errno; }
+    #endif
+    return 0;
+}
+
 file_interface file = {
     .chdir      = file_chdir,
+    .mkdir      = file_mkdir,
+    .rmdir      = file_rmdir,
     .exist      = file_exist,
     .size       = file_size,
+    .seek       = file_seek,
+    .tell       = file_tell,
     .read_fully = read_fully
 };
 
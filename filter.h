@@ -0,0 +1,313 @@
+#ifndef filter_header_included
+#define filter_header_included
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reversible filters applied before compression and after decompression.
+//
+// Branch-call-jump (BCJ) filters replace relative displacements of
+// x86-64 CALL/JMP rel32 and ARM64 BL imm26 with absolute targets so that
+// calls to the same function look alike to lz77 matching.
+//
+// Delta filter replaces each byte with its difference from the byte
+// `stride` [1..4] bytes before it (pixels, fixed width records) so that
+// smooth data turns into small repeating values. Differences are zigzag
+// coded (0, -1, 1, -2, 2... as 0, 1, 2, 3, 4...) to keep them below 0x80.
+
+enum {
+    filter_machine_none  = 0,
+    filter_machine_x86   = 1,
+    filter_machine_arm64 = 2
+};
+
+typedef struct {
+    // in place, `encode` false restores the data
+    void (*x86)(uint8_t* data, size_t bytes, bool encode);
+    void (*arm64)(uint8_t* data, size_t bytes, bool encode);
+    // filter_machine_* of ELF executable image or filter_machine_none
+    int32_t (*machine)(const uint8_t* data, size_t bytes);
+    void (*delta)(uint8_t* data, size_t bytes, int32_t stride, bool encode);
+    // delta stride of BMP image or the stride that makes a sample of the
+    // data much more predictable or 0 if delta filter is not advised
+    int32_t (*stride)(const uint8_t* data, size_t bytes);
+} filter_interface;
+
+extern filter_interface filter;
+
+#endif // filter_header_included
+
+#if defined(filter_implementation) && !defined(filter_implemented)
+
+#define filter_implemented
+
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define filter_sse2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define filter_neon
+#endif
+
+#ifndef assert
+#include <assert.h>
+#endif
+
+static inline uint32_t filter_load32(const uint8_t* p) {
+    return (uint32_t)p[0]         | ((uint32_t)p[1] <<  8) |
+          ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void filter_store32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >>  8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void filter_x86(uint8_t* data, size_t bytes, bool encode) {
+    // Only displacements within +/-16MB (top byte 0x00 or 0xFF) are
+    // converted modulo 2^25 and sign extended back so the top byte stays
+    // 0x00 or 0xFF and the decoder makes exactly the same decisions.
+    // All 5 bytes are skipped even when the displacement is out of range,
+    // otherwise a converted instruction inside them could change the top
+    // byte the decision depends on.
+    size_t i = 0;
+    while (i + 5 <= bytes) {
+        const uint8_t op = data[i];
+        if (op == 0xE8 || op == 0xE9) {
+            const uint8_t top = data[i + 4];
+            if (top == 0x00 || top == 0xFF) {
+                const uint32_t ip = (uint32_t)(i + 5);
+                const uint32_t v = filter_load32(data + i + 1);
+                uint32_t w = (encode ? v + ip : v - ip) & 0x01FFFFFFu;
+                if (w & 0x01000000u) { w |= 0xFE000000u; }
+                filter_store32(data + i + 1, w);
+            }
+            i += 5;
+        } else {
+            i++;
+        }
+    }
+}
+
+static void filter_arm64(uint8_t* data, size_t bytes, bool encode) {
+    for (size_t i = 0; i + 4 <= bytes; i += 4) {
+        const uint32_t instruction = filter_load32(data + i);
+        if ((instruction & 0xFC000000u) == 0x94000000u) { // BL imm26
+            const uint32_t pc = (uint32_t)(i >> 2);
+            const uint32_t imm = instruction & 0x03FFFFFFu;
+            const uint32_t v = (encode ? imm + pc : imm - pc) & 0x03FFFFFFu;
+            filter_store32(data + i, 0x94000000u | v);
+        }
+    }
+}
+
+static int32_t filter_machine(const uint8_t* data, size_t bytes) {
+    enum { em_x86_64 = 62, em_aarch64 = 183 };
+    // ELF magic, class, little endian (ELFDATA2LSB = 1), e_machine at 18
+    if (bytes >= 20 && data[0] == 0x7F && data[1] == 'E' &&
+        data[2] == 'L' && data[3] == 'F' && data[5] == 1) {
+        const uint32_t machine = (uint32_t)data[18] | ((uint32_t)data[19] << 8);
+        if (machine == em_x86_64)  { return filter_machine_x86; }
+        if (machine == em_aarch64) { return filter_machine_arm64; }
+    }
+    return filter_machine_none;
+}
+
+// Encoding goes backwards so d[i - stride] is still original when d[i]
+// is replaced (16 bytes at a time). Decoding is a running sum with lag
+// `stride`: in 16 byte vectors it is a log step prefix sum plus the
+// last `stride` bytes of the previous vector replicated (stride 1, 2, 4).
+
+static inline uint8_t filter_zigzag(uint8_t v) {
+    return (uint8_t)((v << 1) ^ ((v & 0x80) ? 0xFF : 0x00));
+}
+
+static inline uint8_t filter_unzigzag(uint8_t z) {
+    return (uint8_t)((z >> 1) ^ (uint8_t)(0 - (z & 1)));
+}
+
+static void filter_delta_encode(uint8_t* d, size_t bytes, size_t stride) {
+    size_t i = bytes;
+#if defined(filter_sse2)
+    const __m128i zero = _mm_setzero_si128();
+    while (i >= stride + 16) {
+        i -= 16;
+        const __m128i a = _mm_loadu_si128((const __m128i*)(d + i));
+        const __m128i b = _mm_loadu_si128((const __m128i*)(d + i - stride));
+        const __m128i v = _mm_sub_epi8(a, b);
+        const __m128i sign = _mm_cmplt_epi8(v, zero);
+        const __m128i z = _mm_xor_si128(_mm_add_epi8(v, v), sign);
+        _mm_storeu_si128((__m128i*)(d + i), z);
+    }
+#elif defined(filter_neon)
+    while (i >= stride + 16) {
+        i -= 16;
+        const uint8x16_t v = vsubq_u8(vld1q_u8(d + i), vld1q_u8(d + i - stride));
+        const uint8x16_t sign = vreinterpretq_u8_s8(
+            vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+        vst1q_u8(d + i, veorq_u8(vshlq_n_u8(v, 1), sign));
+    }
+#endif
+    while (i > stride) {
+        i--;
+        d[i] = filter_zigzag((uint8_t)(d[i] - d[i - stride]));
+    }
+}
+
+#if defined(filter_sse2)
+
+#define filter_delta_decode_sse2(s, broadcast) do {                             \
+    __m128i carry = broadcast(_mm_loadu_si128((const __m128i*)(d + i - 16)));   \
+    const __m128i ones = _mm_set1_epi8(1);                                      \
+    const __m128i low7 = _mm_set1_epi8(0x7F);                                   \
+    while (i + 16 <= bytes) {                                                   \
+        __m128i x = _mm_loadu_si128((const __m128i*)(d + i));                   \
+        x = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(x, 1), low7),            \
+              _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(x, ones)));       \
+        x = _mm_add_epi8(x, _mm_slli_si128(x, (s)));                            \
+        if ((s) * 2 < 16) { x = _mm_add_epi8(x, _mm_slli_si128(x, (s) * 2)); }  \
+        if ((s) * 4 < 16) { x = _mm_add_epi8(x, _mm_slli_si128(x, (s) * 4)); }  \
+        if ((s) * 8 < 16) { x = _mm_add_epi8(x, _mm_slli_si128(x, (s) * 8)); }  \
+        x = _mm_add_epi8(x, carry);                                             \
+        _mm_storeu_si128((__m128i*)(d + i), x);                                 \
+        carry = broadcast(x);                                                   \
+        i += 16;                                                                \
+    }                                                                           \
+} while (0)
+
+static inline __m128i filter_last8(__m128i x) { // last byte 16 times
+    x = _mm_unpackhi_epi8(x, x);
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xFF), 0xFF);
+}
+
+static inline __m128i filter_last16(__m128i x) { // last 2 bytes 8 times
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xFF), 0xFF);
+}
+
+static inline __m128i filter_last32(__m128i x) { // last 4 bytes 4 times
+    return _mm_shuffle_epi32(x, 0xFF);
+}
+
+#elif defined(filter_neon)
+
+// x shifted by n bytes towards higher addresses (zero when n >= 16)
+#define filter_neon_shl(x, n) vextq_u8(zero, (x), (n) < 16 ? 16 - (n) : 0)
+
+#define filter_delta_decode_neon(s, broadcast) do {                             \
+    const uint8x16_t zero = vdupq_n_u8(0);                                      \
+    uint8x16_t carry = broadcast(vld1q_u8(d + i - 16));                         \
+    while (i + 16 <= bytes) {                                                   \
+        uint8x16_t x = vld1q_u8(d + i);                                         \
+        x = veorq_u8(vshrq_n_u8(x, 1), vreinterpretq_u8_s8(vnegq_s8(            \
+                vreinterpretq_s8_u8(vandq_u8(x, vdupq_n_u8(1))))));             \
+        x = vaddq_u8(x, filter_neon_shl(x, (s)));                               \
+        if ((s) * 2 < 16) { x = vaddq_u8(x, filter_neon_shl(x, (s) * 2)); }     \
+        if ((s) * 4 < 16) { x = vaddq_u8(x, filter_neon_shl(x, (s) * 4)); }     \
+        if ((s) * 8 < 16) { x = vaddq_u8(x, filter_neon_shl(x, (s) * 8)); }     \
+        x = vaddq_u8(x, carry);                                                 \
+        vst1q_u8(d + i, x);                                                     \
+        carry = broadcast(x);                                                   \
+        i += 16;                                                                \
+    }                                                                           \
+} while (0)
+
+static inline uint8x16_t filter_last8(uint8x16_t x) {
+    return vdupq_laneq_u8(x, 15);
+}
+
+static inline uint8x16_t filter_last16(uint8x16_t x) {
+    return vreinterpretq_u8_u16(vdupq_laneq_u16(vreinterpretq_u16_u8(x), 7));
+}
+
+static inline uint8x16_t filter_last32(uint8x16_t x) {
+    return vreinterpretq_u8_u32(vdupq_laneq_u32(vreinterpretq_u32_u8(x), 3));
+}
+
+#endif
+
+static void filter_delta_decode(uint8_t* d, size_t bytes, size_t stride) {
+    size_t i = stride;
+    // scalar head: the vector loop needs 16 decoded bytes behind it
+    const size_t head = bytes < 16 ? bytes : 16;
+    while (i < head) {
+        d[i] = (uint8_t)(filter_unzigzag(d[i]) + d[i - stride]);
+        i++;
+    }
+#if defined(filter_sse2)
+    if (i >= 16) {
+        if (stride == 1) { filter_delta_decode_sse2(1, filter_last8);  }
+        if (stride == 2) { filter_delta_decode_sse2(2, filter_last16); }
+        if (stride == 4) { filter_delta_decode_sse2(4, filter_last32); }
+    }
+#elif defined(filter_neon)
+    if (i >= 16) {
+        if (stride == 1) { filter_delta_decode_neon(1, filter_last8);  }
+        if (stride == 2) { filter_delta_decode_neon(2, filter_last16); }
+        if (stride == 4) { filter_delta_decode_neon(4, filter_last32); }
+    }
+#endif
+    while (i < bytes) {
+        d[i] = (uint8_t)(filter_unzigzag(d[i]) + d[i - stride]);
+        i++;
+    }
+}
+
+static void filter_delta(uint8_t* data, size_t bytes, int32_t stride,
+                         bool encode) {
+    assert(1 <= stride && stride <= 4);
+    if (encode) {
+        filter_delta_encode(data, bytes, (size_t)stride);
+    } else {
+        filter_delta_decode(data, bytes, (size_t)stride);
+    }
+}
+
+static double filter_entropy(const uint8_t* d, size_t bytes, size_t stride) {
+    uint64_t freq[256] = {0};
+    for (size_t i = stride; i < bytes; i++) {
+        freq[(uint8_t)(d[i] - (stride > 0 ? d[i - stride] : 0))]++;
+    }
+    const double total = (double)(bytes - stride);
+    double entropy = 0;
+    for (int32_t i = 0; i < 256; i++) {
+        if (freq[i] > 0) {
+            const double p = (double)freq[i] / total;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy; // bits per byte
+}
+
+static int32_t filter_stride(const uint8_t* data, size_t bytes) {
+    // BMP: "BM", bits per pixel at offset 28
+    if (bytes >= 30 && data[0] == 'B' && data[1] == 'M') {
+        const uint32_t bpp = (uint32_t)data[28] | ((uint32_t)data[29] << 8);
+        if (bpp == 8 || bpp == 16 || bpp == 24 || bpp == 32) {
+            return (int32_t)(bpp / 8);
+        }
+    }
+    enum { sample = 64 * 1024 };
+    const size_t n = bytes < sample ? bytes : sample;
+    if (n < 1024) { return 0; }
+    int32_t best = 0;
+    double least = filter_entropy(data, n, 0) - 1.0; // must save 1 bit
+    for (int32_t stride = 1; stride <= 4; stride++) {
+        const double e = filter_entropy(data, n, (size_t)stride);
+        if (e < least) { least = e; best = stride; }
+    }
+    return best;
+}
+
+filter_interface filter = {
+    .x86     = filter_x86,
+    .arm64   = filter_arm64,
+    .machine = filter_machine,
+    .delta   = filter_delta,
+    .stride  = filter_stride
+};
+
+#endif // filter_implementation
@@ -1,16 +1,24 @@
 #ifndef huffman_header_included
 #define huffman_header_included
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <errno.h>
 
 // Adaptive Huffman Coding
 // https://en.wikipedia.org/wiki/Adaptive_Huffman_coding
 
+// Code length is limited to huffman_max_bits: tree maintenance refuses to
+// push any leaf deeper than that. Every code fits a single bitstream word
+// and decoding a symbol never takes more than huffman_max_bits steps.
+
+enum { huffman_max_bits = 24 };
+
 typedef struct huffman_node_struct {
     uint64_t freq;
     uint64_t path;
-    int32_t  bits; // 0 for root
+    int16_t  bits; // 0 for root
+    int16_t  deep; // bits of the deepest leaf in the subtree
     int32_t  pix;  // parent
     int32_t  lix;  // left
     int32_t  rix;  // right
@@ -19,9 +27,9 @@ typedef struct huffman_node_struct {
 typedef struct huffman_tree_struct {
     huffman_node_type* node;
     int32_t n;
-    int32_t depth; // max tree depth seen
-    int32_t complete; // tree is too deep or freq too high - no more updates
-    int32_t padding;
+    int32_t depth; // max tree depth seen <= huffman_max_bits
+    int32_t complete; // freq too high - no more updates
+    int32_t built; // 0: nodes not written yet (see huffman.build())
     // stats:
     struct {
         size_t updates;
@@ -35,6 +43,14 @@ typedef struct {
                  const size_t m);
     void (*inc_frequency)(huffman_tree_type* t, int32_t symbol);
     uint8_t (*log2_of_pow2)(uint64_t pow2);
+    // build() writes the initial balanced tree. init() only takes the
+    // node memory so untouched (e.g. fresh zero) pages of unused trees
+    // are not written; inc_frequency() builds the tree on first use,
+    // code that reads nodes directly must call build() before.
+    void (*build)(huffman_tree_type* t);
+    // valid() checks nodes loaded from outside (e.g. a saved image) for
+    // consistent links, paths, depths and frequencies of a built tree
+    bool (*valid)(const huffman_tree_type* t);
 } huffman_interface;
 
 extern huffman_interface huffman;
@@ -59,23 +75,41 @@ static void huffman_update_paths(huffman_tree_type* t, int32_t i) {
     if (i == m - 1) { t->depth = 0; } // root
     const int32_t  bits = t->node[i].bits;
     const uint64_t path = t->node[i].path;
-    assert(bits < (int32_t)sizeof(uint64_t) * 8 - 1);
+    assert(bits <= huffman_max_bits);
     assert((path & (~((1ULL << (bits + 1)) - 1))) == 0);
     const int32_t lix = t->node[i].lix;
     const int32_t rix = t->node[i].rix;
     if (lix != -1) {
         assert(rix != -1);
-        t->node[lix].bits = bits + 1;
+        t->node[lix].bits = (int16_t)(bits + 1);
         t->node[lix].path = path;
-        t->node[rix].bits = bits + 1;
+        t->node[rix].bits = (int16_t)(bits + 1);
         t->node[rix].path = path | (1ULL << bits);
         huffman_update_paths(t, lix);
         huffman_update_paths(t, rix);
+        const int16_t l = t->node[lix].deep;
+        const int16_t r = t->node[rix].deep;
+        t->node[i].deep = l > r ? l : r;
     } else {
+        t->node[i].deep = (int16_t)bits;
         if (bits > t->depth) { t->depth = bits; }
     }
 }
 
+// after the subtree of `i` changed its depth
+
+static void huffman_update_deep(huffman_tree_type* t, int32_t i) {
+    int32_t pix = t->node[i].pix;
+    while (pix != -1) {
+        const int16_t l = t->node[t->node[pix].lix].deep;
+        const int16_t r = t->node[t->node[pix].rix].deep;
+        const int16_t d = l > r ? l : r;
+        if (t->node[pix].deep == d) { break; }
+        t->node[pix].deep = d;
+        pix = t->node[pix].pix;
+    }
+}
+
 static int32_t huffman_swap_siblings_if_necessary(huffman_tree_type* t,
                                                   const int32_t ix) {
     const int32_t m = t->n * 2 - 1;
@@ -113,7 +147,10 @@ static void huffman_move_up(huffman_tree_type* t, int32_t i) {
     const bool parent_is_left_child = pix == t->node[gix].lix;
     const int32_t psx = parent_is_left_child ? // parent sibling index
         t->node[gix].rix : t->node[gix].lix;   // aka auntie/uncle
-    if (t->node[i].freq > t->node[psx].freq) {
+    // Moving `i` up pushes parent sibling subtree one level down.
+    // Do not do that if it will make any code longer than huffman_max_bits.
+    if (t->node[i].freq > t->node[psx].freq &&
+        t->node[psx].deep < huffman_max_bits) {
         // Move grandparents left or right subtree to be
         // parents right child instead of 'i'.
         t->stats.moves++;
@@ -131,6 +168,7 @@ static void huffman_move_up(huffman_tree_type* t, int32_t i) {
         huffman_swap_siblings_if_necessary(t, psx);
         huffman_swap_siblings_if_necessary(t, pix);
         huffman_update_paths(t, gix);
+        huffman_update_deep(t, gix);
         huffman_frequency_changed(t, gix);
     }
 }
@@ -154,16 +192,20 @@ static void huffman_frequency_changed(huffman_tree_type* t, int32_t i) {
     }
 }
 
+static void huffman_build(huffman_tree_type* t);
+
 static void huffman_inc_frequency(huffman_tree_type* t, int32_t i) {
     assert(0 <= i && i < t->n); // terminal
+    if (!t->built) { huffman_build(t); }
     // If input sequence frequencies are severely skewed (e.g. Lucas numbers
-    // similar to Fibonacci numbers) and input sequence is long enough.
-    // The depth of the tree will grow past 64 bits.
-    // The first Lucas number that exceeds 2^64 is
-    // L(81) = 18,446,744,073,709,551,616 not actually realistic but
-    // better be safe than sorry:
+    // similar to Fibonacci numbers) and input sequence is long enough
+    // the depth of the tree would grow past 64 bits. huffman_move_up()
+    // keeps the depth at or below huffman_max_bits instead. Root frequency
+    // still may overflow on extremely long inputs, better be safe than sorry:
     if (!t->complete) {
-        if (t->depth < 63 && t->node[i].freq < UINT64_MAX - 1) {
+        assert(t->depth <= huffman_max_bits);
+        const int32_t root = t->n * 2 - 2;
+        if (t->node[root].freq < UINT64_MAX - 1) {
             t->node[i].freq++;
             huffman_frequency_changed(t, i);
         } else {
@@ -197,10 +239,18 @@ static void huffman_init(huffman_tree_type* t, huffman_node_type nodes[],
     t->n = n;
     t->depth = bits_per_symbol;
     t->complete = 0;
+    t->built = 0;
+}
+
+static void huffman_build(huffman_tree_type* t) {
+    if (t->built) { return; }
+    const int32_t n = t->n;
+    const int32_t m = n * 2 - 1;
+    const int32_t bits_per_symbol = huffman_log2_of_pow2(n);
     for (int32_t i = 0; i < n; i++) {
         t->node[i] = (huffman_node_type){
             .freq = 1, .lix = -1, .rix = -1, .pix = n + i / 2,
-            .bits = bits_per_symbol
+            .bits = (int16_t)bits_per_symbol
         };
     }
     int32_t ix = n;
@@ -214,7 +264,8 @@ static void huffman_init(huffman_tree_type* t, huffman_node_type nodes[],
             uint64_t f = t->node[lix].freq + t->node[rix].freq;
             assert(ix < m);
             t->node[ix] = (huffman_node_type){
-                .freq = f, .lix = lix, .rix = rix, .pix = pix, .bits = bits };
+                .freq = f, .lix = lix, .rix = rix, .pix = pix,
+                .bits = (int16_t)bits };
             lix += 2;
             rix += 2;
             if (i % 2 == 1) { pix++; }
@@ -230,12 +281,56 @@ static void huffman_init(huffman_tree_type* t, huffman_node_type nodes[],
     t->node[root].pix = -1;
     t->node[root].path = 0;
     huffman_update_paths(t, m - 1);
+    t->built = 1;
+}
+
+// Children are one bit deeper than their parent so following `pix`
+// always ends at the root and every node is reachable from it.
+
+static bool huffman_valid(const huffman_tree_type* t) {
+    const int32_t n = t->n;
+    const int32_t m = n * 2 - 1;
+    const int32_t root = m - 1;
+    const huffman_node_type* r = &t->node[root];
+    if (r->pix != -1 || r->bits != 0 || r->path != 0 ||
+        t->depth < r->deep) { // depth: deepest seen, it never shrinks
+        return false;
+    }
+    for (int32_t i = 0; i < m; i++) {
+        const huffman_node_type* x = &t->node[i];
+        if (i != root && (x->pix < n || x->pix >= m)) { return false; }
+        if (i < n) { // leaf
+            if (x->lix != -1 || x->rix != -1 || x->deep != x->bits) {
+                return false;
+            }
+            continue;
+        }
+        const int32_t lix = x->lix;
+        const int32_t rix = x->rix;
+        if (lix < 0 || lix >= root || rix < 0 || rix >= root || lix == rix) {
+            return false;
+        }
+        const huffman_node_type* a = &t->node[lix];
+        const huffman_node_type* b = &t->node[rix];
+        const int32_t bits = x->bits + 1;
+        const int16_t deep = a->deep > b->deep ? a->deep : b->deep;
+        if (a->pix != i || b->pix != i || bits > huffman_max_bits ||
+            a->bits != bits || b->bits != bits || x->deep != deep ||
+            (x->path >> x->bits) != 0 || a->path != x->path ||
+            b->path != (x->path | (1ULL << x->bits)) ||
+            x->freq != a->freq + b->freq || x->freq < a->freq) {
+            return false;
+        }
+    }
+    return true;
 }
 
 huffman_interface huffman = {
     .init          = huffman_init,
     .inc_frequency = huffman_inc_frequency,
-    .log2_of_pow2  = huffman_log2_of_pow2
+    .log2_of_pow2  = huffman_log2_of_pow2,
+    .build         = huffman_build,
+    .valid         = huffman_valid
 };
 
 #endif
\ No newline at end of file
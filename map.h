@@ -1,20 +1,79 @@
 #ifndef map_header_included
 #define map_header_included
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#if !defined(_MSC_VER) && !defined(__STDC_LIB_EXT1__)
+typedef int errno_t; // C11 Annex K, Microsoft CRT has it
+#endif
+
 // Braindead hash map for lz77 compression dictionary
 // Only supports d from 2 to 255 b because
 // 255 to ~2 b compression is about 1% of source and is good enough.
 
 typedef uint8_t map_entry_t[256]; // d[0] number of b [2..127]
 
+// Optional prefix index: hashed trie of the first map_index_depth bytes
+// of all words. Node index is its slot in node[] and children are found
+// by hashing (parent, byte). map.best() walks it once along the data
+// instead of probing the map per length. Words are cut at the depth (or
+// earlier when the nodes run out): the node they are cut at is marked
+// `longer` and map.best() probes (and so verifies) lengths past it.
+// All zero node is an unused slot, so zero memory is an empty index.
+// Nodes of an older `epoch` are unused too: map.clear() starts a new
+// epoch instead of clearing node[].
+
+typedef struct {
+    int32_t parent; // parent slot + 2: 1 for root, map_node_empty unused
+    int32_t word;   // entry index + 1 of the word ending here or 0
+    uint8_t byte;   // last byte of the prefix
+    uint8_t longer; // some words continue past this node unindexed
+    uint16_t epoch; // node is unused unless it is the map epoch
+} map_node_t;
+
+enum { map_node_empty = 0, map_index_depth = 16 };
+
+// References mode: instead of copying words into 256 bytes entries
+// the map stores (offset, bytes) of the word inside the caller's buffer
+// `base` that stays available (e.g. compressor input or decompressor
+// output). Before the buffer goes away map.retain() copies referenced
+// words into `spill` memory. Spill grows with the words kept (the map
+// allocates it, map.fini() frees it) so both modes have the same words.
+
 typedef struct {
-    map_entry_t* entry;
-    int32_t n; // entry[n]
+    uint32_t offset;    // in `base` or `spill` memory: low 32 bits
+    uint16_t offset_hi; // and high 16 bits
+    uint8_t  bytes;  // [2..255] or 0 for empty slot
+    uint8_t  where;  // map_ref_base or map_ref_spill
+} map_ref_t;
+
+enum { map_ref_base = 0, map_ref_spill = 1 };
+
+// used[] slots for map.track(): the map is filled to 3/4 at most
+#define map_used_n(n) ((uint64_t)(n) / 4 * 3)
+
+typedef struct {
+    map_entry_t* entry; // null in references mode
+    map_ref_t*   ref;   // null in copy mode
+    const uint8_t* base; // referenced words memory
+    uint64_t base_bytes;
+    uint8_t* spill;  // allocated by the map in references mode
+    uint64_t spill_bytes;
+    uint64_t spilled;
+    int32_t* used;    // slots in order words were put or null (map.track())
+    int32_t retained; // used[0..retained) slots reference no `base`
+    errno_t error;    // sticky ENOMEM: spill memory could not grow
+    int32_t n; // entry[n] or ref[n]
     int32_t entries;
     int32_t max_chain;
     int32_t max_bytes;
+    map_node_t* node; // null if no prefix index attached
+    int32_t nodes_n;  // node[nodes_n]
+    int32_t nodes;
+    int32_t indexed;  // prefix index is attached and holds every word
+    uint16_t epoch;   // of the used nodes
 } map_type;
 
 typedef struct {
@@ -25,11 +84,41 @@ typedef struct {
     int32_t     (*put)(map_type* m, const void* data, uint8_t bytes);
     int32_t     (*best)(const map_type* m, const void* data, size_t bytes);
     void        (*clear)(map_type *m);
+    void        (*index)(map_type* m, map_node_t node[], size_t n);
+    void        (*init_refs)(map_type* m, map_ref_t ref[], size_t n);
+    void        (*track)(map_type* m, int32_t used[], size_t n);
+    void        (*rebase)(map_type* m, const void* base, size_t bytes);
+    errno_t     (*retain)(map_type* m);
+    int32_t     (*insert)(map_type* m, int32_t i, const void* data,
+                          uint8_t bytes);
+    void        (*init_zeroed)(map_type* m, map_entry_t entry[], size_t n);
+    void        (*index_zeroed)(map_type* m, map_node_t node[], size_t n);
+    void        (*fini)(map_type* m);
 } map_interface;
 
-// map.put()  is no operation if map is filled to 75% or more
-// map.get()  returns index of matching entry or -1
-// map.best() returns index of longest matching entry or -1
+// map.put()   is no operation if map is filled to 75% or more
+// map.get()   returns index of matching entry or -1
+// map.best()  returns index of longest matching entry or -1
+// map.index() attaches prefix index to the empty map. Once the index is
+//             filled to 75% new words are only indexed as far as their
+//             prefixes already are.
+// map.rebase() sets buffer words put() into references mode map are
+//              referenced in. Must be inside the same buffer.
+// map.track() attaches used[map_used_n(m->n)] to the empty map. It lists
+//              used slots so retain() only visits words put since the
+//              last retain() instead of all slots.
+// map.retain() copies words referenced in current buffer into spill
+//              memory and detaches the buffer. Returns ENOMEM when the
+//              spill memory could not grow (words are lost then).
+// map.clear() empties the map: with map.track() only used slots are
+//             cleared and the prefix index starts a new epoch.
+// map.insert() puts word into empty slot `i` (restoring saved dictionary)
+//              returns i or -1 if slot is taken or there is no room.
+// map.init_zeroed() is map.init() for entry[] memory known to be zero:
+//              slots are not cleared so untouched pages stay unmapped.
+// map.index_zeroed() is map.index() for node[] memory known to be zero.
+// map.fini()  frees the spill memory of references mode (init_refs()
+//             starts without it).
 
 extern map_interface map;
 
@@ -39,6 +128,7 @@ extern map_interface map;
 
 #define map_implemented
 
+#include <stdlib.h>
 #include <string.h>
 
 #ifndef assert
@@ -72,37 +162,238 @@ static inline uint64_t map_hash64(const uint8_t* data, size_t bytes) {
     return hash;
 }
 
-static void map_init(map_type* m, map_entry_t entry[], size_t n) {
-    assert(16 < n && n < 1024 * 1024);
+static void map_init_with(map_type* m, map_entry_t entry[], size_t n,
+                          bool zeroed) {
+    assert(16 < n && n <= 1024 * 1024);
     m->n = (int32_t)n;
     m->entry = entry;
-    for (int32_t i = 0; i < m->n; i++) { m->entry[i][0] = 0; }
+    m->ref = null;
+    m->base = null;
+    m->base_bytes = 0;
+    m->spill = null;
+    m->spill_bytes = 0;
+    m->spilled = 0;
+    m->used = null;
+    m->retained = 0;
+    m->error = 0;
+    if (!zeroed) {
+        for (int32_t i = 0; i < m->n; i++) { m->entry[i][0] = 0; }
+    }
+    m->entries = 0;
+    m->max_chain = 0;
+    m->max_bytes = 0;
+    m->node = null;
+    m->nodes_n = 0;
+    m->nodes = 0;
+    m->indexed = 0;
+    m->epoch = 0;
+}
+
+static void map_index_clear(map_type* m) {
+    m->epoch++;
+    if (m->node != null && m->epoch == 0) { // wrapped: old nodes are live
+        memset(m->node, 0, sizeof(map_node_t) * (size_t)m->nodes_n);
+    }
+    m->nodes = 0;
+    m->indexed = m->node != null;
+}
+
+static void map_index_with(map_type* m, map_node_t node[], size_t n,
+                           bool zeroed) {
+    assert(m->entries == 0);
+    assert(16 < n && n < INT32_MAX);
+    m->node = node;
+    m->nodes_n = (int32_t)n;
+    m->nodes = 0;
+    m->indexed = 1;
+    m->epoch = 0;
+    if (!zeroed) { memset(m->node, 0, sizeof(map_node_t) * n); }
+}
+
+static void map_index(map_type* m, map_node_t node[], size_t n) {
+    map_index_with(m, node, n, false);
+}
+
+static void map_index_zeroed(map_type* m, map_node_t node[], size_t n) {
+    map_index_with(m, node, n, true);
+}
+
+static inline size_t map_node_slot(const map_type* m, int32_t parent,
+                                   uint8_t byte) {
+    const uint64_t key = ((uint64_t)(uint32_t)(parent + 1) << 8) | byte;
+    const uint64_t hash = key * 0x9E3779B97F4A7C15ULL; // Fibonacci hashing
+    return (size_t)((hash ^ (hash >> 32)) % (uint64_t)m->nodes_n);
+}
+
+static inline bool map_node_used(const map_type* m, size_t i) {
+    return m->node[i].parent != map_node_empty &&
+           m->node[i].epoch == m->epoch;
+}
+
+static inline int32_t map_node_child(const map_type* m, int32_t parent,
+                                     uint8_t byte) {
+    size_t i = map_node_slot(m, parent, byte);
+    while (map_node_used(m, i)) {
+        if (m->node[i].parent == parent + 2 && m->node[i].byte == byte) {
+            return (int32_t)i;
+        }
+        i = (i + 1) % m->nodes_n;
+    }
+    return -1;
+}
+
+static void map_index_put(map_type* m, const uint8_t* d, uint8_t b,
+                          int32_t word) {
+    int32_t parent = -1;
+    uint8_t k = 0;
+    while (k < b && k < map_index_depth) {
+        int32_t child = map_node_child(m, parent, d[k]);
+        // first bytes (at most 256 nodes) are indexed past 75%, the rest
+        // of the words are cut where the nodes run out
+        const int32_t limit = k == 0 ? m->nodes_n - 1 : m->nodes_n / 4 * 3;
+        if (child < 0 && m->nodes >= limit) { break; }
+        if (child < 0) {
+            size_t i = map_node_slot(m, parent, d[k]);
+            while (map_node_used(m, i)) { i = (i + 1) % m->nodes_n; }
+            m->node[i] = (map_node_t){ .parent = parent + 2, .byte = d[k],
+                                       .epoch = m->epoch };
+            m->nodes++;
+            child = (int32_t)i;
+        }
+        parent = child;
+        k++;
+    }
+    if (k == b) {
+        m->node[parent].word = word + 1;
+    } else if (parent >= 0) {
+        m->node[parent].longer = 1;
+    } else {
+        m->indexed = 0; // not even the first byte fits
+    }
+}
+
+static void map_init(map_type* m, map_entry_t entry[], size_t n) {
+    map_init_with(m, entry, n, false);
+}
+
+static void map_init_zeroed(map_type* m, map_entry_t entry[], size_t n) {
+    map_init_with(m, entry, n, true);
+}
+
+static void map_init_refs(map_type* m, map_ref_t ref[], size_t n) {
+    assert(16 < n && n <= 1024 * 1024);
+    m->n = (int32_t)n;
+    m->entry = null;
+    m->ref = ref;
+    m->base = null;
+    m->base_bytes = 0;
+    m->spill = null;
+    m->spill_bytes = 0;
+    m->spilled = 0;
+    m->used = null;
+    m->retained = 0;
+    m->error = 0;
+    for (int32_t i = 0; i < m->n; i++) { m->ref[i].bytes = 0; }
     m->entries = 0;
     m->max_chain = 0;
     m->max_bytes = 0;
+    m->node = null;
+    m->nodes_n = 0;
+    m->nodes = 0;
+    m->indexed = 0;
+    m->epoch = 0;
+}
+
+static void map_track(map_type* m, int32_t used[], size_t n) {
+    assert(m->entries == 0 && n >= map_used_n(m->n));
+    (void)n;
+    m->used = used;
+    m->retained = 0;
+}
+
+static void map_fini(map_type* m) {
+    free(m->spill);
+    m->spill = null;
+    m->spill_bytes = 0;
+    m->spilled = 0;
+}
+
+enum { map_spill_min = 64 * 1024 }; // first spill allocation
+
+static inline map_ref_t map_ref(uint64_t offset, uint8_t b, uint8_t where) {
+    return (map_ref_t){ .offset = (uint32_t)offset,
+                        .offset_hi = (uint16_t)(offset >> 32),
+                        .bytes = b, .where = where };
+}
+
+static inline uint64_t map_ref_offset(const map_ref_t* r) {
+    return ((uint64_t)r->offset_hi << 32) | r->offset;
+}
+
+// copies the word into spill memory growing it when it is full
+
+static bool map_spill(map_type* m, const uint8_t* d, uint8_t b,
+                      map_ref_t* r) {
+    if (m->spill_bytes - m->spilled < b) {
+        uint64_t bytes = m->spill_bytes < map_spill_min ?
+                         map_spill_min : m->spill_bytes * 2;
+        uint8_t* spill = (uint8_t*)realloc(m->spill, (size_t)bytes);
+        if (spill == null) { m->error = ENOMEM; return false; }
+        m->spill = spill;
+        m->spill_bytes = bytes;
+    }
+    memcpy(m->spill + m->spilled, d, b);
+    *r = map_ref(m->spilled, b, map_ref_spill);
+    m->spilled += b;
+    return true;
+}
+
+static inline bool map_used(const map_type* m, size_t i) {
+    return (m->ref != null ? m->ref[i].bytes : m->entry[i][0]) > 0;
+}
+
+static inline const uint8_t* map_word(const map_type* m, size_t i) {
+    if (m->ref == null) {
+        return m->entry[i][0] > 0 ? &m->entry[i][1] : null;
+    } else if (m->ref[i].bytes == 0) {
+        return null;
+    } else if (m->ref[i].where == map_ref_base) {
+        assert(m->base != null && map_ref_offset(&m->ref[i]) < m->base_bytes);
+        return m->base + map_ref_offset(&m->ref[i]);
+    } else {
+        return m->spill + map_ref_offset(&m->ref[i]);
+    }
+}
+
+static inline uint8_t map_word_bytes(const map_type* m, size_t i) {
+    return m->ref == null ? m->entry[i][0] : m->ref[i].bytes;
+}
+
+static inline bool map_equal(const map_type* m, size_t i,
+                             const void* d, uint8_t b) {
+    if (map_word_bytes(m, i) != b) { return false; }
+    return memcmp(map_word(m, i), d, b) == 0;
 }
 
 static inline const void* map_data(const map_type* m, int32_t i) {
     assert(0 <= i && i < m->n);
-    return m->entry[i][0] > 0 ? &m->entry[i][1] : null;
+    return map_word(m, (size_t)i);
 }
 
 static inline uint8_t map_bytes(const map_type* m, int32_t i) {
     assert(0 <= i && i < m->n);
-    return m->entry[i][0];
+    return map_word_bytes(m, (size_t)i);
 }
 
 
 static int32_t map_get_hashed(const map_type* m, uint64_t hash,
                               const void* d, uint8_t b) {
-    enum { max_bytes = sizeof(m->entry[0]) - 1 };
-    assert(2 <= b && b <= max_bytes);
-    const map_entry_t* entries = m->entry;
+    assert(2 <= b); // uint8_t b <= sizeof(map_entry_t) - 1
     size_t i = (size_t)hash % m->n;
     // Because map is filled to 3/4 only there will always be
     // an empty slot at the end of the chain.
-    while (entries[i][0] > 0) {
-        if (entries[i][0] == b && memcmp(entries[i] + 1, d, b) == 0) {
+    while (map_used(m, i)) {
+        if (map_equal(m, i, d, b)) {
             return (int32_t)i;
         }
         i = (i + 1) % m->n;
@@ -114,69 +405,192 @@ static int32_t map_get(const map_type* m, const void* d, uint8_t b) {
     return map_get_hashed(m, map_hash64(d, b), d, b);
 }
 
-static int32_t map_put(map_type* m, const uint8_t* d, uint8_t b) {
-    enum { max_bytes = sizeof(m->entry[0]) - 1 };
-    assert(2 <= b && b <= max_bytes);
+static int32_t map_put(map_type* m, const void* data, uint8_t b) {
+    const uint8_t* d = (const uint8_t*)data;
+    assert(2 <= b); // uint8_t b <= sizeof(map_entry_t) - 1
     if (m->entries < m->n * 3 / 4) {
-        map_entry_t* entries = m->entry;
         uint64_t hash = map_hash64(d, b);
         size_t i = (size_t)hash % m->n;
         int32_t chain = 0; // max chain length
-        while (entries[i][0] > 0) {
-            if (entries[i][0] == b && memcmp(entries[i] + 1, d, b) == 0) {
+        while (map_used(m, i)) {
+            if (map_equal(m, i, d, b)) {
                 return (int32_t)i; // found match with existing entry
             }
             chain++;
             i = (i + 1) % m->n;
             assert(chain < m->n); // looping endlessly?
         }
+        if (m->ref == null) {
+            m->entry[i][0] = b;
+            memcpy(m->entry[i] + 1, d, b);
+        } else if (m->base != null && d >= m->base &&
+                   d + b <= m->base + m->base_bytes) {
+            m->ref[i] = map_ref((uint64_t)(d - m->base), b, map_ref_base);
+        } else if (!map_spill(m, d, b, &m->ref[i])) {
+            return -1;
+        }
         if (chain > m->max_chain) { m->max_chain = chain; }
         if (b  > m->max_bytes) { m->max_bytes = b; }
-        entries[i][0] = b;
-        memcpy(entries[i] + 1, d, b);
+        if (m->used != null) { m->used[m->entries] = (int32_t)i; }
         m->entries++;
+        if (m->indexed) { map_index_put(m, d, b, (int32_t)i); }
         return (int32_t)i;
     }
     return -1;
 }
 
+// Probes lengths from i + 1 on with `hash` of d[0..i - 1] and `best` so
+// far: the last word of the first run of consecutive lengths that are
+// all present in the map.
+
+static int32_t map_best_probed(const map_type* m, const uint8_t* d,
+                               uint8_t b, uint8_t i, uint64_t hash,
+                               int32_t best) {
+    for (; i < b - 1; i++) {
+        hash = map_hash64_byte(hash, d[i]);
+        int32_t r = map_get_hashed(m, hash, d, i + 1);
+        if (r != -1) {
+            best = r;
+        } else if (best != -1) {
+            break; // will return longest matching entry index
+        }
+    }
+    return best;
+}
+
+// Same result as probing: walks the trie while it holds every word with
+// the prefix and probes the rest of the lengths past a `longer` node.
+
+static int32_t map_best_indexed(const map_type* m, const uint8_t* d,
+                                uint8_t b) {
+    int32_t best = -1;
+    int32_t node = -1; // root
+    uint64_t hash = map_hash_init;
+    for (uint8_t i = 0; i < b - 1; i++) {
+        node = map_node_child(m, node, d[i]);
+        if (node < 0) { break; } // no word starts with d[0..i]
+        hash = map_hash64_byte(hash, d[i]);
+        if (i >= 1) {
+            const int32_t word = m->node[node].word - 1;
+            if (word >= 0) {
+                best = word;
+            } else if (best != -1) {
+                break;
+            }
+        }
+        if (m->node[node].longer) {
+            return map_best_probed(m, d, b, i + 1, hash, best);
+        }
+    }
+    return best;
+}
+
 static int32_t map_best(const map_type* m, const void* data, size_t bytes) {
     enum { max_bytes = sizeof(m->entry[0]) - 1 };
     int32_t best = -1; // best (longest) result
     if (bytes > 1) {
         const uint8_t  b = (uint8_t)(bytes <= max_bytes ? bytes : max_bytes);
-        const uint8_t* d = (uint8_t*)data;
-        uint64_t hash = map_hash64_byte(map_hash_init, d[0]);
-        for (uint8_t i = 1; i < b - 1; i++) {
-            hash = map_hash64_byte(hash, d[i]);
-            int32_t r = map_get_hashed(m, hash, data, i + 1);
-            if (r != -1) {
-                best = r;
-            } else if (best != -1) {
-                break; // will return longest matching entry index
-            }
+        const uint8_t* d = (const uint8_t*)data;
+        if (m->indexed) {
+            best = map_best_indexed(m, d, b);
+        } else {
+            const uint64_t hash = map_hash64_byte(map_hash_init, d[0]);
+            best = map_best_probed(m, d, b, 1, hash, -1);
         }
     }
     return best;
 }
 
+static void map_rebase(map_type* m, const void* base, size_t bytes) {
+    assert(m->ref != null);
+    assert(m->base == null || m->base == base); // retain() first
+    assert((uint64_t)bytes < (1ULL << 48)); // map_ref_t offset
+    m->base = (const uint8_t*)base;
+    m->base_bytes = bytes;
+}
+
+static void map_retain_slot(map_type* m, int32_t i) {
+    map_ref_t* r = &m->ref[i];
+    if (r->bytes > 0 && r->where == map_ref_base) {
+        if (!map_spill(m, m->base + map_ref_offset(r), r->bytes, r)) {
+            r->bytes = 0; // lost (m->error is set)
+        }
+    }
+}
+
+static errno_t map_retain(map_type* m) {
+    assert(m->ref != null);
+    if (m->base != null && m->used != null) { // words since last retain()
+        for (int32_t k = m->retained; k < m->entries; k++) {
+            map_retain_slot(m, m->used[k]);
+        }
+    } else if (m->base != null) {
+        for (int32_t i = 0; i < m->n; i++) { map_retain_slot(m, i); }
+    }
+    m->retained = m->entries;
+    m->base = null;
+    m->base_bytes = 0;
+    return m->error;
+}
+
+static int32_t map_insert(map_type* m, int32_t i, const void* data,
+                          uint8_t b) {
+    assert(2 <= b && 0 <= i && i < m->n); // b <= sizeof(map_entry_t) - 1
+    const uint8_t* d = (const uint8_t*)data;
+    if (map_used(m, (size_t)i) || m->entries >= m->n * 3 / 4) { return -1; }
+    if (m->ref == null) {
+        m->entry[i][0] = b;
+        memcpy(m->entry[i] + 1, d, b);
+    } else if (!map_spill(m, d, b, &m->ref[i])) {
+        return -1;
+    }
+    const int32_t home = (int32_t)(map_hash64(d, b) % m->n);
+    const int32_t chain = (i - home + m->n) % m->n;
+    if (chain > m->max_chain) { m->max_chain = chain; }
+    if (b > m->max_bytes) { m->max_bytes = b; }
+    if (m->used != null) { m->used[m->entries] = i; }
+    m->entries++;
+    if (m->indexed) { map_index_put(m, d, b, i); }
+    return i;
+}
+
+static inline void map_clear_slot(map_type *m, int32_t i) {
+    if (m->ref != null) { m->ref[i].bytes = 0; } else { m->entry[i][0] = 0; }
+}
+
 static void map_clear(map_type *m) {
-    for (int32_t i = 0; i < m->n; i++) {
-        m->entry[i][0] = 0;
+    if (m->used != null) {
+        for (int32_t k = 0; k < m->entries; k++) {
+            map_clear_slot(m, m->used[k]);
+        }
+    } else {
+        for (int32_t i = 0; i < m->n; i++) { map_clear_slot(m, i); }
     }
+    m->spilled = 0;
+    m->retained = 0;
     m->entries = 0;
     m->max_chain = 0;
     m->max_bytes = 0;
+    map_index_clear(m);
 }
 
 map_interface map = {
-    .init  = map_init,
-    .data  = map_data,
-    .bytes = map_bytes,
-    .get   = map_get,
-    .put   = map_put,
-    .best  = map_best,
-    .clear = map_clear
+    .init      = map_init,
+    .data      = map_data,
+    .bytes     = map_bytes,
+    .get       = map_get,
+    .put       = map_put,
+    .best      = map_best,
+    .clear     = map_clear,
+    .index     = map_index,
+    .init_refs = map_init_refs,
+    .track     = map_track,
+    .rebase    = map_rebase,
+    .retain    = map_retain,
+    .insert    = map_insert,
+    .init_zeroed  = map_init_zeroed,
+    .index_zeroed = map_index_zeroed,
+    .fini         = map_fini
 };
 
 #endif // map_implementation
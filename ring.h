@@ -0,0 +1,109 @@
+#ifndef ring_header_included
+#define ring_header_included
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Lock-free single producer single consumer ring of fixed size items.
+// Producer and consumer may block (spin, then yield) on a full or empty
+// ring. Either side can close() the ring: put() fails right away and
+// get() fails once the ring is drained.
+
+enum { ring_cache_line = 64 };
+
+typedef struct {
+    uint8_t* data; // data[n * item]
+    uint32_t item; // bytes
+    uint32_t n;    // power of 2
+    uint8_t  padding0[ring_cache_line - sizeof(uint8_t*) - 8];
+    _Atomic(uint64_t) head; // written by producer
+    uint8_t  padding1[ring_cache_line - sizeof(uint64_t)];
+    _Atomic(uint64_t) tail; // written by consumer
+    uint8_t  padding2[ring_cache_line - sizeof(uint64_t)];
+    atomic_bool closed;
+} ring_type;
+
+typedef struct {
+    void (*init)(ring_type* r, void* memory, uint32_t item, uint32_t n);
+    bool (*put)(ring_type* r, const void* item);
+    bool (*get)(ring_type* r, void* item);
+    void (*close)(ring_type* r);
+} ring_interface;
+
+extern ring_interface ring;
+
+#endif // ring_header_included
+
+#if defined(ring_implementation) && !defined(ring_implemented)
+
+#define ring_implemented
+
+#include <string.h>
+#include <threads.h>
+
+#ifndef assert
+#include <assert.h>
+#endif
+
+enum { ring_spins = 1024 }; // before yielding the thread
+
+static void ring_init(ring_type* r, void* memory, uint32_t item, uint32_t n) {
+    assert(item > 0 && n > 1 && (n & (n - 1)) == 0);
+    r->data = (uint8_t*)memory;
+    r->item = item;
+    r->n = n;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->closed, false);
+}
+
+static inline void ring_wait(uint32_t* spins) {
+    if (++*spins >= ring_spins) { thrd_yield(); *spins = 0; }
+}
+
+static bool ring_put(ring_type* r, const void* item) {
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t spins = 0;
+    while (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= r->n) {
+        if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+            return false;
+        }
+        ring_wait(&spins);
+    }
+    if (atomic_load_explicit(&r->closed, memory_order_relaxed)) { return false; }
+    memcpy(r->data + (head & (r->n - 1)) * r->item, item, r->item);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_get(ring_type* r, void* item) {
+    const uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t spins = 0;
+    while (atomic_load_explicit(&r->head, memory_order_acquire) == tail) {
+        if (atomic_load_explicit(&r->closed, memory_order_acquire)) {
+            // producer may have published the last item before closing
+            if (atomic_load_explicit(&r->head, memory_order_acquire) == tail) {
+                return false;
+            }
+            break;
+        }
+        ring_wait(&spins);
+    }
+    memcpy(item, r->data + (tail & (r->n - 1)) * r->item, r->item);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static void ring_close(ring_type* r) {
+    atomic_store_explicit(&r->closed, true, memory_order_release);
+}
+
+ring_interface ring = {
+    .init  = ring_init,
+    .put   = ring_put,
+    .get   = ring_get,
+    .close = ring_close
+};
+
+#endif // ring_implementation
@@ -3,6 +3,13 @@
 
 // nano runtime to make debugging, life, universe and everything a bit easier
 
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE) // glibc hides POSIX and
+#define _DEFAULT_SOURCE                             // BSD APIs in -std=c11
+#endif
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <locale.h>
 #include <math.h>
 #include <stdarg.h>
@@ -32,6 +39,21 @@
 #pragma warning(disable: 5045) // Compiler will insert Spectre mitigation
 #endif
 
+#if !defined(_MSC_VER) // posix: C11 Annex K types and functions
+#include <errno.h>
+#ifndef __STDC_LIB_EXT1__
+typedef int errno_t;
+static inline errno_t rt_fopen_s(FILE** f, const char* name, const char* mode) {
+    *f = fopen(name, mode);
+    return *f != NULL ? 0 : errno;
+}
+#define fopen_s(f, name, mode) rt_fopen_s(f, name, mode)
+#endif
+#if !defined(thread_local) && (__STDC_VERSION__ < 202311L)
+#define thread_local _Thread_local
+#endif
+#endif
+
 #if defined(_DEBUG) && !defined(DEBUG)
 #define DEBUG // clang & gcc make use DEBUG, Microsoft _DEBUG
 #endif
@@ -80,7 +102,7 @@ static void rt_output_line(const char* s) {
 static void rt_flush_buffer(rt_debug_output_t* out, const char* file,
                             int32_t line, const char* function) {
     if (out->wr > out->rd) {
-        if ((out->wr - out->rd) >= (sizeof(out->buffer) - 4)) {
+        if ((size_t)(out->wr - out->rd) >= (sizeof(out->buffer) - 4)) {
             strcpy(out->wr - 3, "...\n");
         }
         char prefix[1024];
@@ -189,9 +211,9 @@ static int32_t rt_printf_implementation(const char* file, int32_t line,
                 rt_exit(1)))
 #else
     #define rt_swear(b, ...) ((void)                                        \
-        ((!!(b)) || rt_printf_implementation(__FILE__, __LINE__, __func__,  \
+        ((!!(b)) || (rt_printf_implementation(__FILE__, __LINE__, __func__, \
                          true, #b " false " __VA_ARGS__) &&                 \
-                    rt_exit(1)))
+                    rt_exit(1))))
 #endif
 
 #if defined(DEBUG) || defined(_DEBUG)
@@ -201,8 +223,10 @@ static int32_t rt_printf_implementation(const char* file, int32_t line,
 #endif
 
 static int32_t rt_exit(int exit_code) {
-    _Pragma("warning(push)")
-    _Pragma("warning(disable: 4702)") /* unreachable code */
+    #ifdef _MSC_VER
+    #pragma warning(push)
+    #pragma warning(disable: 4702) // unreachable code
+    #endif
     if (exit_code == 0) { rt_printf("exit code must be non-zero"); }
     if (exit_code != 0) {
         #ifdef _WINDOWS_
@@ -213,7 +237,9 @@ static int32_t rt_exit(int exit_code) {
         #endif
     }
     return 0;
-    _Pragma("warning(pop)")
+    #ifdef _MSC_VER
+    #pragma warning(pop)
+    #endif
 }
 
 #endif // rt_header_included
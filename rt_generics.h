@@ -2,7 +2,11 @@
 #define rt_generics_header_included
 
 #include <stdint.h>
+#ifdef _MSC_VER
 #include <malloc.h>
+#else
+#include <alloca.h>
+#endif
 
 typedef float  fp32_t;
 typedef double fp64_t;
@@ -28,7 +32,9 @@ static inline fp64_t   rt_max_fp64(fp64_t x, fp64_t y)       { return x > y ? x
 
 // MS cl.exe version 19.39.33523 has issues with "long":
 // does not pick up int32_t/uint32_t types for "long" and "unsigned long"
-// need to handle long / unsigned long separately:
+// need to handle long / unsigned long separately.
+// On LP64 Linux int64_t *is* long and listing both in one _Generic is an
+// error, so long is selected in the nested _Generic of the default case:
 
 static inline long          rt_max_long(long x, long y)                    { return x > y ? x : y; }
 static inline unsigned long rt_max_ulong(unsigned long x, unsigned long y) { return x > y ? x : y; }
@@ -62,9 +68,10 @@ static inline void rt_max_undefined(void) { }
     uint64_t: rt_max_uint64, \
     fp32_t:   rt_max_fp32,   \
     fp64_t:   rt_max_fp64,   \
-    long:     rt_max_long,   \
-    unsigned long: rt_max_ulong, \
-    default:  rt_max_undefined)(X, Y)
+    default:  _Generic((X) + (Y),     \
+        long:          rt_max_long,  \
+        unsigned long: rt_max_ulong, \
+        default:       rt_max_undefined))(X, Y)
 
 #define rt_min(X, Y) _Generic((X) + (Y), \
     int8_t:   rt_min_int8,   \
@@ -77,18 +84,13 @@ static inline void rt_max_undefined(void) { }
     uint64_t: rt_min_uint64, \
     fp32_t:   rt_min_fp32,   \
     fp64_t:   rt_min_fp64,   \
-    long:     rt_min_long,   \
-    unsigned long: rt_min_ulong, \
-    default:  rt_min_undefined)(X, Y)
+    default:  _Generic((X) + (Y),     \
+        long:          rt_min_long,  \
+        unsigned long: rt_min_ulong, \
+        default:       rt_min_undefined))(X, Y)
 
 
-#if defined(__clang__) || defined(__GNUC__)
-    #define rt_alloca(n)                                       \
-        _Pragma("GCC diagnostic push")                         \
-        _Pragma("GCC diagnostic ignored \"-Walloca\"")         \
-        alloca(n)                                              \
-        _Pragma("GCC diagnostic pop")
-#elif defined(_MSC_VER)
+#if defined(_MSC_VER)
     #define rt_alloca(n)                                       \
         __pragma(warning(push))                                \
         __pragma(warning(disable: 6255)) /* alloca warning */  \
@@ -122,8 +124,6 @@ static inline void rt_swap_implementation(void* a, void *b, size_t bytes) {
     uint64_t: rt_swap_implementation(&a, &b, sizeof(uint64_t)), \
     fp32_t:   rt_swap_implementation(&a, &b, sizeof(fp32_t)),   \
     fp64_t:   rt_swap_implementation(&a, &b, sizeof(fp64_t)),   \
-    long:     rt_swap_implementation(&a, &b, sizeof(long)),     \
-    unsigned long: rt_swap_implementation(&a, &b, sizeof(unsigned long)), \
     default:  rt_swap_implementation(&a, &b, sizeof(a)))
 
 #endif // rt_generics_header_included
@@ -1,12 +1,21 @@
 #ifndef squeeze_header_included
 #define squeeze_header_included
 
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE) // clock_gettime()
+#define _POSIX_C_SOURCE 200809L                     // with -std=c11
+#endif
+
 #include <errno.h>
 #include <stdint.h>
 
+#include "arena.h"
 #include "bitstream.h"
+#include "checksum.h"
+#include "file.h"
+#include "filter.h"
 #include "huffman.h"
 #include "map.h"
+#include "ring.h"
 
 enum {
     squeeze_min_win_bits = 10,
@@ -17,10 +26,215 @@ enum {
     squeeze_max_len_bits =  8
 };
 
+// Stream header: bytes (64 bits), squeeze_magic (32 bits), win_bits,
+// map_bits, len_bits (8 bits each), flags (16 bits) and the dictionary
+// ID (32 bits) with squeeze_flag_dictionary. The magic carries the format
+// version: streams of other versions are rejected by read_header().
+
+enum { squeeze_magic = 0x025A5153 }; // "SQZ" version 2: LSB first bits
+
+enum { // header flags
+    // literals and positions are coded into sub-streams of their own that
+    // the decoder decodes on their own threads ahead of the token stream
+    // (see squeeze_streams_type). Not with squeeze_option_resume.
+    squeeze_flag_streams = 0x01,
+    // matches farther than the window: position symbol 0 is followed
+    // by the distance as a number (see squeeze_option_long)
+    squeeze_flag_long  = 0x02,
+    // branch-call-jump filters (see filter.h) applied to the data
+    squeeze_flag_x86   = 0x04,
+    squeeze_flag_arm64 = 0x08,
+    squeeze_flags_bcj  = squeeze_flag_x86 | squeeze_flag_arm64,
+    // delta filter, stride - 1 in squeeze_flags_stride bits
+    squeeze_flag_delta   = 0x10,
+    squeeze_flags_stride = 0x60,
+    squeeze_flags_filter = squeeze_flags_bcj | squeeze_flag_delta,
+    // stream is compressed with primed dictionary (see squeeze.prime())
+    // its 32 bit ID follows flags in the header
+    squeeze_flag_dictionary = 0x80,
+    // CRC32C (see checksum.h) of each squeeze_checksum_block bytes of the
+    // coded data follows the token completing it, CRC32C of the whole
+    // input (before filters) ends the stream. Not with squeeze_option_resume.
+    squeeze_flag_checksum = 0x100,
+    squeeze_flags_all  = squeeze_flag_streams | squeeze_flag_long |
+                         squeeze_flags_filter | squeeze_flags_stride |
+                         squeeze_flag_dictionary | squeeze_flag_checksum
+};
+
+enum { squeeze_checksum_block = 64 * 1024 };
+
+// delta filter flags for `stride` [1..4] and stride of the flags
+#define squeeze_flag_stride(stride) \
+    ((uint8_t)(squeeze_flag_delta | (((stride) - 1) << 5)))
+#define squeeze_stride(flags) ((int32_t)((((flags) >> 5) & 0x3) + 1))
+
+enum { // context options (not part of the stream format)
+    // dictionary references words in compress()/decompress() buffers
+    // instead of copying them (see map.init_refs()). Words that outlive
+    // a buffer are copied into spill memory that grows as they do.
+    squeeze_option_refs = 0x01,
+    // match search runs on its own thread ahead of the entropy coder,
+    // output is identical to the serial compressor
+    squeeze_option_pipeline = 0x02,
+    // worker threads search the window for each position of the input
+    // ahead of the parse, output is identical to the serial compressor
+    squeeze_option_parallel = 0x04,
+    // memory for the long distance index used with squeeze_flag_long
+    squeeze_option_long = 0x08,
+    // context keeps the last window of compressed data and the pending
+    // bits of the stream so squeeze.checkpoint() can save it and
+    // compression can continue after squeeze.restore()
+    squeeze_option_resume = 0x10,
+    // compress() and decompress() count tokens, lengths and distances
+    // for squeeze.stats(), compiled out when squeeze_no_stats is defined
+    squeeze_option_stats = 0x20,
+    // compress() and decompress() record timeline events and sampled
+    // stage times for squeeze.trace(), compiled out with squeeze_no_trace
+    squeeze_option_trace = 0x40,
+    // memory passed to init() is known to be zero (fresh mmap, calloc,
+    // unused arena): map slots and prefix index nodes are not cleared
+    // and their pages are only touched (committed, placed on the NUMA
+    // node) once they are used. Huffman trees are always built on first
+    // use (see huffman.build())
+    squeeze_option_zeroed = 0x80
+};
+
+enum {
+    squeeze_long_block = 64, // sampled (and minimum) long match bytes
+    squeeze_long_bits  = 20, // log2 of long distance index entries
+    squeeze_long_base  = 12  // distance number base
+};
+
+enum {
+    squeeze_parallel_chunk   = 64 * 1024, // positions searched at once
+    squeeze_parallel_cap     = 64,  // longer matches are searched serially
+    squeeze_parallel_workers = 8,   // default
+    squeeze_parallel_max_workers = 64,
+    squeeze_match_unknown = 0xFFFF
+};
+
+typedef struct {
+    uint32_t pos; // distance of the longest match
+    uint16_t len; // < squeeze_parallel_cap exact or squeeze_match_unknown
+    uint16_t padding;
+} squeeze_match_type;
+
+enum { squeeze_pipeline_tokens = 4096 }; // ring between pipeline stages
+
+enum { // tokens
+    squeeze_token_literal = 0,
+    squeeze_token_match   = 1,
+    squeeze_token_word    = 2, // dictionary word
+    squeeze_token_long    = 3  // long distance match
+};
+
+typedef struct {
+    uint64_t len;  // bytes of input covered by the token
+    uint64_t pos;  // match distance
+    int32_t  wix;  // dictionary word written or added by match (-1 none)
+    uint8_t  kind; // squeeze_token_*
+    uint8_t  byte; // literal
+} squeeze_token_type;
+
+enum { squeeze_stats_buckets = 64 }; // histograms by floor(log2(value))
+
+typedef struct {
+    int32_t  n;       // symbols
+    int32_t  depth;   // longest code bits seen
+    uint64_t updates; // huffman_tree_type.stats: cost of tree maintenance
+    uint64_t swaps;
+    uint64_t moves;
+} squeeze_tree_stats_type;
+
+// Counters are collected with squeeze_option_stats and accumulate until
+// init() (also over seekable blocks). Fields after the histograms are
+// only filled in by squeeze.stats() from the state of the context.
+
+typedef struct {
+    uint64_t literals;
+    uint64_t matches;  // including long distance matches
+    uint64_t words;    // dictionary hits
+    uint64_t escapes;  // matches with escaped length or long distance
+    uint64_t bytes;    // of data covered by tokens
+    uint64_t bits;     // of coded stream (without header)
+    uint64_t length[squeeze_stats_buckets];   // of matches and words
+    uint64_t distance[squeeze_stats_buckets]; // of matches
+    double   bits_per_token;
+    double   hit_rate; // words / tokens
+    double   load;     // entries / slots
+    int32_t  entries;  // dictionary words
+    int32_t  slots;
+    squeeze_tree_stats_type sym;
+    squeeze_tree_stats_type dic;
+    squeeze_tree_stats_type pos;
+    squeeze_tree_stats_type len;
+} squeeze_stats_type;
+
+enum { // compression stages timed with squeeze_option_trace
+    squeeze_stage_search = 0, // window scan for the longest match
+    squeeze_stage_lookup = 1, // dictionary map.best()
+    squeeze_stage_coding = 2, // Huffman codes and tree updates
+    squeeze_stage_io     = 3, // bitstream writes
+    squeeze_stages       = 4
+};
+
+enum { // trace event kinds
+    squeeze_event_compress   = 0, // match search (if not pipelined) + coder
+    squeeze_event_search     = 1, // pipeline finder or parallel worker
+    squeeze_event_decompress = 2
+};
+
+enum { // trace event threads
+    squeeze_thread_coder  = 0, // calling thread
+    squeeze_thread_finder = 1, // squeeze_option_pipeline
+    squeeze_thread_worker = 2  // + k for squeeze_option_parallel workers
+};
+
+enum {
+    squeeze_trace_block = 64 * 1024, // bytes per event
+    squeeze_trace_every = 64 // one of that many tokens is stage timed
+};
+
+typedef struct {
+    uint64_t start;    // ns since the first traced compress/decompress
+    uint64_t duration; // ns
+    uint64_t bytes;    // of input (compress) or output (decompress)
+    uint64_t stage[squeeze_stages]; // estimated cycle counter ticks
+    uint32_t thread;   // squeeze_thread_*
+    uint32_t kind;     // squeeze_event_*
+} squeeze_event_type;
+
+typedef struct {
+    uint64_t ticks[squeeze_stages]; // of sampled tokens
+    uint64_t last;
+    int32_t  stage; // of the sampled token or -1
+    uint32_t count; // tokens since the last sample
+} squeeze_sampler_type;
+
+// With squeeze_option_trace compress() and decompress() record an event
+// per squeeze_trace_block bytes (and per parallel search segment) into
+// `event` memory the caller sets after init(). Events past `capacity`
+// are counted but dropped. Stage times come from the cycle counter
+// read around stages of every squeeze_trace_every-th token only.
+
+typedef struct {
+    squeeze_event_type* event;
+    uint64_t capacity;
+    _Atomic(uint64_t) count; // events recorded
+    uint64_t origin;   // ns
+    uint64_t origin_ticks;
+    uint64_t ns;       // end of the latest coder event
+    uint64_t ticks;    // (calibrates ticks to ns)
+    squeeze_sampler_type sampler[2]; // squeeze_side_search, _coder
+} squeeze_trace_type;
+
 typedef struct {
     errno_t error; // sticky
     map_type map;  // `words` dictionary
-    map_entry_t* map_entries;
+    map_entry_t* map_entries; // null with squeeze_option_refs
+    map_ref_t*   map_refs;    // squeeze_option_refs only
+    int32_t*     map_used;    // map.track() slots of the words
+    map_node_t*  map_nodes; // prefix index of `words` 4 nodes per entry
     huffman_tree_type dic; // `map` keys tree
     huffman_tree_type sym; // 0..255 ASCII characters
     huffman_tree_type pos; // positions tree of 1^win_bits
@@ -30,16 +244,193 @@ typedef struct {
     huffman_node_type* pos_nodes;
     huffman_node_type* len_nodes;
     bitstream_type*    bs;
+    squeeze_token_type* tokens; // squeeze_option_pipeline only
+    ring_type ring;
+    squeeze_match_type* matches; // squeeze_option_parallel only
+    uint64_t matches_from; // matches[0] is for data[matches_from]
+    uint64_t matches_to;
+    int32_t  workers; // squeeze_option_parallel can be changed after init()
+    struct squeeze_pool_struct* pool; // worker threads, started on demand
+    // squeeze_flag_streams: sub-streams of the compress()/decompress() call
+    struct squeeze_streams_struct* streams;
+    uint64_t* long_index; // squeeze_option_long: hash -> position + 1
+    uint64_t  long_indexed; // next sampled position to index
+    uint16_t  long_epoch; // of the long_index entries of this compress()
+    uint16_t flags; // header flags must be set before compress/decompress
+    uint32_t options;
+    uint64_t checked; // squeeze_flag_checksum: bytes covered by block CRCs
+    uint32_t crc;     // squeeze_flag_checksum: of the whole input
+    uint32_t crc_checked; // of data[0..checked) combined from block CRCs
+    uint32_t dictionary; // ID of primed dictionary or 0
+    uint8_t* history; // squeeze_option_resume: last window bytes compressed
+    uint64_t history_bytes;
+    struct { // squeeze_option_resume: stream before the final flush
+        uint64_t total; // bytes compressed
+        uint64_t b64;   // pending bits
+        int32_t  bits;
+        int32_t  padding;
+        uint64_t bytes; // stream bytes before the pending bits
+    } resume;
+    void*  memory; // passed to init() for reset between seekable blocks
+    size_t size;
+    arena_type* arena; // owner of the memory (new_in()) or null
+    squeeze_stats_type stats; // squeeze_option_stats
+    squeeze_trace_type trace; // squeeze_option_trace
 } squeeze_type;
 
+// Serialized dictionary image: this header followed by depth, complete
+// and nodes of sym, dic, pos and len trees and `words` entries of
+// (slot, bytes, data[bytes]). Integers and nodes are in host byte order.
+// prime() only reads the image, so one read-only mapping can prime any
+// number of contexts. It copies trees and words into the context because
+// adaptive coding updates them with every symbol.
+
+enum { squeeze_dictionary_magic = 0x445A5153 }; // "SQZD"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t id; // not 0
+    uint8_t  win_bits;
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    uint8_t  padding;
+    uint32_t words;
+    uint64_t bytes; // of the whole image
+} squeeze_dictionary_type;
+
+// Checkpoint image: this header followed by the same trees and words
+// as the dictionary image and `history` bytes of the window.
+
+enum { squeeze_checkpoint_magic = 0x435A5153 }; // "SQZC"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t dictionary;
+    uint8_t  win_bits;
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    uint8_t  padding;
+    uint32_t flags;
+    uint32_t words;
+    uint32_t reserved;
+    uint64_t total;   // bytes compressed so far
+    uint64_t b64;     // pending bits of the stream
+    uint64_t bits;
+    uint64_t offset;  // stream bytes before the pending bits
+    uint64_t history; // bytes
+    uint64_t bytes;   // of the whole image
+} squeeze_checkpoint_type;
+
+// Seekable format: independently compressed blocks (each a complete
+// stream with its own header) followed by the index of all blocks and
+// a footer of 4 words: number of blocks, index position, block size and
+// squeeze_seekable_magic. Positions are from the start of the output.
+
+enum { squeeze_seekable_magic = 0x535A5153 }; // "SQZS"
+
+typedef struct {
+    uint64_t offset;   // uncompressed
+    uint64_t position; // compressed
+    uint64_t bytes;    // uncompressed
+    uint64_t size;     // compressed
+} squeeze_block_type;
+
+// Auto-tune: tune() compresses a sample of the input (slices spread over
+// it) into nothing with candidate win_bits, map_bits and len_bits, one
+// parameter at a time, and picks the smallest output within the budget.
+// Larger values cost time and memory: a parameter is not raised further
+// once it stops shrinking the output or gets too slow.
+// With t->bs the header with the choice (t->flags, no dictionary id) is
+// written to it, decoder needs nothing else. The sample is compressed
+// with map_bits lowered by log2 of input/sample bytes, so the dictionary
+// fills as it would with the whole input. If no candidate is fast enough
+// the fastest is chosen.
+
+enum {
+    squeeze_tune_sample = 64 * 1024, // default bytes of the sample
+    squeeze_tune_slices = 8
+};
+
+typedef struct {
+    // budget and parameters (0: unlimited, default)
+    uint64_t memory;  // bytes of the context squeeze_sizeof_with(..options)
+    double   speed;   // minimum compression speed of the sample bytes/s
+    size_t   sample;  // bytes of the input to compress for each candidate
+    uint16_t flags;   // header flags (filters, long) used for compression
+    uint32_t options; // context options (pipeline, parallel)
+    bitstream_type* bs; // optional: header of `bytes` with the choice
+    // choice
+    uint8_t  win_bits;
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    uint64_t sampled;    // bytes of the sample
+    uint64_t compressed; // bytes of the sample compressed with the choice
+    double   seconds;    // time it took
+    int32_t  candidates; // number of compressions of the sample
+} squeeze_tune_type;
+
+// Batch format: many small records in one stream with a single header
+// (total bytes of all records), squeeze_batch_magic, number of records,
+// workers, 32 bit bytes and compressed size of each
+// record, padding to 64 bits, then the records in order. Record k is
+// coded by worker k % workers: each worker is one context (primed with
+// the dictionary if squeeze_flag_dictionary) that keeps its model and
+// words from record to record, so records of a worker are decoded in
+// order, by one thread per worker. Each record is a complete stream
+// without the header. Worker contexts stay in the batch object and are
+// cleared for the next call with the same parameters and options.
+
+enum {
+    squeeze_batch_magic = 0x42515A53, // "SQZB"
+    squeeze_batch_max_record = 0x7FFFFFFF
+};
+
+typedef struct {
+    const uint8_t* data; // compress: input
+    uint8_t* output;     // decompress: output of `bytes`
+    uint64_t bytes;      // uncompressed
+    uint64_t position;   // of the compressed record from the batch start
+    uint64_t size;       // compressed bytes
+    errno_t  error;
+} squeeze_record_type;
+
+typedef struct {
+    uint8_t  win_bits; // compress only, decompress reads the header
+    uint8_t  map_bits;
+    uint8_t  len_bits;
+    uint16_t flags;    // squeeze_flag_*
+    uint32_t options;  // context options of workers (but resume)
+    int32_t  workers;  // compress: threads and contexts, 0: default
+    const void* image; // dictionary with squeeze_flag_dictionary or null
+    size_t   image_bytes;
+    // worker contexts kept from call to call (squeeze.dispose_batch())
+    squeeze_type* context[squeeze_parallel_max_workers];
+} squeeze_batch_type;
+
 #define squeeze_size_mul(name, count) (                                         \
     ((uint64_t)(count) >= ((SIZE_MAX / 4) / (uint64_t)sizeof(name))) ?          \
     0 : (size_t)((uint64_t)sizeof(name) * (uint64_t)(count))                    \
 )
 
-#define squeeze_size_implementation(win_bits, map_bits, len_bits) (             \
+#define squeeze_size_map(map_bits, options) (                                   \
+    ((options) & squeeze_option_refs) ?                                         \
+    squeeze_size_mul(map_ref_t, (1ULL << (map_bits))) :                         \
+    squeeze_size_mul(map_entry_t, (1ULL << (map_bits)))                         \
+)
+
+#define squeeze_size_implementation(win_bits, map_bits, len_bits, options) (    \
     (sizeof(squeeze_type)) +                                                    \
-    squeeze_size_mul(map_entry_t, (1ULL << (map_bits))) +                       \
+    squeeze_size_map((map_bits), (options)) +                                   \
+    squeeze_size_mul(int32_t, map_used_n(1ULL << (map_bits))) +                 \
+    (((options) & squeeze_option_pipeline) ?                                    \
+      squeeze_size_mul(squeeze_token_type, squeeze_pipeline_tokens) : 0) +      \
+    (((options) & squeeze_option_resume) ?                                      \
+      squeeze_size_mul(uint8_t, 1ULL << (win_bits)) : 0) +                      \
+    (((options) & squeeze_option_long) ?                                        \
+      squeeze_size_mul(uint64_t, 1ULL << squeeze_long_bits) : 0) +              \
+    (((options) & squeeze_option_parallel) ?                                    \
+      squeeze_size_mul(squeeze_match_type, squeeze_parallel_chunk) : 0) +       \
+    squeeze_size_mul(map_node_t,  (1ULL << (map_bits)) * 4ULL) +                \
     /* dic_nodes: */                                                            \
     squeeze_size_mul(huffman_node_type, ((1ULL << (map_bits)) * 2ULL - 1ULL)) + \
     /* sym_nodes: */                                                            \
@@ -50,56 +441,134 @@ typedef struct {
     squeeze_size_mul(huffman_node_type, ((1ULL << (len_bits)) * 2ULL - 1ULL))   \
 )
 
-#define squeeze_sizeof(win_bits, map_bits, len_bits) (                          \
+#define squeeze_sizeof_with(win_bits, map_bits, len_bits, options) (            \
     (sizeof(size_t) == sizeof(uint64_t)) &&                                     \
-    (squeeze_min_win_bits <= (win_bits)) &&                                     \
-                             ((win_bits) <= squeeze_max_win_bits) &&            \
-    (squeeze_min_map_bits <= (map_bits)) &&                                     \
-                            ((map_bits) <= squeeze_max_map_bits) &&             \
-    (squeeze_min_len_bits <= (len_bits)) &&                                     \
-                            ((len_bits) <= squeeze_max_len_bits) ?              \
-    (size_t)squeeze_size_implementation((win_bits), (map_bits), (len_bits)) : 0 \
+    (squeeze_min_win_bits <= (int)(win_bits)) &&                                \
+                        ((int)(win_bits) <= squeeze_max_win_bits) &&            \
+    (squeeze_min_map_bits <= (int)(map_bits)) &&                                \
+                        ((int)(map_bits) <= squeeze_max_map_bits) &&            \
+    (squeeze_min_len_bits <= (int)(len_bits)) &&                                \
+                        ((int)(len_bits) <= squeeze_max_len_bits) ?             \
+    (size_t)squeeze_size_implementation((win_bits), (map_bits), (len_bits),     \
+                                        (options)) : 0                          \
 )
 
+#define squeeze_sizeof(win_bits, map_bits, len_bits)                            \
+    squeeze_sizeof_with((win_bits), (map_bits), (len_bits), 0)
+
 typedef struct {
     // `win_bits` is a log2 of window size in bytes in range
     // [squeeze_min_win_bits..squeeze_max_win_bits]
+    // `flags` combination of squeeze_flag_* bits
+    // `options` combination of squeeze_option_* bits
+    // init() memory size must be squeeze_sizeof_with(..., options)
+    errno_t (*init)(squeeze_type* s, void* memory, size_t size,
+                    uint8_t win_bits, uint8_t map_bits, uint8_t len_bits,
+                    uint32_t options);
+    // new() allocates and initializes context on the heap
+    squeeze_type* (*new)(bitstream_type* bs, uint8_t win_bits,
+                         uint8_t map_bits, uint8_t len_bits, uint32_t options);
+    // new_in() places context into the arena (see arena.h: huge pages,
+    // NUMA node, memory that was never used is not cleared again)
+    squeeze_type* (*new_in)(arena_type* a, bitstream_type* bs,
+                            uint8_t win_bits, uint8_t map_bits,
+                            uint8_t len_bits, uint32_t options);
+    void (*delete)(squeeze_type* s);
+    // fini() stops worker threads of squeeze_option_parallel that live as
+    // long as the context. delete() calls it, contexts placed by init()
+    // must call it before their memory is released.
+    void (*fini)(squeeze_type* s);
+    // clear() makes the context ready for an independent stream with the
+    // same parameters and options, cheaper than init() of the whole memory
+    void (*clear)(squeeze_type* s);
+    // `id` of the dictionary is written when squeeze_flag_dictionary is set
     void (*write_header)(bitstream_type* bs, uint64_t bytes,
-                         uint8_t win_bits, uint8_t map_bits, uint8_t len_bits);
+                         uint8_t win_bits, uint8_t map_bits, uint8_t len_bits,
+                         uint16_t flags, uint32_t id);
     void (*compress)(squeeze_type* s, const uint8_t* data, size_t bytes);
     void (*read_header)(bitstream_type* bs, uint64_t *bytes,
-                        uint8_t *win_bits, uint8_t *map_bits, uint8_t *len_bits);
+                        uint8_t *win_bits, uint8_t *map_bits, uint8_t *len_bits,
+                        uint16_t *flags, uint32_t *id);
     void (*decompress)(squeeze_type* s, uint8_t* data, size_t bytes);
+    // train() learns words and frequencies by compressing `data` into
+    // nothing, may be called for several samples
+    void (*train)(squeeze_type* s, const uint8_t* data, size_t bytes);
+    // dictionary() returns bytes of the image and writes it into `image`
+    // if `capacity` is sufficient
+    size_t (*dictionary)(const squeeze_type* s, uint32_t id,
+                         void* image, size_t capacity);
+    // prime() loads image into just initialized context of the same
+    // win_bits, map_bits and len_bits
+    errno_t (*prime)(squeeze_type* s, const void* image, size_t bytes);
+    // Append-only streams (squeeze_option_resume, no filters):
+    // checkpoint() returns bytes of the snapshot and writes it into
+    // `image` if `capacity` is sufficient.
+    size_t (*checkpoint)(const squeeze_type* s, void* image, size_t capacity);
+    // restore() loads snapshot into just initialized context and sets
+    // s->bs to continue at stream offset s->resume.bytes (the caller
+    // positions the output there and after compress() rewrites the
+    // first 8 bytes of the header with the new s->resume.total).
+    errno_t (*restore)(squeeze_type* s, const void* image, size_t bytes);
+    // Seekable format (no dictionary or resume option): compress_blocks()
+    // writes data into s->bs as independent blocks of `block` bytes plus
+    // the block index. decompress_range() reads [offset..offset + bytes)
+    // of the uncompressed data decoding only the blocks that cover it
+    // from s->bs->file positioned anywhere.
+    void (*compress_blocks)(squeeze_type* s, const uint8_t* data,
+                            size_t bytes, size_t block);
+    errno_t (*decompress_range)(squeeze_type* s, uint64_t offset,
+                                uint8_t* data, size_t bytes);
+    // stats() reports counters collected with squeeze_option_stats (zero
+    // without it) together with dictionary load and tree statistics
+    void (*stats)(const squeeze_type* s, squeeze_stats_type* stats);
+    // trace() writes events recorded with squeeze_option_trace as Chrome
+    // trace JSON (chrome://tracing or ui.perfetto.dev) with a timeline
+    // per thread and sampled stage times per event
+    errno_t (*trace)(const squeeze_type* s, FILE* f);
+    // tune() chooses win_bits, map_bits and len_bits for `data` (see
+    // squeeze_tune_type), ENOMEM if no context fits t->memory
+    errno_t (*tune)(const uint8_t* data, size_t bytes, squeeze_tune_type* t);
+    // Batch format (see squeeze_record_type): compress_batch() writes
+    // `n` records into `bs` (at a 64 bit word boundary) and sets their
+    // position and size. decompress_batch() reads the index into
+    // records[0..*n) and decodes records into their outputs, only the
+    // index is filled if any output is null. E2BIG and number of
+    // records in `*n` when `records` is null or not large enough.
+    // `b` (may be null) of decompress_batch() gives the dictionary image
+    // and options, parameters and flags come from the header. Both keep
+    // their worker contexts in `b` until dispose_batch().
+    errno_t (*compress_batch)(bitstream_type* bs, squeeze_batch_type* b,
+                              squeeze_record_type records[], size_t n);
+    errno_t (*decompress_batch)(squeeze_batch_type* b,
+                                const void* batch, size_t bytes,
+                                squeeze_record_type records[], size_t *n);
+    void (*dispose_batch)(squeeze_batch_type* b);
 } squeeze_interface;
 
 extern squeeze_interface squeeze;
 
-#if 0 
+#endif // squeeze_header_included
 
-// TODO: consider inclusion of these two functions for convinience:
+#if defined(squeeze_implementation) && !defined(squeeze_implemented)
 
-static squeeze_type* squeeze_new(bitstream_type* bs, uint8_t win_bits,
-                                 uint8_t map_bits, uint8_t len_bits) {
-    const uint64_t bytes = squeeze_sizeof(win_bits, map_bits, len_bits);
-    squeeze_type* s = (squeeze_type*)calloc(1, (size_t)bytes);
-    if (s != null) {
-        squeeze_init_with(s, s, bytes, win_bits, map_bits, len_bits);
-        s->bs = bs;
-    }
-    return s;
-}
+#define squeeze_implemented
 
-static void squeeze_delete(squeeze_type* s) {
-    free(s);
-}
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
 
+#ifdef _WIN32
+#include <windows.h> // QueryPerformanceCounter()
 #endif
 
-#endif // squeeze_header_included
-
-#if defined(squeeze_implementation) && !defined(squeeze_implemented)
-
-#define squeeze_implemented
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define squeeze_rdtsc
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define squeeze_rdtsc
+#endif
 
 #include "bitstream.h"
 
@@ -115,6 +584,54 @@ static void squeeze_delete(squeeze_type* s) {
 #include <assert.h>
 #endif
 
+#if defined(_MSC_VER)
+#define squeeze_inline __forceinline
+#else
+#define squeeze_inline inline __attribute__((always_inline))
+#endif
+
+// Hot loops call bitstream, huffman and map implementations directly when
+// they are compiled into the same translation unit ahead of squeeze (like
+// test.c does) so the compiler can inline them; otherwise via interfaces.
+
+#if defined(bitstream_implemented)
+#define squeeze_put_bits(...) bitstream_write_bits(__VA_ARGS__)
+#define squeeze_get_bits(...) bitstream_read_bits(__VA_ARGS__)
+#else
+#define squeeze_put_bits(...) bitstream.write_bits(__VA_ARGS__)
+#define squeeze_get_bits(...) bitstream.read_bits(__VA_ARGS__)
+#endif
+
+#if defined(huffman_implemented)
+#define squeeze_inc_frequency(...) huffman_inc_frequency(__VA_ARGS__)
+#else
+#define squeeze_inc_frequency(...) huffman.inc_frequency(__VA_ARGS__)
+#endif
+
+#if defined(map_implemented)
+#define squeeze_map_put(...)   map_put(__VA_ARGS__)
+#define squeeze_map_best(...)  map_best(__VA_ARGS__)
+#define squeeze_map_data(...)  map_data(__VA_ARGS__)
+#define squeeze_map_bytes(...) map_bytes(__VA_ARGS__)
+#else
+#define squeeze_map_put(...)   map.put(__VA_ARGS__)
+#define squeeze_map_best(...)  map.best(__VA_ARGS__)
+#define squeeze_map_data(...)  map.data(__VA_ARGS__)
+#define squeeze_map_bytes(...) map.bytes(__VA_ARGS__)
+#endif
+
+#if defined(squeeze_no_stats)
+#define squeeze_stats_on(s) false
+#else
+#define squeeze_stats_on(s) (((s)->options & squeeze_option_stats) != 0)
+#endif
+
+#if defined(squeeze_no_trace)
+#define squeeze_trace_on(s) false
+#else
+#define squeeze_trace_on(s) (((s)->options & squeeze_option_trace) != 0)
+#endif
+
 #define squeeze_if_error_return(s) do { \
     if (s->error) { return; }           \
 } while (0)
@@ -124,37 +641,477 @@ static void squeeze_delete(squeeze_type* s) {
     return;                             \
 } while (0)
 
-static inline void squeeze_write_bit(squeeze_type* s, bool bit) {
+static errno_t squeeze_init(squeeze_type* s, void* memory, size_t size,
+                            uint8_t win_bits, uint8_t map_bits,
+                            uint8_t len_bits, uint32_t options) {
+    errno_t r = 0;
+    assert(squeeze_min_win_bits <= win_bits && win_bits <= squeeze_max_win_bits);
+    assert(squeeze_min_map_bits <= map_bits && map_bits <= squeeze_max_map_bits);
+    assert(squeeze_min_len_bits <= len_bits && len_bits <= squeeze_max_len_bits);
+    size_t expected = squeeze_sizeof_with(win_bits, map_bits, len_bits, options);
+    // 167,936,192 bytes for (win_bits = 11, map_bits = 19)
+    assert(size == expected);
+    if (expected == 0 || memory == null || size != expected) {
+        r = EINVAL;
+    } else {
+        uint8_t* p = (uint8_t*)memory;
+        memset(s, 0, sizeof(squeeze_type));
+        p += sizeof(squeeze_type);
+        const size_t map_n = ((size_t)1U) << map_bits;
+        const size_t dic_n = map_n;
+        const size_t sym_n = 256; // always 256
+        const size_t pos_n = ((size_t)1U) << win_bits;
+        const size_t len_n = ((size_t)1U) << len_bits;
+        const size_t dic_m = dic_n * 2 - 1;
+        const size_t sym_m = sym_n * 2 - 1;
+        const size_t pos_m = pos_n * 2 - 1;
+        const size_t len_m = len_n * 2 - 1;
+        const size_t used_n = (size_t)map_used_n(map_n);
+        if (options & squeeze_option_refs) {
+            s->map_refs  = (map_ref_t*)p; p += sizeof(map_ref_t) * map_n;
+        } else {
+            s->map_entries = (map_entry_t*)p; p += sizeof(map_entry_t) * map_n;
+        }
+        s->map_used = (int32_t*)p; p += sizeof(int32_t) * used_n;
+        s->map_nodes = (map_node_t*)p; p += sizeof(map_node_t) * map_n * 4;
+        if (options & squeeze_option_pipeline) {
+            s->tokens = (squeeze_token_type*)p;
+            p += sizeof(squeeze_token_type) * squeeze_pipeline_tokens;
+        }
+        if (options & squeeze_option_parallel) {
+            s->matches = (squeeze_match_type*)p;
+            p += sizeof(squeeze_match_type) * squeeze_parallel_chunk;
+            s->workers = squeeze_parallel_workers;
+        }
+        if (options & squeeze_option_resume) {
+            s->history = p;
+            p += pos_n;
+        }
+        if (options & squeeze_option_long) {
+            s->long_index = (uint64_t*)p;
+            p += sizeof(uint64_t) * (1ULL << squeeze_long_bits);
+            if ((options & squeeze_option_zeroed) == 0) {
+                memset(s->long_index, 0,
+                       sizeof(uint64_t) * (1ULL << squeeze_long_bits));
+            }
+        }
+        s->dic_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * dic_m;
+        s->sym_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * sym_m;
+        s->pos_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * pos_m;
+        s->len_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * len_m;
+        assert(p == (uint8_t*)memory + size);
+        if (options & squeeze_option_refs) {
+            map.init_refs(&s->map, s->map_refs, map_n);
+        } else if (options & squeeze_option_zeroed) {
+            map.init_zeroed(&s->map, s->map_entries, map_n);
+        } else {
+            map.init(&s->map, s->map_entries, map_n);
+        }
+        map.track(&s->map, s->map_used, used_n);
+        if (options & squeeze_option_zeroed) {
+            map.index_zeroed(&s->map, s->map_nodes, map_n * 4);
+        } else {
+            map.index(&s->map, s->map_nodes, map_n * 4);
+        }
+        huffman.init(&s->sym, s->sym_nodes, sym_m);
+        huffman.init(&s->dic, s->dic_nodes, dic_m);
+        huffman.init(&s->pos, s->pos_nodes, pos_m);
+        huffman.init(&s->len, s->len_nodes, len_m);
+        s->options = options;
+        s->memory = memory;
+        s->size = size;
+        s->trace.sampler[0].stage = -1;
+        s->trace.sampler[1].stage = -1;
+    }
+    return r;
+}
+
+static squeeze_type* squeeze_new(bitstream_type* bs, uint8_t win_bits,
+                                 uint8_t map_bits, uint8_t len_bits,
+                                 uint32_t options) {
+    const size_t bytes = squeeze_sizeof_with(win_bits, map_bits, len_bits,
+                                             options);
+    // large calloc() gets fresh zero pages from the OS
+    squeeze_type* s = bytes == 0 ? null : (squeeze_type*)calloc(1, bytes);
+    if (s != null) {
+        if (squeeze_init(s, s, bytes, win_bits, map_bits, len_bits,
+                         options | squeeze_option_zeroed) != 0) {
+            free(s);
+            s = null;
+        } else {
+            s->bs = bs;
+        }
+    }
+    return s;
+}
+
+static squeeze_type* squeeze_new_in(arena_type* a, bitstream_type* bs,
+                                    uint8_t win_bits, uint8_t map_bits,
+                                    uint8_t len_bits, uint32_t options) {
+    enum { page = 4096 };
+    const size_t bytes = squeeze_sizeof_with(win_bits, map_bits, len_bits,
+                                             options);
+    bool zeroed = false;
+    squeeze_type* s = bytes == 0 ? null :
+                      (squeeze_type*)arena.alloc(a, bytes, page, &zeroed);
+    if (s != null) {
+        options = zeroed ? options | squeeze_option_zeroed :
+                           options & ~(uint32_t)squeeze_option_zeroed;
+        if (squeeze_init(s, s, bytes, win_bits, map_bits, len_bits,
+                         options) != 0) {
+            arena.free(a, s, bytes);
+            s = null;
+        } else {
+            s->bs = bs;
+            s->arena = a;
+        }
+    }
+    return s;
+}
+
+static void squeeze_fini(squeeze_type* s);
+
+static void squeeze_delete(squeeze_type* s) {
+    squeeze_fini(s);
+    if (s->arena != null) {
+        arena.free(s->arena, s, s->size);
+    } else {
+        free(s);
+    }
+}
+
+static inline int32_t squeeze_log2(uint64_t v) { // floor, 0 for 0
+    int32_t k = 0;
+    while (v >>= 1) { k++; }
+    return k;
+}
+
+// called per token only when squeeze_stats_on(s)
+
+static void squeeze_count(squeeze_type* s, uint8_t kind, uint64_t len,
+                          uint64_t pos, bool escape) {
+    squeeze_stats_type* st = &s->stats;
+    st->bytes += len;
+    if (kind == squeeze_token_literal) {
+        st->literals++;
+    } else if (kind == squeeze_token_word) {
+        st->words++;
+        st->length[squeeze_log2(len)]++;
+    } else {
+        st->matches++;
+        if (escape || kind == squeeze_token_long) { st->escapes++; }
+        st->length[squeeze_log2(len)]++;
+        st->distance[squeeze_log2(pos)]++;
+    }
+}
+
+// Trace: time is taken per block and per sampled token, never per symbol.
+// Search side stages (search, lookup) and coder side stages (coding, io)
+// run on different threads when pipelined, each side has its sampler.
+
+enum { squeeze_side_search = 0, squeeze_side_coder = 1 };
+
+// monotonic: wall clock adjustments must not reorder or stretch events
+
+static uint64_t squeeze_ns(void) {
+    #ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        const uint64_t f = (uint64_t)frequency.QuadPart;
+        const uint64_t c = (uint64_t)counter.QuadPart;
+        return c / f * 1000000000ULL + c % f * 1000000000ULL / f;
+    #else
+        struct timespec ts = {0};
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    #endif
+}
+
+static inline uint64_t squeeze_ticks(void) {
+    #if defined(squeeze_rdtsc)
+        return __rdtsc();
+    #elif defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+        return ticks;
+    #else
+        return squeeze_ns();
+    #endif
+}
+
+// starts timing of every squeeze_trace_every-th token in `stage`
+
+static squeeze_inline void squeeze_sample_begin(squeeze_type* s, int32_t side,
+                                                int32_t stage) {
+    if (squeeze_trace_on(s)) {
+        squeeze_sampler_type* sp = &s->trace.sampler[side];
+        if (++sp->count >= squeeze_trace_every) {
+            sp->count = 0;
+            sp->stage = stage;
+            sp->last = squeeze_ticks();
+        }
+    }
+}
+
+// switches sampled token to `stage`, -1 ends the sample
+
+static squeeze_inline void squeeze_sample(squeeze_type* s, int32_t side,
+                                          int32_t stage) {
+    if (squeeze_trace_on(s) && s->trace.sampler[side].stage >= 0) {
+        squeeze_sampler_type* sp = &s->trace.sampler[side];
+        const uint64_t now = squeeze_ticks();
+        sp->ticks[sp->stage] += now - sp->last;
+        sp->last = now;
+        sp->stage = stage;
+    }
+}
+
+static void squeeze_trace_origin(squeeze_type* s) {
+    if (s->trace.origin == 0) {
+        s->trace.origin = squeeze_ns();
+        s->trace.origin_ticks = squeeze_ticks();
+    }
+}
+
+typedef struct {
+    uint64_t start; // ns
+    uint64_t at;    // data[at] the span started
+    uint64_t ticks[squeeze_stages]; // sampled ticks at start
+    uint32_t thread;
+    uint32_t kind;
+    uint32_t sides; // bit mask of samplers the thread owns
+} squeeze_span_type;
+
+static void squeeze_span_begin(squeeze_type* s, squeeze_span_type* span,
+                               uint64_t at) {
+    span->start = squeeze_ns();
+    span->at = at;
+    for (int32_t k = 0; k < squeeze_stages; k++) {
+        span->ticks[k] = 0;
+        for (int32_t side = 0; side < 2; side++) {
+            if (span->sides & (1U << side)) {
+                span->ticks[k] += s->trace.sampler[side].ticks[k];
+            }
+        }
+    }
+}
+
+static void squeeze_record(squeeze_type* s, const squeeze_event_type* e) {
+    const uint64_t k = atomic_fetch_add(&s->trace.count, 1);
+    if (s->trace.event != null && k < s->trace.capacity) {
+        s->trace.event[k] = *e;
+    }
+}
+
+static void squeeze_span_end(squeeze_type* s, squeeze_span_type* span,
+                             uint64_t at) {
+    const uint64_t now = squeeze_ns();
+    squeeze_event_type e = {
+        .start = span->start - s->trace.origin,
+        .duration = now - span->start,
+        .bytes = at - span->at,
+        .thread = span->thread,
+        .kind = span->kind
+    };
+    for (int32_t k = 0; k < squeeze_stages; k++) {
+        uint64_t ticks = 0;
+        for (int32_t side = 0; side < 2; side++) {
+            if (span->sides & (1U << side)) {
+                ticks += s->trace.sampler[side].ticks[k];
+            }
+        }
+        e.stage[k] = (ticks - span->ticks[k]) * squeeze_trace_every;
+    }
+    squeeze_record(s, &e);
+    if (span->thread == squeeze_thread_coder) {
+        s->trace.ns = now;
+        s->trace.ticks = squeeze_ticks();
+    }
+}
+
+// ends the span at data[at] and starts the next one once it covers
+// squeeze_trace_block bytes or when `last`
+
+static squeeze_inline void squeeze_span(squeeze_type* s,
+        squeeze_span_type* span, uint64_t at, bool last) {
+    if (squeeze_trace_on(s) && at > span->at &&
+        (last || at - span->at >= squeeze_trace_block)) {
+        squeeze_span_end(s, span, at);
+        squeeze_span_begin(s, span, at);
+    }
+}
+
+// Sub-streams (squeeze_flag_streams): literal symbols go into the literal
+// stream, position symbols and far distances into the position stream
+// and the rest of the tokens (flags, lengths, words, escaped lengths and
+// checksums) into the token stream. Each adaptive tree is only updated
+// by the symbols of one stream. The streams are written after the header
+// as a table of 64 bit words (literals, literal stream bytes, positions,
+// position stream bytes, token stream bytes) followed by the literal,
+// position and token streams. The decoder reads them and decodes literals
+// and positions on threads of their own while the calling thread decodes
+// the token stream and takes literals and positions in order.
+
+enum {
+    squeeze_stream_lit = 0,
+    squeeze_stream_pos = 1,
+    squeeze_stream_tok = 2,
+    squeeze_streams    = 3,
+    squeeze_stream_publish = 64 // decoded symbols per release
+};
+
+#define squeeze_far (1ULL << 63) // decoded position is a far distance
+
+typedef struct {
+    bitstream_type bs; // memory stream
+    huffman_tree_type* t;
+    uint64_t count;  // symbols in the stream
+    uint8_t*  byte;  // decoded literals
+    uint64_t* value; // decoded positions (| squeeze_far)
+    uint64_t  next;  // token decoder: next symbol to take
+    uint64_t  seen;  // token decoder: ready symbols seen
+    bool      far;   // position stream with squeeze_flag_long
+    bool      started;
+    thrd_t    thread;
+    _Atomic(uint64_t) ready; // symbols decoded
+    _Atomic(int32_t)  error;
+    atomic_bool       quit;
+} squeeze_stream_type;
+
+typedef struct squeeze_streams_struct {
+    squeeze_stream_type stream[squeeze_streams];
+    bitstream_type* bs; // of the context replaced by the token stream
+} squeeze_streams_type;
+
+// encoder streams grow: every write finds room for a whole word
+
+static void squeeze_stream_grow(squeeze_type* s, bitstream_type* bs) {
+    const size_t capacity = (size_t)bs->capacity * 2;
+    uint8_t* data = (uint8_t*)realloc(bs->data, capacity);
+    if (data == null) {
+        s->error = ENOMEM;
+    } else {
+        bs->data = data;
+        bs->capacity = capacity;
+    }
+}
+
+static inline void squeeze_write_to(squeeze_type* s, bitstream_type* bs,
+                                    uint64_t b64, uint8_t bits) {
+    if (s->streams != null && bs->capacity - bs->bytes < 8) {
+        squeeze_stream_grow(s, bs);
+    }
     if (s->error == 0) {
-        bitstream.write_bit(s->bs, bit);
-        s->error = s->bs->error;
+        squeeze_sample(s, squeeze_side_coder, squeeze_stage_io);
+        squeeze_put_bits(bs, b64, bits);
+        s->error = bs->error;
+        squeeze_sample(s, squeeze_side_coder, squeeze_stage_coding);
     }
 }
 
 static inline void squeeze_write_bits(squeeze_type* s,
                                       uint64_t b64, uint8_t bits) {
-    if (s->error == 0) {
-        bitstream.write_bits(s->bs, b64, bits);
-        s->error = s->bs->error;
-    }
+    squeeze_write_to(s, s->bs, b64, bits);
+}
+
+static inline void squeeze_write_bit(squeeze_type* s, bool bit) {
+    squeeze_write_bits(s, bit, 1);
 }
 
-static inline void squeeze_write_number(squeeze_type* s,
+static inline void squeeze_write_number(squeeze_type* s, bitstream_type* bs,
                                         uint64_t bits, uint8_t base) {
     while (s->error == 0 && bits != 0) {
-        squeeze_write_bits(s, bits, base);
+        squeeze_write_to(s, bs, bits, base);
         bits >>= base;
-        squeeze_write_bit(s, bits != 0); // continue bit
+        squeeze_write_to(s, bs, bits != 0, 1); // continue bit
     }
 }
 
+// sub-stream of the tree symbols or null for the token stream
+
+static inline squeeze_stream_type* squeeze_stream_of(squeeze_type* s,
+        const huffman_tree_type* t) {
+    squeeze_streams_type* ss = s->streams;
+    if (ss == null) { return null; }
+    return t == &s->sym ? &ss->stream[squeeze_stream_lit] :
+           t == &s->pos ? &ss->stream[squeeze_stream_pos] : null;
+}
+
 static inline void squeeze_write_huffman(squeeze_type* s, huffman_tree_type* t,
                                          int32_t i) {
     assert(t != null && t->node != null);
     assert(0 <= i && i < t->n); // leaf symbol
-    assert(1 <= t->node[i].bits && t->node[i].bits < 64);
-    squeeze_write_bits(s, t->node[i].path, (uint8_t)t->node[i].bits);
-    huffman.inc_frequency(t, i); // after the path is written
+    if (!t->built) { huffman.build(t); }
+    assert(1 <= t->node[i].bits && t->node[i].bits <= huffman_max_bits);
+    squeeze_stream_type* st = squeeze_stream_of(s, t);
+    // single word emit: path never exceeds huffman_max_bits
+    squeeze_write_to(s, st != null ? &st->bs : s->bs, t->node[i].path,
+                     (uint8_t)t->node[i].bits);
+    if (st != null) { st->count++; }
+    squeeze_inc_frequency(t, i); // after the path is written
+}
+
+// streams memory is little-endian 64 bit words of the bitstream
+
+static void squeeze_stream_put(bitstream_type* out, const uint8_t* p,
+                               uint64_t bytes) {
+    for (uint64_t i = 0; i < bytes && out->error == 0; i += 8) {
+        uint64_t word = 0;
+        for (int32_t j = 0; j < 8; j++) {
+            word |= (uint64_t)p[i + (uint64_t)j] << (j * 8);
+        }
+        bitstream.write_bits(out, word, 64);
+    }
+}
+
+static void squeeze_stream_get(bitstream_type* in, uint8_t* p,
+                               uint64_t bytes) {
+    for (uint64_t i = 0; i < bytes && in->error == 0; i += 8) {
+        const uint64_t word = bitstream.read_bits(in, 64);
+        for (int32_t j = 0; j < 8; j++) {
+            p[i + (uint64_t)j] = (uint8_t)(word >> (j * 8));
+        }
+    }
+}
+
+// s->bs is replaced by the token stream until squeeze_streams_write()
+
+static void squeeze_streams_begin(squeeze_type* s, squeeze_streams_type* ss,
+                                  uint64_t bytes) {
+    memset(ss, 0x00, sizeof(*ss));
+    const size_t capacity = (size_t)(bytes / 8) + 4096;
+    for (int32_t k = 0; k < squeeze_streams && s->error == 0; k++) {
+        bitstream_type* bs = &ss->stream[k].bs;
+        bs->data = (uint8_t*)malloc(capacity);
+        bs->capacity = capacity;
+        if (bs->data == null) { s->error = ENOMEM; }
+    }
+    ss->bs = s->bs;
+    s->bs = &ss->stream[squeeze_stream_tok].bs;
+    s->streams = ss;
+}
+
+static void squeeze_streams_write(squeeze_type* s, squeeze_streams_type* ss) {
+    s->bs = ss->bs;
+    s->streams = null;
+    squeeze_stream_type* st = ss->stream;
+    for (int32_t k = 0; k < squeeze_streams && s->error == 0; k++) {
+        bitstream.flush(&st[k].bs);
+        s->error = st[k].bs.error;
+    }
+    if (s->error == 0) {
+        bitstream.write_bits(s->bs, st[squeeze_stream_lit].count, 64);
+        bitstream.write_bits(s->bs, st[squeeze_stream_lit].bs.bytes, 64);
+        bitstream.write_bits(s->bs, st[squeeze_stream_pos].count, 64);
+        bitstream.write_bits(s->bs, st[squeeze_stream_pos].bs.bytes, 64);
+        bitstream.write_bits(s->bs, st[squeeze_stream_tok].bs.bytes, 64);
+        for (int32_t k = 0; k < squeeze_streams; k++) {
+            squeeze_stream_put(s->bs, st[k].bs.data, st[k].bs.bytes);
+        }
+        s->error = s->bs->error;
+    }
+    for (int32_t k = 0; k < squeeze_streams; k++) { free(st[k].bs.data); }
 }
 
 static inline void squeeze_flush(squeeze_type* s) {
@@ -164,186 +1121,907 @@ static inline void squeeze_flush(squeeze_type* s) {
     }
 }
 
+// squeeze_flag_checksum: CRC32C of data[s->checked..i) whole blocks is
+// written (`encode`) or read and compared. Block CRCs are combined into
+// the CRC of the whole input on the fly so the data is read only once.
+
+static void squeeze_checksum_blocks(squeeze_type* s, const uint8_t* data,
+                                    uint64_t i, bool encode) {
+    while (s->error == 0 && i - s->checked >= squeeze_checksum_block) {
+        const uint32_t crc = checksum.crc32c(0, data + s->checked,
+                                             squeeze_checksum_block);
+        s->crc_checked = checksum.combine(s->crc_checked, crc,
+                                          squeeze_checksum_block);
+        if (encode) {
+            squeeze_write_bits(s, crc, 32);
+        } else if (squeeze_get_bits(s->bs, 32) != crc) {
+            s->error = s->bs->error != 0 ? s->bs->error : EBADMSG;
+        }
+        s->checked += squeeze_checksum_block;
+    }
+}
+
+static inline void squeeze_checksum(squeeze_type* s, const uint8_t* data,
+                                    uint64_t i, bool encode) {
+    if ((s->flags & squeeze_flag_checksum) &&
+        i - s->checked >= squeeze_checksum_block) {
+        squeeze_checksum_blocks(s, data, i, encode);
+    }
+}
+
+// CRC32C of the last partial block and of the whole input. Filters
+// change the coded data, then the whole input CRC is of the unfiltered
+// data: s->crc computed by compress() and checked by decompress().
+
+static void squeeze_checksum_final(squeeze_type* s, const uint8_t* data,
+                                   uint64_t bytes, bool encode) {
+    squeeze_checksum_blocks(s, data, bytes, encode);
+    const uint32_t last = checksum.crc32c(0, data + s->checked,
+                                          (size_t)(bytes - s->checked));
+    s->crc_checked = checksum.combine(s->crc_checked, last,
+                                      bytes - s->checked);
+    const bool filtered = (s->flags & squeeze_flags_filter) != 0;
+    if (encode) {
+        squeeze_write_bits(s, last, 32);
+        squeeze_write_bits(s, filtered ? s->crc : s->crc_checked, 32);
+    } else if (s->error == 0) {
+        const uint32_t partial = (uint32_t)bitstream.read_bits(s->bs, 32);
+        s->crc = (uint32_t)bitstream.read_bits(s->bs, 32);
+        if (s->bs->error != 0) {
+            s->error = s->bs->error;
+        } else if (partial != last || (!filtered && s->crc != s->crc_checked)) {
+            s->error = EBADMSG;
+        }
+    }
+    s->checked = bytes;
+}
+
 static void squeeze_write_header(bitstream_type* bs, uint64_t bytes,
                                  uint8_t win_bits, uint8_t map_bits,
-                                 uint8_t len_bits) {
+                                 uint8_t len_bits, uint16_t flags,
+                                 uint32_t id) {
     if (win_bits < squeeze_min_win_bits || win_bits > squeeze_max_win_bits ||
         map_bits < squeeze_min_map_bits || map_bits > squeeze_max_map_bits ||
-        len_bits < squeeze_min_len_bits || len_bits > squeeze_max_len_bits) {
+        len_bits < squeeze_min_len_bits || len_bits > squeeze_max_len_bits ||
+        (flags & ~squeeze_flags_all) != 0 ||
+        ((flags & squeeze_flag_dictionary) != 0) != (id != 0)) {
         bs->error = EINVAL;
     } else {
         enum { bits64 = sizeof(uint64_t) * 8 };
         bitstream.write_bits(bs, (uint64_t)bytes, bits64);
+        bitstream.write_bits(bs, squeeze_magic, sizeof(uint32_t) * 8);
         enum { bits8 = sizeof(uint8_t) * 8 };
         bitstream.write_bits(bs, win_bits, bits8);
         bitstream.write_bits(bs, map_bits, bits8);
         bitstream.write_bits(bs, len_bits, bits8);
+        bitstream.write_bits(bs, flags, sizeof(uint16_t) * 8);
+        if (flags & squeeze_flag_dictionary) {
+            bitstream.write_bits(bs, id, sizeof(uint32_t) * 8);
+        }
     }
 }
 
-static double squeeze_entropy(uint64_t freq[], int32_t n) {
-    double total = 0;
-    double aha_entropy = 0.0;
-    for (int32_t i = 0; i < n; i++) { total += (double)freq[i]; }
-    for (int32_t i = 0; i < n; i++) {
-        if (freq[i] > 0) {
-            double p_i = (double)freq[i] / total;
-            aha_entropy += p_i * log2(p_i);
-        }
-    }
-    return -aha_entropy;
+static int32_t squeeze_put_word(squeeze_type* s, const uint8_t* word,
+                                uint64_t bytes) {
+    enum { max_bytes = sizeof(map_entry_t) - 1 };
+    size_t word_bytes = bytes < max_bytes ? bytes : max_bytes;
+    assert(word_bytes <= 0xFF);
+    return squeeze_map_put(&s->map, word, (uint8_t)word_bytes);
 }
 
 static void squeeze_add_to_dictionary(squeeze_type* s, const uint8_t* word,
                                       uint64_t bytes) {
-    size_t word_bytes = bytes < countof(s->map_entries[0]) - 1 ?
-                        bytes : countof(s->map_entries[0]) - 1;
-    assert(word_bytes <= 0xFF);
-    int32_t wix = map.put(&s->map, word, (uint8_t)word_bytes);
+    int32_t wix = squeeze_put_word(s, word, bytes);
     if (wix >= 0) {
-        huffman.inc_frequency(&s->dic, wix);
+        squeeze_inc_frequency(&s->dic, wix);
     }
 }
 
-static void squeeze_compress(squeeze_type* s, const uint8_t* data, uint64_t bytes) {
-    squeeze_if_error_return(s);
-    const uint8_t win_bits = huffman.log2_of_pow2(s->pos.n);
-    const uint8_t len_bits = huffman.log2_of_pow2(s->len.n);
-    if (win_bits < 10 || win_bits > 20) { squeeze_return_invalid(s); }
-    const size_t window = ((size_t)1U) << win_bits;
-    const uint8_t base = (win_bits - 4) / 2;
-    size_t i = 0;
-    while (i < bytes) {
-        // bytes and position of longest matching sequence
-        size_t len = 0;
-        size_t pos = 0;
-        if (i >= 1) {
-            size_t j = i - 1;
-            size_t min_j = i > window ? i - window : 0;
-            while (j > min_j) {
-                assert((i - j) < window);
-                const size_t n = bytes - i;
-                size_t k = 0;
-                while (k < n && data[j + k] == data[i + k]) {
-                    k++;
-                }
-                if (k > len) {
-                    len = k;
-                    pos = i - j;
-                }
-                j--;
+// Match search only depends on the data and the dictionary `map`
+// while the encoder only depends on the Huffman trees and bitstream.
+// squeeze_find() may run on a separate thread ahead of squeeze_encode().
+
+// bytes and position of longest matching sequence not longer than `cap`
+
+static size_t squeeze_longest(const uint8_t* data, size_t bytes, size_t i,
+                              size_t window, size_t cap, size_t *distance) {
+    size_t len = 0;
+    size_t pos = 0;
+    if (i >= 1) {
+        size_t j = i - 1;
+        size_t min_j = i > window ? i - window : 0;
+        const size_t n = bytes - i < cap ? bytes - i : cap;
+        while (j > min_j) {
+            assert((i - j) < window);
+            size_t k = 0;
+            while (k < n && data[j + k] == data[i + k]) {
+                k++;
+            }
+            if (k > len) {
+                len = k;
+                pos = i - j;
             }
+            j--;
+        }
+    }
+    *distance = pos;
+    return len;
+}
+
+// Capped search of [from..to) positions. Matches shorter than the cap are
+// exact. Capped positions and the positions that follow them (inside
+// the same long match, where a search would cost the most and the parse
+// rarely stops) are marked unknown and searched serially if needed.
+
+typedef struct {
+    const uint8_t* data;
+    size_t bytes;
+    size_t window;
+    size_t from;
+    size_t to;
+    squeeze_match_type* match; // match[0] for data[from]
+    bool     trace;
+    uint64_t start; // ns, squeeze_option_trace only
+    uint64_t end;
+} squeeze_worker_type;
+
+static int squeeze_worker(void* p) {
+    squeeze_worker_type* w = (squeeze_worker_type*)p;
+    if (w->trace) { w->start = squeeze_ns(); }
+    size_t run = 0; // positions since the last capped search
+    for (size_t i = w->from; i < w->to; i++) {
+        squeeze_match_type* m = &w->match[i - w->from];
+        if (0 < run && run < squeeze_parallel_cap) {
+            m->len = squeeze_match_unknown;
+            run++;
+        } else {
+            size_t pos = 0;
+            size_t len = squeeze_longest(w->data, w->bytes, i, w->window,
+                                         squeeze_parallel_cap, &pos);
+            m->pos = (uint32_t)pos;
+            m->len = len < squeeze_parallel_cap ?
+                     (uint16_t)len : squeeze_match_unknown;
+            run = len < squeeze_parallel_cap ? 0 : 1;
+        }
+    }
+    if (w->trace) { w->end = squeeze_ns(); }
+    return 0;
+}
+
+// Worker threads are started by the first search of the context and wait
+// for the next chunk until fini(). Each chunk bumps `chunk` and wakes all
+// of them, the first `active` search their segments while the calling
+// thread searches the last one and waits for `pending` to drop to zero.
+
+struct squeeze_pool_struct;
+
+typedef struct {
+    struct squeeze_pool_struct* pool;
+    int32_t k;
+} squeeze_pool_thread_type;
+
+typedef struct squeeze_pool_struct {
+    mtx_t   lock;
+    cnd_t   go;
+    cnd_t   done;
+    uint64_t chunk;  // generation of the segments in w[]
+    int32_t active;  // workers that search the chunk
+    int32_t pending; // of `active` still searching
+    int32_t threads; // started
+    bool    quit;
+    thrd_t  thread[squeeze_parallel_max_workers];
+    squeeze_pool_thread_type arg[squeeze_parallel_max_workers];
+    squeeze_worker_type w[squeeze_parallel_max_workers];
+} squeeze_pool_type;
+
+static int squeeze_pool_thread(void* p) {
+    squeeze_pool_type* pool = ((squeeze_pool_thread_type*)p)->pool;
+    const int32_t k = ((squeeze_pool_thread_type*)p)->k;
+    uint64_t chunk = 0;
+    mtx_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->chunk == chunk) {
+            cnd_wait(&pool->go, &pool->lock);
+        }
+        if (pool->quit) { break; }
+        chunk = pool->chunk;
+        if (k < pool->active) {
+            mtx_unlock(&pool->lock);
+            squeeze_worker(&pool->w[k]);
+            mtx_lock(&pool->lock);
+            if (--pool->pending == 0) { cnd_signal(&pool->done); }
+        }
+    }
+    mtx_unlock(&pool->lock);
+    return 0;
+}
+
+// returns number of threads available for searching (may be less than
+// requested or 0 if none could be started)
+
+static int32_t squeeze_pool_start(squeeze_type* s, int32_t n) {
+    if (s->pool == null) {
+        squeeze_pool_type* pool = (squeeze_pool_type*)calloc(1, sizeof(*pool));
+        if (pool == null) { return 0; }
+        if (mtx_init(&pool->lock, mtx_plain) != thrd_success) {
+            free(pool);
+            return 0;
+        }
+        if (cnd_init(&pool->go) != thrd_success) {
+            mtx_destroy(&pool->lock);
+            free(pool);
+            return 0;
+        }
+        if (cnd_init(&pool->done) != thrd_success) {
+            cnd_destroy(&pool->go);
+            mtx_destroy(&pool->lock);
+            free(pool);
+            return 0;
+        }
+        s->pool = pool;
+    }
+    squeeze_pool_type* pool = s->pool;
+    while (pool->threads < n) {
+        squeeze_pool_thread_type* a = &pool->arg[pool->threads];
+        *a = (squeeze_pool_thread_type){ .pool = pool, .k = pool->threads };
+        if (thrd_create(&pool->thread[pool->threads], squeeze_pool_thread,
+                        a) != thrd_success) {
+            break;
+        }
+        pool->threads++;
+    }
+    return pool->threads < n ? pool->threads : n;
+}
+
+static void squeeze_fini(squeeze_type* s) {
+    map.fini(&s->map);
+    squeeze_pool_type* pool = s->pool;
+    if (pool != null) {
+        mtx_lock(&pool->lock);
+        pool->quit = true;
+        cnd_broadcast(&pool->go);
+        mtx_unlock(&pool->lock);
+        for (int32_t k = 0; k < pool->threads; k++) {
+            thrd_join(pool->thread[k], null);
+        }
+        cnd_destroy(&pool->done);
+        cnd_destroy(&pool->go);
+        mtx_destroy(&pool->lock);
+        free(pool);
+        s->pool = null;
+    }
+}
+
+static void squeeze_search(squeeze_type* s, const uint8_t* data, size_t bytes,
+                           size_t i, size_t window) {
+    const size_t to = bytes - i < squeeze_parallel_chunk ?
+                      bytes : i + squeeze_parallel_chunk;
+    int32_t n = s->workers;
+    if (n < 1) { n = 1; }
+    if (n > squeeze_parallel_max_workers) { n = squeeze_parallel_max_workers; }
+    // the last segment is searched on the calling thread, segments of
+    // workers that could not be started too
+    const int32_t started = n > 1 ? squeeze_pool_start(s, n - 1) : 0;
+    squeeze_worker_type local[squeeze_parallel_max_workers];
+    squeeze_worker_type* w = started > 0 ? s->pool->w : local;
+    if (started > 0) { mtx_lock(&s->pool->lock); }
+    const size_t segment = (to - i + n - 1) / n;
+    for (int32_t k = 0; k < n; k++) {
+        const size_t from = i + segment * k < to ? i + segment * k : to;
+        w[k] = (squeeze_worker_type){
+            .data = data, .bytes = bytes, .window = window,
+            .from = from, .to = to - from < segment ? to : from + segment,
+            .match = s->matches + (from - i), .trace = squeeze_trace_on(s)
+        };
+    }
+    if (started > 0) {
+        squeeze_pool_type* pool = s->pool;
+        pool->active = started;
+        pool->pending = started;
+        pool->chunk++;
+        cnd_broadcast(&pool->go);
+        mtx_unlock(&pool->lock);
+    }
+    for (int32_t k = started; k < n; k++) { squeeze_worker(&w[k]); }
+    if (started > 0) {
+        squeeze_pool_type* pool = s->pool;
+        mtx_lock(&pool->lock);
+        while (pool->pending > 0) { cnd_wait(&pool->done, &pool->lock); }
+        mtx_unlock(&pool->lock);
+    }
+    for (int32_t k = 0; k < n && squeeze_trace_on(s); k++) {
+        const squeeze_event_type e = {
+            .start = w[k].start - s->trace.origin,
+            .duration = w[k].end - w[k].start,
+            .bytes = w[k].to - w[k].from,
+            .thread = squeeze_thread_worker + (uint32_t)k,
+            .kind = squeeze_event_search
+        };
+        squeeze_record(s, &e);
+    }
+    s->matches_from = i;
+    s->matches_to = to;
+}
+
+// Long distance matches: hashes of squeeze_long_block bytes sampled at
+// every block boundary of the input are kept in `long_index`. A block
+// that starts at the current position and is found farther than the
+// window is extended as far as it matches and skips the window search.
+// Entries are (epoch << 48 | position + 1): each compress() call starts
+// a new epoch instead of clearing the index.
+
+static inline uint64_t squeeze_long_hash(const uint8_t* d) {
+    uint64_t h = 0;
+    for (int32_t k = 0; k < squeeze_long_block; k += 8) {
+        uint64_t w;
+        memcpy(&w, d + k, sizeof(w));
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h >> (64 - squeeze_long_bits);
+}
+
+static size_t squeeze_find_long(squeeze_type* s, const uint8_t* data,
+                                size_t bytes, size_t i, size_t window,
+                                size_t *distance) {
+    while (s->long_indexed + squeeze_long_block <= i) {
+        const size_t p = (size_t)s->long_indexed;
+        s->long_index[squeeze_long_hash(data + p)] =
+            ((uint64_t)s->long_epoch << 48) | (p + 1);
+        s->long_indexed += squeeze_long_block;
+    }
+    if (bytes - i < squeeze_long_block) { return 0; }
+    const uint64_t e = s->long_index[squeeze_long_hash(data + i)];
+    const uint64_t c = e & ((1ULL << 48) - 1);
+    if (e >> 48 != s->long_epoch || c == 0 || i - (c - 1) < window) {
+        return 0;
+    }
+    const size_t j = (size_t)c - 1;
+    if (memcmp(data + j, data + i, squeeze_long_block) != 0) { return 0; }
+    size_t k = squeeze_long_block;
+    while (i + k < bytes && data[j + k] == data[i + k]) { k++; }
+    *distance = i - j;
+    return k;
+}
+
+static void squeeze_find(squeeze_type* s, const uint8_t* data, size_t bytes,
+                         size_t i, size_t window, squeeze_token_type* t) {
+    size_t len = squeeze_match_unknown;
+    size_t pos = 0;
+    if (s->flags & squeeze_flag_long) {
+        len = squeeze_find_long(s, data, bytes, i, window, &pos);
+        if (len > 0) {
+            t->kind = squeeze_token_long;
+            t->len  = len;
+            t->pos  = pos;
+            t->wix  = squeeze_put_word(s, &data[i], len);
+            return;
         }
-        if (len > 2) {
-            assert(0 < pos && pos < window);
-            squeeze_write_bits(s, 0b11, 2); // flags
+        len = squeeze_match_unknown;
+    }
+    if (s->matches != null) {
+        if (!(s->matches_from <= i && i < s->matches_to)) {
+            squeeze_search(s, data, bytes, i, window);
+        }
+        const squeeze_match_type* m = &s->matches[i - s->matches_from];
+        len = m->len;
+        pos = m->pos;
+    }
+    if (len == squeeze_match_unknown) {
+        len = squeeze_longest(data, bytes, i, window, bytes, &pos);
+    }
+    if (len > 2) {
+        assert(0 < pos && pos < window);
+        t->kind = squeeze_token_match;
+        t->len  = len;
+        t->pos  = pos;
+        t->wix  = squeeze_put_word(s, &data[i], len);
+    } else {
+        squeeze_sample(s, squeeze_side_search, squeeze_stage_lookup);
+        int32_t best = squeeze_map_best(&s->map, &data[i], bytes - i);
+        squeeze_sample(s, squeeze_side_search, squeeze_stage_search);
+        if (best >= 0) {
+            assert(squeeze_map_bytes(&s->map, best) >= 3);
+            t->kind = squeeze_token_word;
+            t->len  = squeeze_map_bytes(&s->map, best);
+            t->pos  = 0;
+            t->wix  = best;
+        } else {
+            t->kind = squeeze_token_literal;
+            t->len  = 1;
+            t->pos  = 0;
+            t->wix  = -1;
+            t->byte = data[i];
+        }
+    }
+}
+
+static squeeze_inline void squeeze_encode(squeeze_type* s,
+        const squeeze_token_type* t, uint8_t len_bits, uint8_t base) {
+    if (squeeze_stats_on(s)) {
+        squeeze_count(s, t->kind, t->len, t->pos,
+                      t->len >= (1ULL << len_bits));
+    }
+    if (t->kind == squeeze_token_match || t->kind == squeeze_token_long) {
+        squeeze_write_bits(s, 0b11, 2); // flags
+        squeeze_if_error_return(s);
+        if (t->len < (1ULL << len_bits)) {
+            squeeze_write_huffman(s, &s->len, (int32_t)t->len);
+        } else {
+            squeeze_write_huffman(s, &s->len, 0);
             squeeze_if_error_return(s);
-            if (len < (1ULL << len_bits)) {
-                squeeze_write_huffman(s, &s->len, (int32_t)len);
-            } else {
-                squeeze_write_huffman(s, &s->len, 0);
-                squeeze_if_error_return(s);
-                squeeze_write_number(s, len, base);
-            }
+            squeeze_write_number(s, s->bs, t->len, base);
+        }
+        squeeze_if_error_return(s);
+        if (t->kind == squeeze_token_long) {
+            squeeze_write_huffman(s, &s->pos, 0); // escape
             squeeze_if_error_return(s);
-            squeeze_write_huffman(s, &s->pos, (int32_t)pos);
+            squeeze_stream_type* st = squeeze_stream_of(s, &s->pos);
+            squeeze_write_number(s, st != null ? &st->bs : s->bs,
+                                 t->pos, squeeze_long_base);
+        } else {
+            squeeze_write_huffman(s, &s->pos, (int32_t)t->pos);
+        }
+        squeeze_if_error_return(s);
+        if (t->wix >= 0) { squeeze_inc_frequency(&s->dic, t->wix); }
+    } else if (t->kind == squeeze_token_word) {
+        squeeze_write_bits(s, 0b11, 2); // flags
+        squeeze_if_error_return(s);
+        // len == 1 indicates that it's a dictionary word
+        squeeze_write_huffman(s, &s->len, 1);
+        squeeze_if_error_return(s);
+        assert(s->dic.node[t->wix].bits <= 0xFF);
+        squeeze_write_huffman(s, &s->dic, t->wix);
+    } else {
+        const uint8_t b = t->byte;
+        // European texts are predominantly spaces and small ASCII letters:
+        if (b < 0x80) {
+            squeeze_write_bit(s, 0); // flags
             squeeze_if_error_return(s);
-            squeeze_add_to_dictionary(s, &data[i], len);
-            i += len;
+            // ASCII byte < 0x80 with 8th bit set to `0`
+            squeeze_write_huffman(s, &s->sym, b);
         } else {
-            int32_t best = map.best(&s->map, &data[i], bytes - i);
-            if (best >= 0) {
-                assert(best <= INT32_MAX);
-                if (map.bytes(&s->map, best) < 3) {
-                    printf("%d\n", map.bytes(&s->map, best));
-                }
-                assert(map.bytes(&s->map, best) >= 3);
-                squeeze_write_bits(s, 0b11, 2); // flags
-                squeeze_if_error_return(s);
-                // len == 1 indicates that it's a dictionary word
-                squeeze_write_huffman(s, &s->len, 1);
-                squeeze_if_error_return(s);
-                assert(s->dic.node[best].bits <= 0xFF);
-                squeeze_write_huffman(s, &s->dic, (int32_t)best);
-                squeeze_if_error_return(s);
-                i += map.bytes(&s->map, best);
-            } else {
-                const uint8_t b = data[i];
-                // European texts are predominantly spaces and small ASCII letters:
-                if (b < 0x80) {
-                    squeeze_write_bit(s, 0); // flags
-                    squeeze_if_error_return(s);
-                    // ASCII byte < 0x80 with 8th bit set to `0`
-                    squeeze_write_huffman(s, &s->sym, b);
-                    squeeze_if_error_return(s);
-                } else {
-                    squeeze_write_bit(s, 1); // flag: 1
-                    squeeze_write_bit(s, 0); // flag: 0
-                    squeeze_if_error_return(s);
-                    // only 7 bit because 8th bit is `1`
-                    squeeze_write_huffman(s, &s->sym, b);
-                    squeeze_if_error_return(s);
-                }
-                i++;
-            }
+            squeeze_write_bit(s, 1); // flag: 1
+            squeeze_write_bit(s, 0); // flag: 0
+            squeeze_if_error_return(s);
+            // only 7 bit because 8th bit is `1`
+            squeeze_write_huffman(s, &s->sym, b);
         }
     }
+}
+
+typedef struct {
+    squeeze_type*  s;
+    const uint8_t* data;
+    size_t start;
+    size_t bytes;
+    size_t window;
+} squeeze_finder_type;
+
+static int squeeze_finder(void* p) {
+    squeeze_finder_type* f = (squeeze_finder_type*)p;
+    squeeze_type* s = f->s;
+    size_t i = f->start;
+    squeeze_span_type span = {
+        .thread = squeeze_thread_finder, .kind = squeeze_event_search,
+        .sides = 1U << squeeze_side_search
+    };
+    if (squeeze_trace_on(s)) { squeeze_span_begin(s, &span, i); }
+    while (i < f->bytes) {
+        squeeze_token_type t;
+        squeeze_sample_begin(s, squeeze_side_search, squeeze_stage_search);
+        squeeze_find(s, f->data, f->bytes, i, f->window, &t);
+        squeeze_sample(s, squeeze_side_search, -1);
+        if (!ring.put(&s->ring, &t)) { break; } // encoder failed
+        i += t.len;
+        squeeze_span(s, &span, i, i >= f->bytes);
+    }
+    ring.close(&s->ring);
+    return 0;
+}
+
+static void squeeze_compress_pipelined(squeeze_type* s, const uint8_t* data,
+                                       size_t start, size_t bytes,
+                                       size_t window,
+                                       uint8_t len_bits, uint8_t base) {
+    ring.init(&s->ring, s->tokens, sizeof(squeeze_token_type),
+              squeeze_pipeline_tokens);
+    squeeze_finder_type f = {
+        .s = s, .data = data, .start = start, .bytes = bytes,
+        .window = window
+    };
+    thrd_t thread;
+    if (thrd_create(&thread, squeeze_finder, &f) != thrd_success) {
+        s->error = EAGAIN;
+        return;
+    }
+    squeeze_token_type t;
+    size_t i = start;
+    squeeze_span_type span = {
+        .thread = squeeze_thread_coder, .kind = squeeze_event_compress,
+        .sides = 1U << squeeze_side_coder
+    };
+    if (squeeze_trace_on(s)) { squeeze_span_begin(s, &span, i); }
+    while (ring.get(&s->ring, &t)) {
+        squeeze_sample_begin(s, squeeze_side_coder, squeeze_stage_coding);
+        squeeze_encode(s, &t, len_bits, base);
+        squeeze_sample(s, squeeze_side_coder, -1);
+        i += t.len;
+        squeeze_checksum(s, data, i, true);
+        if (s->error != 0) { ring.close(&s->ring); break; }
+        squeeze_span(s, &span, i, i >= bytes);
+    }
+    thrd_join(thread, null);
+}
+
+static void squeeze_compress_serial(squeeze_type* s, const uint8_t* data,
+                                    size_t start, size_t bytes,
+                                    uint8_t win_bits, uint8_t len_bits) {
+    const size_t window = ((size_t)1U) << win_bits;
+    const uint8_t base = (win_bits - 4) / 2;
+    size_t i = start;
+    squeeze_span_type span = {
+        .thread = squeeze_thread_coder, .kind = squeeze_event_compress,
+        .sides = (1U << squeeze_side_search) | (1U << squeeze_side_coder)
+    };
+    if (squeeze_trace_on(s)) { squeeze_span_begin(s, &span, i); }
+    while (i < bytes) {
+        squeeze_token_type t;
+        squeeze_sample_begin(s, squeeze_side_search, squeeze_stage_search);
+        squeeze_find(s, data, bytes, i, window, &t);
+        squeeze_sample(s, squeeze_side_search, -1);
+        squeeze_sample_begin(s, squeeze_side_coder, squeeze_stage_coding);
+        squeeze_encode(s, &t, len_bits, base);
+        squeeze_sample(s, squeeze_side_coder, -1);
+        squeeze_if_error_return(s);
+        i += t.len;
+        squeeze_checksum(s, data, i, true);
+        squeeze_span(s, &span, i, i >= bytes);
+    }
+}
+
+// data[0..start) is history (already compressed) that matches can refer to
+
+static void squeeze_compress_data(squeeze_type* s, const uint8_t* data,
+                                  uint64_t start, uint64_t bytes) {
+    squeeze_if_error_return(s);
+    const uint8_t win_bits = huffman.log2_of_pow2(s->pos.n);
+    const uint8_t len_bits = huffman.log2_of_pow2(s->len.n);
+    if (win_bits < 10 || win_bits > 20) { squeeze_return_invalid(s); }
+    const size_t window = ((size_t)1U) << win_bits;
+    const uint8_t base = (win_bits - 4) / 2;
+    if (s->flags & squeeze_flag_long) {
+        if (s->long_index == null || bytes >= (1ULL << 48)) {
+            squeeze_return_invalid(s);
+        }
+        if (++s->long_epoch == 0) { // wrapped: old entries would match
+            memset(s->long_index, 0,
+                   sizeof(uint64_t) * (1ULL << squeeze_long_bits));
+            s->long_epoch = 1;
+        }
+        s->long_indexed = 0;
+    }
+    if (s->map.ref != null) { map.rebase(&s->map, data, bytes); }
+    s->matches_from = 0;
+    s->matches_to = 0;
+    s->checked = start;
+    s->crc_checked = 0;
+    if (squeeze_trace_on(s)) { squeeze_trace_origin(s); }
+    const uint64_t written = s->bs->bytes;
+    squeeze_streams_type streams;
+    const bool split = (s->flags & squeeze_flag_streams) != 0;
+    if (split) { squeeze_streams_begin(s, &streams, bytes); }
+    if (s->error == 0 && s->tokens != null) {
+        squeeze_compress_pipelined(s, data, start, bytes, window,
+                                   len_bits, base);
+    } else if (s->error == 0) {
+        squeeze_compress_serial(s, data, start, bytes, win_bits, len_bits);
+    }
+    if (s->error == 0 && (s->flags & squeeze_flag_checksum)) {
+        squeeze_checksum_final(s, data, bytes, true);
+    }
+    if (split) { squeeze_streams_write(s, &streams); }
+    squeeze_if_error_return(s);
+    if (s->history != null) {
+        s->resume.b64 = s->bs->b64;
+        s->resume.bits = s->bs->bits;
+        s->resume.bytes = s->bs->bytes;
+    }
     squeeze_flush(s);
+    if (s->map.ref != null) { s->error = map.retain(&s->map); }
+    if (squeeze_stats_on(s)) { s->stats.bits += (s->bs->bytes - written) * 8; }
 }
 
-static inline uint64_t squeeze_read_bit(squeeze_type* s) {
-    bool bit = 0;
-    if (s->error == 0) {
-        bit = bitstream.read_bit(s->bs);
-        s->error = s->bs->error;
+static void squeeze_compress_resumable(squeeze_type* s, const uint8_t* data,
+                                       uint64_t bytes) {
+    if (s->flags & squeeze_flags_filter) {
+        squeeze_return_invalid(s);
+    }
+    const size_t window = (size_t)s->pos.n;
+    const size_t h = (size_t)s->history_bytes;
+    if (h == 0) {
+        squeeze_compress_data(s, data, 0, bytes);
+    } else { // history followed by data in one buffer
+        uint8_t* buffer = (uint8_t*)malloc(h + (size_t)bytes);
+        if (buffer == null) { s->error = ENOMEM; return; }
+        memcpy(buffer, s->history, h);
+        memcpy(buffer + h, data, (size_t)bytes);
+        squeeze_compress_data(s, buffer, h, h + bytes);
+        free(buffer);
+    }
+    squeeze_if_error_return(s);
+    s->resume.total += bytes;
+    if (bytes >= window) {
+        memcpy(s->history, data + bytes - window, window);
+        s->history_bytes = window;
+    } else {
+        const size_t keep = h + bytes <= window ? h : window - (size_t)bytes;
+        memmove(s->history, s->history + h - keep, keep);
+        memcpy(s->history + keep, data, (size_t)bytes);
+        s->history_bytes = keep + bytes;
     }
-    return bit;
 }
 
-static inline uint64_t squeeze_read_bits(squeeze_type* s, uint32_t n) {
-    assert(n <= 64);
+static void squeeze_compress(squeeze_type* s, const uint8_t* data, uint64_t bytes) {
+    squeeze_if_error_return(s);
+    if (((s->flags & squeeze_flag_dictionary) != 0) != (s->dictionary != 0)) {
+        squeeze_return_invalid(s);
+    }
+    if (s->history != null && (s->flags & squeeze_flag_streams)) {
+        squeeze_return_invalid(s);
+    }
+    if (s->flags & squeeze_flag_checksum) {
+        if (s->history != null) { squeeze_return_invalid(s); }
+        if (s->flags & squeeze_flags_filter) { // of the unfiltered input
+            s->crc = checksum.crc32c(0, data, (size_t)bytes);
+        }
+    }
+    if (s->history != null) {
+        squeeze_compress_resumable(s, data, bytes);
+    } else if ((s->flags & squeeze_flags_filter) == 0) {
+        squeeze_compress_data(s, data, 0, bytes);
+    } else { // filters work on a copy of the input
+        uint8_t* copy = (uint8_t*)malloc(bytes > 0 ? (size_t)bytes : 1);
+        if (copy == null) { s->error = ENOMEM; return; }
+        memcpy(copy, data, (size_t)bytes);
+        if (s->flags & squeeze_flag_x86)   { filter.x86(copy, bytes, true); }
+        if (s->flags & squeeze_flag_arm64) { filter.arm64(copy, bytes, true); }
+        if (s->flags & squeeze_flag_delta) {
+            filter.delta(copy, bytes, squeeze_stride(s->flags), true);
+        }
+        squeeze_compress_data(s, copy, 0, bytes);
+        free(copy);
+    }
+}
+
+// Readers with `fast` true skip per bit error checks: bitstream errors are
+// sticky and reads after an error return 0 bits, which still end every
+// Huffman walk and number, so the decoder checks the bitstream error
+// once per token instead.
+
+static squeeze_inline uint64_t squeeze_read_bits(squeeze_type* s, uint32_t n,
+                                                 const bool fast) {
+    assert(0 < n && n <= 64);
     uint64_t bits = 0;
-    if (s->error == 0) {
-        bits = bitstream.read_bits(s->bs, n);
+    if (fast) {
+        bits = squeeze_get_bits(s->bs, (int32_t)n);
+    } else if (s->error == 0) {
+        bits = squeeze_get_bits(s->bs, (int32_t)n);
+        s->error = s->bs->error;
     }
     return bits;
 }
 
-static inline uint64_t squeeze_read_number(squeeze_type* s, uint8_t base) {
+static squeeze_inline uint64_t squeeze_read_bit(squeeze_type* s,
+                                                const bool fast) {
+    return squeeze_read_bits(s, 1, fast);
+}
+
+static squeeze_inline uint64_t squeeze_read_number(squeeze_type* s,
+        uint8_t base, const bool fast) {
     uint64_t bits = 0;
-    uint64_t bit = 0;
     uint32_t shift = 0;
     while (s->error == 0) {
-        bits |= (squeeze_read_bits(s, base) << shift);
+        if (shift >= 64) { s->error = EINVAL; break; } // corrupt stream
+        bits |= (squeeze_read_bits(s, base, fast) << shift);
         shift += base;
-        bit = squeeze_read_bit(s);
-        if (!bit) { break; }
+        if (!squeeze_read_bit(s, fast)) { break; }
     }
     return bits;
 }
 
-static inline uint64_t squeeze_read_huffman(squeeze_type* s, huffman_tree_type* t) {
+static squeeze_inline uint64_t squeeze_read_huffman(squeeze_type* s,
+        huffman_tree_type* t, const bool fast) {
+    if (!t->built) { huffman.build(t); }
     const int32_t m = t->n * 2 - 1;
     int32_t i = m - 1; // root
-    bool bit = squeeze_read_bit(s);
+    int32_t depth = 0; // bounded by huffman_max_bits
+    bool bit = squeeze_read_bit(s, fast) != 0;
     while (s->error == 0) {
         i = bit ? t->node[i].rix : t->node[i].lix;
         assert(0 <= i && i < m);
+        depth++;
+        assert(depth <= huffman_max_bits);
         if (t->node[i].lix < 0 && t->node[i].rix < 0) { break; } // leaf
-        bit = squeeze_read_bit(s);
+        bit = squeeze_read_bit(s, fast) != 0;
     }
+    if (s->error != 0) { return 0; } // `i` may not be a leaf
     assert(0 <= i && i < t->n); // leaf symbol
-    huffman.inc_frequency(t, i);
+    squeeze_inc_frequency(t, i);
     return (uint64_t)i;
 }
 
+// Sub-stream decoders run on threads of their own (squeeze_flag_streams)
+
+static uint64_t squeeze_stream_number(bitstream_type* bs, uint8_t base) {
+    uint64_t bits = 0;
+    uint32_t shift = 0;
+    while (bs->error == 0) {
+        if (shift >= 64) { bs->error = EINVAL; break; } // corrupt stream
+        bits |= squeeze_get_bits(bs, base) << shift;
+        shift += base;
+        if (!squeeze_get_bits(bs, 1)) { break; }
+    }
+    return bits;
+}
+
+static uint64_t squeeze_stream_symbol(bitstream_type* bs,
+                                      huffman_tree_type* t) {
+    if (!t->built) { huffman.build(t); }
+    int32_t i = t->n * 2 - 2; // root
+    do {
+        i = squeeze_get_bits(bs, 1) ? t->node[i].rix : t->node[i].lix;
+    } while (bs->error == 0 && t->node[i].lix >= 0);
+    if (bs->error != 0) { return 0; }
+    squeeze_inc_frequency(t, i);
+    return (uint64_t)i;
+}
+
+static int squeeze_stream_decoder(void* p) {
+    squeeze_stream_type* st = (squeeze_stream_type*)p;
+    bitstream_type* bs = &st->bs;
+    uint64_t i = 0;
+    while (i < st->count &&
+           !atomic_load_explicit(&st->quit, memory_order_relaxed)) {
+        uint64_t v = squeeze_stream_symbol(bs, st->t);
+        if (st->far && v == 0) {
+            v = squeeze_stream_number(bs, squeeze_long_base) | squeeze_far;
+        }
+        if (bs->error != 0) { break; }
+        if (st->byte != null) { st->byte[i] = (uint8_t)v; }
+        else { st->value[i] = v; }
+        i++;
+        if (i % squeeze_stream_publish == 0 || i == st->count) {
+            atomic_store_explicit(&st->ready, i, memory_order_release);
+        }
+    }
+    atomic_store_explicit(&st->error, bs->error, memory_order_release);
+    return 0;
+}
+
+// waits for the next symbol of the stream, false with s->error set
+
+static squeeze_inline bool squeeze_stream_wait(squeeze_type* s,
+                                               squeeze_stream_type* st) {
+    if (st->next >= st->count) { s->error = EINVAL; return false; }
+    while (st->next >= st->seen) {
+        st->seen = atomic_load_explicit(&st->ready, memory_order_acquire);
+        if (st->next < st->seen) { break; }
+        const errno_t r = atomic_load_explicit(&st->error,
+                                               memory_order_acquire);
+        if (r != 0) { s->error = r; return false; }
+        thrd_yield();
+    }
+    return true;
+}
+
+static squeeze_inline uint64_t squeeze_read_literal(squeeze_type* s,
+                                                    const bool fast) {
+    if (s->streams == null) { return squeeze_read_huffman(s, &s->sym, fast); }
+    squeeze_stream_type* st = &s->streams->stream[squeeze_stream_lit];
+    return squeeze_stream_wait(s, st) ? st->byte[st->next++] : 0;
+}
+
+// position with squeeze_far set for far distances (squeeze_flag_long)
+
+static squeeze_inline uint64_t squeeze_read_position(squeeze_type* s,
+                                                     const bool fast) {
+    if (s->streams != null) {
+        squeeze_stream_type* st = &s->streams->stream[squeeze_stream_pos];
+        return squeeze_stream_wait(s, st) ? st->value[st->next++] : 0;
+    }
+    const uint64_t pos = squeeze_read_huffman(s, &s->pos, fast);
+    if (pos != 0 || (s->flags & squeeze_flag_long) == 0) { return pos; }
+    return squeeze_read_number(s, squeeze_long_base, fast) | squeeze_far;
+}
+
+// Reads the streams table and the streams, replaces s->bs by the token
+// stream and starts the literal and position decoders.
+
+static void squeeze_streams_read(squeeze_type* s, squeeze_streams_type* ss,
+                                 uint64_t bytes) {
+    memset(ss, 0x00, sizeof(*ss));
+    ss->bs = s->bs;
+    squeeze_stream_type* st = ss->stream;
+    uint64_t size[squeeze_streams];
+    st[squeeze_stream_lit].count = bitstream.read_bits(s->bs, 64);
+    size[squeeze_stream_lit] = bitstream.read_bits(s->bs, 64);
+    st[squeeze_stream_pos].count = bitstream.read_bits(s->bs, 64);
+    size[squeeze_stream_pos] = bitstream.read_bits(s->bs, 64);
+    size[squeeze_stream_tok] = bitstream.read_bits(s->bs, 64);
+    s->error = s->bs->error;
+    // bounds of the writer: literals are up to huffman_max_bits, positions
+    // up to huffman_max_bits and a far distance, tokens cover 2+ bytes
+    const uint64_t lits = st[squeeze_stream_lit].count;
+    const uint64_t poss = st[squeeze_stream_pos].count;
+    if (s->error == 0 &&
+        (lits > bytes || poss > bytes / 2 || bytes > SIZE_MAX / 8 ||
+         size[squeeze_stream_lit] > lits * 3 + 8 ||
+         size[squeeze_stream_pos] > poss * 16 + 8 ||
+         size[squeeze_stream_tok] > bytes * 8 + 64)) {
+        s->error = EINVAL;
+    }
+    for (int32_t k = 0; k < squeeze_streams && s->error == 0; k++) {
+        if (size[k] % 8 != 0) { s->error = EINVAL; break; }
+        bitstream_type* bs = &st[k].bs;
+        bs->data = (uint8_t*)malloc((size_t)size[k] + 8);
+        if (bs->data == null) { s->error = ENOMEM; break; }
+        bs->capacity = size[k];
+        bs->bytes = size[k];
+        squeeze_stream_get(s->bs, bs->data, size[k]);
+        s->error = s->bs->error;
+    }
+    if (s->error == 0) {
+        st[squeeze_stream_lit].t = &s->sym;
+        st[squeeze_stream_lit].byte = (uint8_t*)malloc((size_t)lits + 1);
+        st[squeeze_stream_pos].t = &s->pos;
+        st[squeeze_stream_pos].far = (s->flags & squeeze_flag_long) != 0;
+        st[squeeze_stream_pos].value =
+            (uint64_t*)malloc(((size_t)poss + 1) * sizeof(uint64_t));
+        if (st[squeeze_stream_lit].byte == null ||
+            st[squeeze_stream_pos].value == null) {
+            s->error = ENOMEM;
+        }
+    }
+    for (int32_t k = 0; k < squeeze_stream_tok && s->error == 0; k++) {
+        st[k].started = thrd_create(&st[k].thread,
+                            squeeze_stream_decoder, &st[k]) == thrd_success;
+        if (!st[k].started) { s->error = EAGAIN; }
+    }
+    s->bs = &st[squeeze_stream_tok].bs;
+    s->streams = ss;
+}
+
+static void squeeze_streams_join(squeeze_type* s, squeeze_streams_type* ss) {
+    squeeze_stream_type* st = ss->stream;
+    for (int32_t k = 0; k < squeeze_stream_tok; k++) {
+        atomic_store_explicit(&st[k].quit, true, memory_order_relaxed);
+        if (st[k].started) { thrd_join(st[k].thread, null); }
+        if (s->error == 0 && st[k].next != st[k].count) { s->error = EINVAL; }
+        free(st[k].byte);
+        free(st[k].value);
+    }
+    for (int32_t k = 0; k < squeeze_streams; k++) { free(st[k].bs.data); }
+    s->bs = ss->bs;
+    s->streams = null;
+}
+
 static void squeeze_read_header(bitstream_type* bs, uint64_t *bytes,
                                 uint8_t *win_bits, uint8_t *map_bits,
-                                uint8_t *len_bits) {
+                                uint8_t *len_bits, uint16_t *flags,
+                                uint32_t *id) {
     uint64_t b  = bitstream.read_bits(bs, sizeof(uint64_t) * 8);
+    uint64_t mg = bitstream.read_bits(bs, sizeof(uint32_t) * 8);
+    if (bs->error == 0 && mg != squeeze_magic) { bs->error = EINVAL; }
     uint64_t wb = bitstream.read_bits(bs, sizeof(uint8_t) * 8);
     uint64_t mb = bitstream.read_bits(bs, sizeof(uint8_t) * 8);
     uint64_t lb = bitstream.read_bits(bs, sizeof(uint8_t) * 8);
+    uint64_t fb = bitstream.read_bits(bs, sizeof(uint16_t) * 8);
+    uint64_t ib = 0;
+    if (bs->error == 0 && (fb & squeeze_flag_dictionary)) {
+        ib = bitstream.read_bits(bs, sizeof(uint32_t) * 8);
+        if (ib == 0) { bs->error = EINVAL; }
+    }
     if (bs->error == 0) {
         if (wb < squeeze_min_win_bits || wb > squeeze_max_win_bits) {
             bs->error = EINVAL;
@@ -351,76 +2029,1036 @@ static void squeeze_read_header(bitstream_type* bs, uint64_t *bytes,
             bs->error = EINVAL;
         } else if (lb < 4 || lb > 8) {
             bs->error = EINVAL;
+        } else if ((fb & ~(uint64_t)squeeze_flags_all) != 0) {
+            bs->error = EINVAL;
         } else if (bs->error == 0) {
             *bytes = b;
             *win_bits = (uint8_t)wb;
             *map_bits = (uint8_t)mb;
             *len_bits = (uint8_t)lb;
+            *flags    = (uint16_t)fb;
+            *id       = (uint32_t)ib;
         }
     }
 }
 
+enum { squeeze_copy_slack = 32 }; // max bytes wide copy writes past the end
+
+// Copies `len` bytes from `data[i - pos]` to `data[i]`. The source overlaps
+// the destination when pos < len and repeats with the period of `pos`.
+// Wide copies may write up to squeeze_copy_slack - 1 bytes after
+// data[i + len - 1] so they are only used when that still fits in
+// data[bytes], otherwise the tail is copied byte by byte.
+
+static inline void squeeze_copy_match(uint8_t* data, size_t i, size_t pos,
+                                      size_t len, size_t bytes) {
+    assert(0 < pos && pos <= i && i + len <= bytes);
+    uint8_t* d = data + i;
+    const uint8_t* s = d - pos;
+    const uint8_t* e = d + len;
+    if (bytes - i - len < squeeze_copy_slack) {
+        while (d < e) { *d++ = *s++; }
+    } else if (pos >= 32) {
+        do { memcpy(d, s, 32); d += 32; s += 32; } while (d < e);
+    } else if (pos >= 16) {
+        do { memcpy(d, s, 16); d += 16; s += 16; } while (d < e);
+    } else if (pos >= 8) {
+        do { memcpy(d, s, 8); d += 8; s += 8; } while (d < e);
+    } else {
+        // replicate pattern of `pos` bytes, step is a multiple of pos
+        uint8_t pattern[16];
+        for (size_t k = 0; k < sizeof(pattern); k++) { pattern[k] = s[k % pos]; }
+        const size_t step = sizeof(pattern) - sizeof(pattern) % pos;
+        do { memcpy(d, pattern, sizeof(pattern)); d += step; } while (d < e);
+    }
+}
+
+// Decodes the token at data[i] and returns its length or 0 with s->error
+// set. All stream values are validated so that a corrupt stream can never
+// read or write outside data[0..bytes) in either mode.
+
+static squeeze_inline size_t squeeze_decode_token(squeeze_type* s,
+        uint8_t* data, size_t bytes, size_t i, size_t window, uint8_t base,
+        const bool fast) {
+    if (!squeeze_read_bit(s, fast)) { // literal byte (ASCII byte < 0x80)
+        const uint64_t b = squeeze_read_literal(s, fast);
+        data[i] = (uint8_t)b;
+        if (squeeze_stats_on(s)) {
+            squeeze_count(s, squeeze_token_literal, 1, 0, false);
+        }
+        return 1;
+    }
+    if (!squeeze_read_bit(s, fast)) { // byte >= 0x80
+        const uint64_t b = squeeze_read_literal(s, fast);
+        data[i] = (uint8_t)b | 0x80;
+        if (squeeze_stats_on(s)) {
+            squeeze_count(s, squeeze_token_literal, 1, 0, false);
+        }
+        return 1;
+    }
+    uint64_t len = squeeze_read_huffman(s, &s->len, fast);
+    if (len == 1) {
+        const int32_t wix = (int32_t)squeeze_read_huffman(s, &s->dic, fast);
+        const size_t n = squeeze_map_bytes(&s->map, wix);
+        if (s->error != 0) { return 0; }
+        if (n == 0 || n > bytes - i) { s->error = EINVAL; return 0; }
+        memcpy(data + i, squeeze_map_data(&s->map, wix), n);
+        if (squeeze_stats_on(s)) {
+            squeeze_count(s, squeeze_token_word, n, 0, false);
+        }
+        return n;
+    }
+    const bool escaped = len == 0;
+    if (escaped) { len = squeeze_read_number(s, base, fast); }
+    uint64_t pos = squeeze_read_position(s, fast);
+    const bool far = (pos & squeeze_far) != 0;
+    pos &= ~squeeze_far;
+    if (s->error != 0) { return 0; }
+    if (pos == 0 || pos > i || (!far && pos >= window) ||
+        len < 2 || len > bytes - i) {
+        s->error = EINVAL;
+        return 0;
+    }
+    // Cannot do plain memcpy() here because of possible overlap.
+    squeeze_copy_match(data, i, (size_t)pos, (size_t)len, bytes);
+    squeeze_add_to_dictionary(s, data + i, len);
+    if (squeeze_stats_on(s)) {
+        squeeze_count(s, far ? squeeze_token_long : squeeze_token_match,
+                      len, pos, escaped);
+    }
+    return (size_t)len;
+}
+
+// output bytes the fast loop keeps ahead: longest word (sizeof(map_entry_t)
+// - 1 bytes) and wide match copies (squeeze_copy_slack) fit
+
+enum { squeeze_decode_slack = sizeof(map_entry_t) };
+
+static void squeeze_decode(squeeze_type* s, uint8_t* data, uint64_t bytes,
+                           uint8_t win_bits) {
+    const size_t window = ((size_t)1U) << win_bits;
+    const uint8_t base = (win_bits - 4) / 2;
+    size_t i = 0; // output b64[i]
+    squeeze_span_type span = {
+        .thread = squeeze_thread_coder, .kind = squeeze_event_decompress
+    };
+    if (squeeze_trace_on(s)) { squeeze_span_begin(s, &span, i); }
+    while (s->error == 0 && bytes - i >= squeeze_decode_slack) {
+        squeeze_checksum(s, data, i, false);
+        if (s->error != 0) { break; }
+        i += squeeze_decode_token(s, data, bytes, i, window, base, true);
+        if (s->error == 0) { s->error = s->bs->error; }
+        squeeze_span(s, &span, i, false);
+    }
+    while (s->error == 0 && i < bytes) { // checked tail
+        squeeze_checksum(s, data, i, false);
+        if (s->error != 0) { break; }
+        i += squeeze_decode_token(s, data, bytes, i, window, base, false);
+        squeeze_span(s, &span, i, i >= bytes);
+    }
+}
+
 static void squeeze_decompress(squeeze_type* s, uint8_t* data, uint64_t bytes) {
     squeeze_if_error_return(s);
+    if (((s->flags & squeeze_flag_dictionary) != 0) != (s->dictionary != 0)) {
+        squeeze_return_invalid(s);
+    }
     const uint8_t win_bits = huffman.log2_of_pow2(s->pos.n);
     if (win_bits < 10 || win_bits > 20) { squeeze_return_invalid(s); }
-    const size_t window = ((size_t)1U) << win_bits;
-    const uint8_t base = (win_bits - 4) / 2;
-    size_t i = 0; // output b64[i]
-    while (i < bytes) {
-        uint64_t bit0 = squeeze_read_bit(s);
-        squeeze_if_error_return(s);
-        if (bit0) {
-            uint64_t bit1 = squeeze_read_bit(s);
-            squeeze_if_error_return(s);
-            if (bit1) {
-                uint64_t len = squeeze_read_huffman(s, &s->len);
-                squeeze_if_error_return(s);
-                if (len == 1) {
-                    uint64_t wix = squeeze_read_huffman(s, &s->dic);
-                    squeeze_if_error_return(s);
-                    assert(wix < (uint64_t)s->map.n);
-                    assert(map.bytes(&s->map, (int32_t)wix) >= 3);
-                    size_t n = map.bytes(&s->map, (int32_t)wix);
-                    assert(i + n <= bytes);
-                    const uint8_t* d = (const uint8_t*)map.data(&s->map, (int32_t)wix);
-                    for (size_t j = 0; j < n; j++) { data[i] = d[j]; i++; }
-                } else {
-                    if (len == 0) { len = squeeze_read_number(s, base); }
-                    uint64_t pos = squeeze_read_huffman(s, &s->pos);
-                    squeeze_if_error_return(s);
-                    assert(0 < pos && pos < window);
-                    if (!(0 < pos && pos < window)) { squeeze_return_invalid(s); }
-                    assert(2 <= len);
-                    if (len < 2) { squeeze_return_invalid(s); }
-                    // Cannot do memcpy() here because of possible overlap.
-                    // memcpy() may read more than one byte at a time.
-                    uint8_t* d = data - (size_t)pos;
-                    const size_t n = i + (size_t)len;
-                    uint8_t* w = d + i;
-                    while (i < n) { data[i] = d[i]; i++; }
-                    squeeze_add_to_dictionary(s, w, len);
+    if (s->map.ref != null) { map.rebase(&s->map, data, bytes); }
+    s->checked = 0;
+    s->crc_checked = 0;
+    if (squeeze_trace_on(s)) { squeeze_trace_origin(s); }
+    const uint64_t read = s->bs->read;
+    squeeze_streams_type streams;
+    const bool split = (s->flags & squeeze_flag_streams) != 0;
+    if (split) { squeeze_streams_read(s, &streams, bytes); }
+    if (s->error == 0) { squeeze_decode(s, data, bytes, win_bits); }
+    if (s->error == 0 && (s->flags & squeeze_flag_checksum)) {
+        squeeze_checksum_final(s, data, bytes, false);
+    }
+    if (split) { squeeze_streams_join(s, &streams); }
+    if (squeeze_stats_on(s)) { s->stats.bits += (s->bs->read - read) * 8; }
+    squeeze_if_error_return(s);
+    s->bs->b64  = 0; // padding of the last word (see squeeze_flush())
+    s->bs->bits = 0;
+    if (s->map.ref != null) { s->error = map.retain(&s->map); }
+    if (s->flags & squeeze_flag_delta) {
+        filter.delta(data, bytes, squeeze_stride(s->flags), false);
+    }
+    if (s->flags & squeeze_flag_arm64) { filter.arm64(data, bytes, false); }
+    if (s->flags & squeeze_flag_x86)   { filter.x86(data, bytes, false); }
+    if ((s->flags & squeeze_flag_checksum) &&
+        (s->flags & squeeze_flags_filter) &&
+        checksum.crc32c(0, data, (size_t)bytes) != s->crc) {
+        s->error = EBADMSG;
+    }
+}
+
+static void squeeze_train(squeeze_type* s, const uint8_t* data, size_t bytes) {
+    bitstream_type* bs = s->bs;
+    bitstream_type sink = {0};
+    s->bs = &sink;
+    const uint32_t dictionary = s->dictionary;
+    s->dictionary = (s->flags & squeeze_flag_dictionary) ? dictionary : 0;
+    squeeze_compress(s, data, bytes);
+    s->dictionary = dictionary;
+    s->bs = bs;
+}
+
+static huffman_tree_type* squeeze_tree(squeeze_type* s, int32_t i) {
+    huffman_tree_type* trees[] = { &s->sym, &s->dic, &s->pos, &s->len };
+    return trees[i];
+}
+
+// Trees and words state shared by dictionary and checkpoint images
+
+static size_t squeeze_state_bytes(const squeeze_type* s, uint32_t *words) {
+    squeeze_type* c = (squeeze_type*)s; // trees and map are only read
+    size_t bytes = 0;
+    for (int32_t i = 0; i < 4; i++) {
+        const huffman_tree_type* t = squeeze_tree(c, i);
+        bytes += sizeof(uint32_t) * 2 +
+                 sizeof(huffman_node_type) * (size_t)(t->n * 2 - 1);
+    }
+    *words = 0;
+    for (int32_t i = 0; i < s->map.n; i++) {
+        const uint8_t b = map.bytes(&s->map, i);
+        if (b > 0) { bytes += sizeof(uint32_t) + 1 + b; (*words)++; }
+    }
+    return bytes;
+}
+
+static uint8_t* squeeze_save_state(const squeeze_type* s, uint8_t* p) {
+    squeeze_type* c = (squeeze_type*)s;
+    for (int32_t i = 0; i < 4; i++) {
+        huffman_tree_type* t = squeeze_tree(c, i);
+        huffman.build(t); // the image always holds whole trees
+        const uint32_t state[2] = { (uint32_t)t->depth,
+                                    (uint32_t)t->complete };
+        memcpy(p, state, sizeof(state)); p += sizeof(state);
+        const size_t n = sizeof(huffman_node_type) * (size_t)(t->n * 2 - 1);
+        memcpy(p, t->node, n); p += n;
+    }
+    for (int32_t i = 0; i < s->map.n; i++) {
+        const uint8_t b = map.bytes(&s->map, i);
+        if (b > 0) {
+            const uint32_t slot = (uint32_t)i;
+            memcpy(p, &slot, sizeof(slot)); p += sizeof(slot);
+            *p++ = b;
+            memcpy(p, map.data(&s->map, i), b); p += b;
+        }
+    }
+    return p;
+}
+
+// returns position after the state or null if image is malformed
+
+static const uint8_t* squeeze_load_state(squeeze_type* s, const uint8_t* p,
+                                         const uint8_t* e, uint32_t words) {
+    for (int32_t i = 0; i < 4; i++) {
+        huffman_tree_type* t = squeeze_tree(s, i);
+        uint32_t state[2];
+        const size_t n = sizeof(huffman_node_type) * (size_t)(t->n * 2 - 1);
+        if ((size_t)(e - p) < sizeof(state) + n) { return null; }
+        memcpy(state, p, sizeof(state)); p += sizeof(state);
+        if (state[0] > huffman_max_bits) { return null; }
+        t->depth = (int32_t)state[0];
+        t->complete = (int32_t)state[1];
+        memcpy(t->node, p, n); p += n;
+        t->built = 1;
+        if (!huffman.valid(t)) { t->built = 0; return null; }
+    }
+    for (uint32_t w = 0; w < words; w++) {
+        uint32_t slot = 0;
+        if ((size_t)(e - p) < sizeof(slot) + 1) { return null; }
+        memcpy(&slot, p, sizeof(slot)); p += sizeof(slot);
+        const uint8_t b = *p++;
+        if ((size_t)(e - p) < b || slot >= (uint32_t)s->map.n || b < 2 ||
+            map.insert(&s->map, (int32_t)slot, p, b) < 0) {
+            return null;
+        }
+        p += b;
+    }
+    return p;
+}
+
+static size_t squeeze_dictionary(const squeeze_type* s, uint32_t id,
+                                 void* image, size_t capacity) {
+    uint32_t words = 0;
+    const size_t bytes = sizeof(squeeze_dictionary_type) +
+                         squeeze_state_bytes(s, &words);
+    if (image != null && capacity >= bytes && id != 0) {
+        const squeeze_dictionary_type h = {
+            .magic = squeeze_dictionary_magic, .id = id,
+            .win_bits = huffman.log2_of_pow2(s->pos.n),
+            .map_bits = huffman.log2_of_pow2(s->map.n),
+            .len_bits = huffman.log2_of_pow2(s->len.n),
+            .words = words, .bytes = bytes
+        };
+        memcpy(image, &h, sizeof(h));
+        uint8_t* p = squeeze_save_state(s, (uint8_t*)image + sizeof(h));
+        assert(p == (uint8_t*)image + bytes); (void)p;
+    }
+    return bytes;
+}
+
+static errno_t squeeze_prime(squeeze_type* s, const void* image, size_t bytes) {
+    const uint8_t* p = (const uint8_t*)image;
+    const uint8_t* e = p + bytes;
+    squeeze_dictionary_type h = {0};
+    if (image == null || bytes < sizeof(h)) { return EINVAL; }
+    memcpy(&h, p, sizeof(h)); p += sizeof(h);
+    if (h.magic != squeeze_dictionary_magic || h.id == 0 || h.bytes != bytes ||
+        h.win_bits != huffman.log2_of_pow2(s->pos.n) ||
+        h.map_bits != huffman.log2_of_pow2(s->map.n) ||
+        h.len_bits != huffman.log2_of_pow2(s->len.n) ||
+        s->map.entries != 0) {
+        return EINVAL;
+    }
+    p = squeeze_load_state(s, p, e, h.words);
+    if (p != e) { return EINVAL; }
+    s->dictionary = h.id;
+    return 0;
+}
+
+static size_t squeeze_checkpoint(const squeeze_type* s, void* image,
+                                 size_t capacity) {
+    uint32_t words = 0;
+    const size_t bytes = sizeof(squeeze_checkpoint_type) +
+                         squeeze_state_bytes(s, &words) +
+                         (size_t)s->history_bytes;
+    if (image != null && capacity >= bytes && s->history != null) {
+        const squeeze_checkpoint_type h = {
+            .magic = squeeze_checkpoint_magic, .dictionary = s->dictionary,
+            .win_bits = huffman.log2_of_pow2(s->pos.n),
+            .map_bits = huffman.log2_of_pow2(s->map.n),
+            .len_bits = huffman.log2_of_pow2(s->len.n),
+            .flags = s->flags, .words = words,
+            .total = s->resume.total, .b64 = s->resume.b64,
+            .bits = (uint64_t)s->resume.bits, .offset = s->resume.bytes,
+            .history = s->history_bytes, .bytes = bytes
+        };
+        memcpy(image, &h, sizeof(h));
+        uint8_t* p = squeeze_save_state(s, (uint8_t*)image + sizeof(h));
+        memcpy(p, s->history, (size_t)s->history_bytes);
+        p += s->history_bytes;
+        assert(p == (uint8_t*)image + bytes); (void)p;
+    }
+    return bytes;
+}
+
+static errno_t squeeze_restore(squeeze_type* s, const void* image,
+                               size_t bytes) {
+    const uint8_t* p = (const uint8_t*)image;
+    const uint8_t* e = p + bytes;
+    squeeze_checkpoint_type h = {0};
+    if (image == null || bytes < sizeof(h) || s->history == null ||
+        s->bs == null) {
+        return EINVAL;
+    }
+    memcpy(&h, p, sizeof(h)); p += sizeof(h);
+    if (h.magic != squeeze_checkpoint_magic || h.bytes != bytes ||
+        h.win_bits != huffman.log2_of_pow2(s->pos.n) ||
+        h.map_bits != huffman.log2_of_pow2(s->map.n) ||
+        h.len_bits != huffman.log2_of_pow2(s->len.n) ||
+        h.bits >= 64 || h.history > (uint64_t)s->pos.n ||
+        (h.flags & ~(uint32_t)squeeze_flags_all) != 0 ||
+        s->map.entries != 0) {
+        return EINVAL;
+    }
+    p = squeeze_load_state(s, p, e, h.words);
+    if (p == null || (uint64_t)(e - p) != h.history) { return EINVAL; }
+    memcpy(s->history, p, (size_t)h.history);
+    s->history_bytes = h.history;
+    s->dictionary = h.dictionary;
+    s->flags = (uint16_t)h.flags;
+    s->resume.total = h.total;
+    s->resume.b64 = h.b64;
+    s->resume.bits = (int32_t)h.bits;
+    s->resume.bytes = h.offset;
+    // continue the stream from the pending (not yet flushed) bits
+    s->bs->b64 = h.b64;
+    s->bs->bits = (int32_t)h.bits;
+    s->bs->bytes = h.offset;
+    return 0;
+}
+
+// Lightweight reset between independent blocks (and batch records):
+// clears only the words of the previous block (and starts a new prefix
+// index epoch, see map.clear()) and lets the trees rebuild on first use.
+// The rest of the coder state is set up by each compress() and
+// decompress() call.
+
+static void squeeze_clear(squeeze_type* s) {
+    map.clear(&s->map);
+    for (int32_t i = 0; i < 4; i++) {
+        huffman_tree_type* t = squeeze_tree(s, i);
+        huffman.init(t, t->node, (size_t)(t->n * 2 - 1));
+    }
+    s->dictionary = 0;
+    s->error = 0;
+}
+
+static void squeeze_compress_blocks(squeeze_type* s, const uint8_t* data,
+                                    size_t bytes, size_t block) {
+    squeeze_if_error_return(s);
+    if (block == 0 || s->history != null || s->dictionary != 0 ||
+        (s->flags & squeeze_flag_dictionary)) {
+        squeeze_return_invalid(s);
+    }
+    const size_t n = (bytes + block - 1) / block;
+    squeeze_block_type* index = (squeeze_block_type*)
+        malloc(n > 0 ? n * sizeof(squeeze_block_type) : 1);
+    if (index == null) { s->error = ENOMEM; return; }
+    bitstream_type* bs = s->bs;
+    for (size_t k = 0; k < n && s->error == 0; k++) {
+        const size_t offset = k * block;
+        const size_t b = bytes - offset < block ? bytes - offset : block;
+        index[k] = (squeeze_block_type){
+            .offset = offset, .position = bs->bytes, .bytes = b
+        };
+        if (k > 0) { squeeze_clear(s); }
+        squeeze.write_header(bs, b, huffman.log2_of_pow2(s->pos.n),
+                             huffman.log2_of_pow2(s->map.n),
+                             huffman.log2_of_pow2(s->len.n), s->flags, 0);
+        s->error = bs->error;
+        squeeze_compress(s, data + offset, b);
+        index[k].size = bs->bytes - index[k].position;
+    }
+    const uint64_t position = bs->bytes;
+    for (size_t k = 0; k < n && s->error == 0; k++) {
+        bitstream.write_bits(bs, index[k].offset,   64);
+        bitstream.write_bits(bs, index[k].position, 64);
+        bitstream.write_bits(bs, index[k].bytes,    64);
+        bitstream.write_bits(bs, index[k].size,     64);
+        s->error = bs->error;
+    }
+    if (s->error == 0) {
+        bitstream.write_bits(bs, n, 64);
+        bitstream.write_bits(bs, position, 64);
+        bitstream.write_bits(bs, block, 64);
+        bitstream.write_bits(bs, squeeze_seekable_magic, 64);
+        s->error = bs->error;
+    }
+    free(index);
+}
+
+static errno_t squeeze_read_words(FILE* f, int64_t position, int whence,
+                                  uint64_t words[], int32_t n) {
+    const errno_t r = file.seek(f, position, whence);
+    if (r != 0) { return r; }
+    bitstream_type bs = { .file = f };
+    for (int32_t i = 0; i < n && bs.error == 0; i++) {
+        words[i] = bitstream.read_bits(&bs, 64);
+    }
+    return bs.error;
+}
+
+static errno_t squeeze_decompress_block(squeeze_type* s,
+                                        const squeeze_block_type* b,
+                                        uint8_t* data) {
+    bitstream_type* out = s->bs; // restored on return
+    bitstream_type bs = { .file = out->file };
+    errno_t r = file.seek(bs.file, (int64_t)b->position, SEEK_SET);
+    if (r != 0) { return r; }
+    uint64_t bytes = 0;
+    uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+    uint16_t flags = 0;
+    uint32_t id = 0;
+    squeeze.read_header(&bs, &bytes, &win_bits, &map_bits, &len_bits,
+                        &flags, &id);
+    if (bs.error != 0) { return bs.error; }
+    if (bytes != b->bytes || win_bits != huffman.log2_of_pow2(s->pos.n) ||
+        map_bits != huffman.log2_of_pow2(s->map.n) ||
+        len_bits != huffman.log2_of_pow2(s->len.n) || id != 0) {
+        return EINVAL;
+    }
+    squeeze_clear(s);
+    s->bs = &bs;
+    s->flags = flags;
+    squeeze_decompress(s, data, bytes);
+    s->bs = out;
+    r = s->error;
+    s->error = 0; // block errors are returned, the context stays usable
+    return r;
+}
+
+static errno_t squeeze_decompress_range(squeeze_type* s, uint64_t offset,
+                                        uint8_t* data, size_t bytes) {
+    FILE* f = s->bs != null ? s->bs->file : null;
+    if (f == null || s->history != null) { return EINVAL; }
+    uint64_t footer[4]; // blocks, index position, block size, magic
+    errno_t r = squeeze_read_words(f, -(int64_t)sizeof(footer), SEEK_END,
+                                   footer, 4);
+    if (r != 0) { return r; }
+    const uint64_t n = footer[0];
+    const uint64_t block = footer[2];
+    if (footer[3] != squeeze_seekable_magic || block == 0) { return EINVAL; }
+    if (bytes == 0) { return 0; }
+    uint8_t* buffer = null;
+    uint64_t k = offset / block;
+    uint64_t done = 0;
+    while (r == 0 && done < bytes) {
+        uint64_t entry[4];
+        squeeze_block_type b = {0};
+        if (k >= n) { r = ERANGE; break; }
+        r = squeeze_read_words(f, (int64_t)(footer[1] + k * sizeof(entry)),
+                               SEEK_SET, entry, 4);
+        if (r != 0) { break; }
+        b = (squeeze_block_type){ .offset = entry[0], .position = entry[1],
+                                  .bytes = entry[2], .size = entry[3] };
+        if (b.bytes > block || b.offset != k * block) { r = EINVAL; break; }
+        const uint64_t from = offset + done - b.offset;
+        const uint64_t count = b.bytes - from < bytes - done ?
+                               b.bytes - from : bytes - done;
+        if (from >= b.bytes) { r = ERANGE; break; }
+        if (from == 0 && count == b.bytes) { // whole block in place
+            r = squeeze_decompress_block(s, &b, data + done);
+        } else {
+            if (buffer == null) { buffer = (uint8_t*)malloc((size_t)block); }
+            if (buffer == null) { r = ENOMEM; break; }
+            r = squeeze_decompress_block(s, &b, buffer);
+            if (r == 0) { memcpy(data + done, buffer + from, (size_t)count); }
+        }
+        done += count;
+        k++;
+    }
+    free(buffer);
+    return r;
+}
+
+static void squeeze_tree_stats(const huffman_tree_type* t,
+                               squeeze_tree_stats_type* ts) {
+    ts->n       = t->n;
+    ts->depth   = t->depth;
+    ts->updates = t->stats.updates;
+    ts->swaps   = t->stats.swaps;
+    ts->moves   = t->stats.moves;
+}
+
+static void squeeze_stats(const squeeze_type* s, squeeze_stats_type* stats) {
+    *stats = s->stats;
+    const uint64_t tokens = stats->literals + stats->matches + stats->words;
+    if (tokens > 0) {
+        stats->bits_per_token = (double)stats->bits / (double)tokens;
+        stats->hit_rate = (double)stats->words / (double)tokens;
+    }
+    stats->entries = s->map.entries;
+    stats->slots   = s->map.n;
+    stats->load    = s->map.n > 0 ?
+                     (double)s->map.entries / (double)s->map.n : 0;
+    squeeze_tree_stats(&s->sym, &stats->sym);
+    squeeze_tree_stats(&s->dic, &stats->dic);
+    squeeze_tree_stats(&s->pos, &stats->pos);
+    squeeze_tree_stats(&s->len, &stats->len);
+}
+
+static errno_t squeeze_trace(const squeeze_type* s, FILE* f) {
+    static const char* kinds[] = { "compress", "search", "decompress" };
+    static const char* stages[] = { "search", "lookup", "coding", "io" };
+    const squeeze_trace_type* t = &s->trace;
+    const uint64_t count = atomic_load(&((squeeze_trace_type*)t)->count);
+    const uint64_t n = t->event == null ? 0 :
+                       (count < t->capacity ? count : t->capacity);
+    // cycle counter ticks per ns measured over the traced calls
+    const double rate = t->ns > t->origin && t->ticks > t->origin_ticks ?
+        (double)(t->ticks - t->origin_ticks) / (double)(t->ns - t->origin) : 1;
+    uint64_t threads[2] = {0}; // bit set of thread ids seen
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (uint64_t i = 0; i < n; i++) {
+        const squeeze_event_type* e = &t->event[i];
+        const uint32_t kind = e->kind < countof(kinds) ? e->kind : 0;
+        const double ts = (double)e->start / 1000.0; // microseconds
+        if (e->thread < 128) {
+            threads[e->thread / 64] |= 1ULL << (e->thread % 64);
+        }
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"squeeze\",\"ph\":\"X\","
+                   "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                   "\"args\":{\"bytes\":%llu",
+                i == 0 ? "" : ",\n", kinds[kind], e->thread, ts,
+                (double)e->duration / 1000.0, (unsigned long long)e->bytes);
+        uint64_t sampled = 0;
+        for (int32_t k = 0; k < squeeze_stages; k++) {
+            sampled += e->stage[k];
+            fprintf(f, ",\"%s_us\":%.3f", stages[k],
+                    (double)e->stage[k] / rate / 1000.0);
+        }
+        fprintf(f, "}}");
+        if (sampled > 0) { // stage time as a counter track per thread
+            fprintf(f, ",\n{\"name\":\"stages %u\",\"ph\":\"C\",\"pid\":1,"
+                       "\"tid\":%u,\"ts\":%.3f,\"args\":{",
+                    e->thread, e->thread, ts);
+            for (int32_t k = 0; k < squeeze_stages; k++) {
+                fprintf(f, "%s\"%s\":%.3f", k == 0 ? "" : ",", stages[k],
+                        (double)e->stage[k] / rate / 1000.0);
+            }
+            fprintf(f, "}}");
+        }
+    }
+    for (uint32_t id = 0; id < 128; id++) {
+        if (threads[id / 64] & (1ULL << (id % 64))) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+                       "\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"",
+                    n == 0 ? "" : ",\n", id);
+            if (id == squeeze_thread_coder) {
+                fprintf(f, "coder");
+            } else if (id == squeeze_thread_finder) {
+                fprintf(f, "finder");
+            } else {
+                fprintf(f, "worker %u", id - squeeze_thread_worker);
+            }
+            fprintf(f, "\"}}");
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{"
+               "\"events\":%llu,\"dropped\":%llu}}\n",
+            (unsigned long long)n, (unsigned long long)(count - n));
+    return ferror(f) ? EIO : 0;
+}
+
+// Auto-tune
+
+enum { squeeze_tune_values = 5 };
+
+typedef struct {
+    uint8_t  bits[3];    // win_bits, map_bits, len_bits
+    uint64_t compressed; // bytes of the sample
+    double   seconds;
+} squeeze_candidate_type;
+
+static bool squeeze_tune_fits(const squeeze_tune_type* t, const uint8_t bits[3]) {
+    const size_t bytes = squeeze_sizeof_with(bits[0], bits[1], bits[2],
+                                             t->options);
+    return bytes > 0 && (t->memory == 0 || bytes <= t->memory);
+}
+
+static bool squeeze_tune_better(const squeeze_tune_type* t, uint64_t sampled,
+                                const squeeze_candidate_type* c,
+                                const squeeze_candidate_type* best) {
+    if (best->compressed == 0) { return true; } // none yet
+    const double seconds = t->speed > 0 ? (double)sampled / t->speed : 0;
+    const bool fast = t->speed == 0 || c->seconds <= seconds;
+    const bool best_fast = t->speed == 0 || best->seconds <= seconds;
+    if (fast != best_fast) { return fast; }
+    if (!fast) { return c->seconds < best->seconds; }
+    if (c->compressed != best->compressed) {
+        return c->compressed < best->compressed;
+    }
+    return squeeze_sizeof_with(c->bits[0], c->bits[1], c->bits[2], 0) <
+           squeeze_sizeof_with(best->bits[0], best->bits[1], best->bits[2], 0);
+}
+
+static errno_t squeeze_tune_run(const squeeze_tune_type* t,
+                                const uint8_t* sample, size_t bytes,
+                                int32_t scale, squeeze_candidate_type* c) {
+    // options that need caller buffers or change the stream are dropped
+    const uint32_t options = t->options & (squeeze_option_refs |
+        squeeze_option_pipeline | squeeze_option_parallel |
+        squeeze_option_long);
+    const int32_t map_bits = c->bits[1] - scale;
+    bitstream_type sink = {0};
+    squeeze_type* s = squeeze_new(&sink, c->bits[0],
+        (uint8_t)(map_bits < squeeze_min_map_bits ?
+                  squeeze_min_map_bits : map_bits), c->bits[2], options);
+    if (s == null) { return ENOMEM; }
+    s->flags = t->flags & ~(uint16_t)squeeze_flag_dictionary;
+    const uint64_t start = squeeze_ns();
+    squeeze_compress(s, sample, bytes);
+    c->seconds = (double)(squeeze_ns() - start) / 1e9;
+    c->compressed = sink.bytes;
+    const errno_t r = s->error;
+    squeeze_delete(s);
+    return r;
+}
+
+static errno_t squeeze_tune(const uint8_t* data, size_t bytes,
+                            squeeze_tune_type* t) {
+    static const uint8_t values[3][squeeze_tune_values] = {
+        { 10, 12, 14, 16, 18 }, // win_bits
+        { 12, 14, 16, 18, 20 }, // map_bits
+        {  4,  5,  6,  7,  8 }  // len_bits
+    };
+    static const int32_t order[3] = { 0, 2, 1 }; // map (memory) last
+    const size_t sample = t->sample > 0 ? t->sample : squeeze_tune_sample;
+    const size_t slices = squeeze_tune_slices;
+    uint8_t* copy = null;
+    const uint8_t* s = data;
+    size_t n = bytes;
+    if (bytes > sample && sample >= slices) { // slices spread over data
+        const size_t slice = sample / slices;
+        copy = (uint8_t*)malloc(slice * slices);
+        if (copy == null) { return ENOMEM; }
+        for (size_t i = 0; i < slices; i++) {
+            const size_t offset = (bytes - slice) / (slices - 1) * i;
+            memcpy(copy + slice * i, data + offset, slice);
+        }
+        s = copy;
+        n = slice * slices;
+    }
+    const int32_t scale = n > 0 && bytes > n ?
+                          squeeze_log2((bytes - 1) / n) + 1 : 0;
+    squeeze_candidate_type best = { .bits = { 12, 16, 4 } };
+    uint8_t smallest[3] = { squeeze_min_win_bits, best.bits[1],
+                            squeeze_min_len_bits };
+    while (!squeeze_tune_fits(t, smallest) &&
+           smallest[1] > squeeze_min_map_bits) {
+        smallest[1]--;
+    }
+    errno_t r = squeeze_tune_fits(t, smallest) ? 0 : ENOMEM;
+    best.bits[1] = smallest[1];
+    t->candidates = 0;
+    for (int32_t k = 0; k < 3 && r == 0; k++) {
+        const int32_t a = order[k];
+        const squeeze_candidate_type current = best;
+        squeeze_candidate_type last = { .compressed = 0 };
+        best.compressed = 0;
+        for (int32_t i = 0; i < squeeze_tune_values && r == 0; i++) {
+            squeeze_candidate_type c = current;
+            c.bits[a] = values[a][i];
+            if (squeeze_tune_fits(t, c.bits)) {
+                r = squeeze_tune_run(t, s, n, scale, &c);
+                t->candidates++;
+                if (r == 0 && squeeze_tune_better(t, n, &c, &best)) {
+                    best = c;
+                }
+                const bool slow = t->speed > 0 &&
+                                  c.seconds > (double)n / t->speed;
+                if (slow || (last.compressed != 0 &&
+                             c.compressed >= last.compressed)) {
+                    break;
                 }
-            } else { // byte >= 0x80
-                uint64_t b = squeeze_read_huffman(s, &s->sym);
-                squeeze_if_error_return(s);
-                data[i] = (uint8_t)b | 0x80;
-                i++;
+                last = c;
             }
-        } else { // literal byte (ASCII byte < 0x80)
-            uint64_t b = squeeze_read_huffman(s, &s->sym);
-            squeeze_if_error_return(s);
-            data[i] = (uint8_t)b;
-            i++;
         }
+        if (best.compressed == 0) { best = current; }
+    }
+    if (r == 0) {
+        t->win_bits   = best.bits[0];
+        t->map_bits   = best.bits[1];
+        t->len_bits   = best.bits[2];
+        t->sampled    = n;
+        t->compressed = best.compressed;
+        t->seconds    = best.seconds;
+        if (t->bs != null) {
+            squeeze_write_header(t->bs, bytes, best.bits[0], best.bits[1],
+                                 best.bits[2], t->flags, 0);
+            r = t->bs->error;
+        }
+    }
+    free(copy);
+    return r;
+}
+
+// Batch
+
+typedef struct {
+    squeeze_batch_type* b;
+    squeeze_record_type* records;
+    size_t   n;
+    int32_t  worker;
+    int32_t  workers;
+    uint8_t  bits[3]; // win_bits, map_bits, len_bits
+    uint16_t flags;
+    uint32_t options;
+    uint32_t id;      // dictionary
+    uint8_t* buffer;  // compress: records of the worker
+    size_t   capacity;
+    size_t   used;
+    const uint8_t* batch; // decompress
+    errno_t  error;
+} squeeze_batch_worker_type;
+
+// context options of the batch workers (not in the batch header)
+
+enum {
+    squeeze_batch_options = squeeze_option_refs | squeeze_option_pipeline |
+        squeeze_option_parallel | squeeze_option_long |
+        squeeze_option_stats | squeeze_option_trace
+};
+
+// the worker's context of the batch object cleared (or replaced if the
+// parameters changed) and primed for the next batch
+
+static squeeze_type* squeeze_batch_worker_context(squeeze_batch_worker_type* w,
+                                                  bitstream_type* bs) {
+    squeeze_type** c = &w->b->context[w->worker];
+    squeeze_type* s = *c;
+    if (s != null && (s->pos.n != 1 << w->bits[0] ||
+                      s->map.n != 1 << w->bits[1] ||
+                      s->len.n != 1 << w->bits[2] ||
+                      (s->options & squeeze_batch_options) != w->options)) {
+        squeeze_delete(s);
+        s = null;
+        *c = null;
+    }
+    if (s == null) {
+        s = squeeze_new(bs, w->bits[0], w->bits[1], w->bits[2], w->options);
+        if (s == null) { w->error = ENOMEM; return null; }
+        *c = s;
+    } else {
+        squeeze_clear(s);
+        s->bs = bs;
+    }
+    s->flags = 0;
+    if (w->flags & squeeze_flag_dictionary) {
+        w->error = squeeze_prime(s, w->b->image, w->b->image_bytes);
+        if (w->error == 0 && s->dictionary != w->id) { w->error = EINVAL; }
+    }
+    if (w->error != 0) { return null; }
+    s->flags = w->flags;
+    return s;
+}
+
+static void squeeze_batch_worker_cancel(squeeze_batch_worker_type* w,
+                                        size_t k) {
+    for (; k < w->n; k += (size_t)w->workers) {
+        w->records[k].error = w->error;
+    }
+}
+
+static int squeeze_batch_worker_compress(void* p) {
+    squeeze_batch_worker_type* w = (squeeze_batch_worker_type*)p;
+    bitstream_type rb = {0};
+    squeeze_type* s = squeeze_batch_worker_context(w, &rb);
+    size_t k = (size_t)w->worker;
+    for (; k < w->n && w->error == 0; k += (size_t)w->workers) {
+        squeeze_record_type* r = &w->records[k];
+        const size_t bound = (size_t)r->bytes * 2 + 4096;
+        if (w->capacity - w->used < bound) {
+            const size_t capacity = w->capacity * 2 > w->used + bound ?
+                                    w->capacity * 2 : w->used + bound;
+            uint8_t* buffer = (uint8_t*)realloc(w->buffer, capacity);
+            if (buffer == null) { w->error = ENOMEM; break; }
+            w->buffer = buffer;
+            w->capacity = capacity;
+        }
+        rb = (bitstream_type){ .data = w->buffer + w->used, .capacity = bound };
+        if (r->bytes > 0) { squeeze_compress(s, r->data, r->bytes); }
+        r->error = s->error;
+        r->position = w->used; // in the worker buffer until written
+        r->size = rb.bytes;
+        w->used += (size_t)rb.bytes;
+        w->error = s->error;
+    }
+    squeeze_batch_worker_cancel(w, k);
+    if (s != null) { s->bs = null; } // `rb` goes out of scope
+    return 0;
+}
+
+static int squeeze_batch_worker_decompress(void* p) {
+    squeeze_batch_worker_type* w = (squeeze_batch_worker_type*)p;
+    bitstream_type rb = {0};
+    squeeze_type* s = squeeze_batch_worker_context(w, &rb);
+    size_t k = (size_t)w->worker;
+    for (; k < w->n && w->error == 0; k += (size_t)w->workers) {
+        squeeze_record_type* r = &w->records[k];
+        if (r->bytes > 0) {
+            rb = (bitstream_type){ .data = (uint8_t*)w->batch + r->position,
+                                   .bytes = r->size };
+            squeeze_decompress(s, r->output, r->bytes);
+        } else if (r->size != 0) {
+            s->error = EINVAL;
+        }
+        r->error = s->error;
+        w->error = s->error;
+    }
+    squeeze_batch_worker_cancel(w, k);
+    if (s != null) { s->bs = null; }
+    return 0;
+}
+
+// runs workers on their threads, the last one on the calling thread
+
+static errno_t squeeze_batch_workers_run(squeeze_batch_worker_type w[],
+                                         int32_t workers, int (*run)(void*)) {
+    thrd_t thread[squeeze_parallel_max_workers];
+    bool started[squeeze_parallel_max_workers];
+    for (int32_t k = 0; k < workers; k++) {
+        started[k] = k < workers - 1 &&
+            thrd_create(&thread[k], run, &w[k]) == thrd_success;
+    }
+    for (int32_t k = 0; k < workers; k++) {
+        if (!started[k]) { run(&w[k]); }
+    }
+    for (int32_t k = 0; k < workers; k++) {
+        if (started[k]) { thrd_join(thread[k], null); }
+    }
+    errno_t r = 0;
+    for (int32_t k = 0; k < workers && r == 0; k++) { r = w[k].error; }
+    return r;
+}
+
+static void squeeze_dispose_batch(squeeze_batch_type* b) {
+    for (int32_t k = 0; k < squeeze_parallel_max_workers; k++) {
+        if (b->context[k] != null) {
+            squeeze_delete(b->context[k]);
+            b->context[k] = null;
+        }
+    }
+}
+
+static errno_t squeeze_batch_id(const squeeze_batch_type* b, uint32_t *id) {
+    squeeze_dictionary_type h = {0};
+    *id = 0;
+    if ((b->flags & squeeze_flag_dictionary) == 0) { return 0; }
+    if (b->image == null || b->image_bytes < sizeof(h)) { return EINVAL; }
+    memcpy(&h, b->image, sizeof(h));
+    *id = h.id;
+    return 0;
+}
+
+static errno_t squeeze_compress_batch(bitstream_type* bs,
+                                      squeeze_batch_type* b,
+                                      squeeze_record_type records[], size_t n) {
+    int32_t workers = b->workers > 0 ? b->workers : squeeze_parallel_workers;
+    if (workers > squeeze_parallel_max_workers) {
+        workers = squeeze_parallel_max_workers;
+    }
+    if ((size_t)workers > n) { workers = n > 0 ? (int32_t)n : 1; }
+    const uint32_t options = b->options & squeeze_batch_options;
+    uint32_t id = 0;
+    errno_t r = bs->bits != 0 || n > UINT32_MAX ?
+                EINVAL : squeeze_batch_id(b, &id);
+    uint64_t total = 0;
+    for (size_t k = 0; k < n && r == 0; k++) {
+        if (records[k].bytes > squeeze_batch_max_record) { r = E2BIG; }
+        total += records[k].bytes;
+        records[k].error = 0;
+    }
+    squeeze_batch_worker_type w[squeeze_parallel_max_workers];
+    for (int32_t k = 0; k < workers; k++) {
+        w[k] = (squeeze_batch_worker_type){
+            .b = b, .records = records, .n = n, .worker = k,
+            .workers = workers,
+            .bits = { b->win_bits, b->map_bits, b->len_bits },
+            .flags = b->flags, .options = options, .id = id
+        };
+    }
+    if (r == 0) {
+        r = squeeze_batch_workers_run(w, workers,
+                                      squeeze_batch_worker_compress);
+    }
+    for (size_t k = 0; k < n && r == 0; k++) {
+        if (records[k].size > UINT32_MAX) { r = E2BIG; }
+    }
+    if (r == 0) {
+        const uint64_t start = bs->bytes;
+        squeeze.write_header(bs, total, b->win_bits, b->map_bits, b->len_bits,
+                             b->flags, id);
+        bitstream.write_bits(bs, squeeze_batch_magic, 32);
+        bitstream.write_bits(bs, n, 32);
+        bitstream.write_bits(bs, (uint64_t)workers, 32);
+        for (size_t k = 0; k < n; k++) {
+            bitstream.write_bits(bs, records[k].bytes, 32);
+            bitstream.write_bits(bs, records[k].size, 32);
+        }
+        bitstream.flush(bs);
+        for (size_t k = 0; k < n && bs->error == 0; k++) {
+            squeeze_record_type* e = &records[k];
+            const uint8_t* p = w[k % (size_t)workers].buffer + e->position;
+            e->position = bs->bytes - start;
+            for (uint64_t i = 0; i < e->size; i += 8) { // whole words
+                uint64_t word = 0;
+                for (int32_t j = 0; j < 8; j++) {
+                    word |= (uint64_t)p[i + (uint64_t)j] << (j * 8);
+                }
+                bitstream.write_bits(bs, word, 64);
+            }
+        }
+        r = bs->error;
+    }
+    for (int32_t k = 0; k < workers; k++) { free(w[k].buffer); }
+    return r;
+}
+
+static errno_t squeeze_decompress_batch(squeeze_batch_type* b,
+                                        const void* batch, size_t bytes,
+                                        squeeze_record_type records[],
+                                        size_t *n) {
+    squeeze_batch_type defaults = {0}; // contexts disposed on return
+    squeeze_batch_type* owned = b == null ? &defaults : null;
+    if (b == null) { b = &defaults; }
+    bitstream_type bs = { .data = (uint8_t*)batch, .bytes = bytes };
+    uint64_t total = 0;
+    uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+    uint16_t flags = 0;
+    uint32_t id = 0;
+    squeeze.read_header(&bs, &total, &win_bits, &map_bits, &len_bits,
+                        &flags, &id);
+    const uint64_t magic = bitstream.read_bits(&bs, 32);
+    const size_t count = (size_t)bitstream.read_bits(&bs, 32);
+    const int32_t workers = (int32_t)bitstream.read_bits(&bs, 32);
+    const uint32_t options = b->options & squeeze_batch_options;
+    errno_t r = bs.error;
+    if (r == 0 && (magic != squeeze_batch_magic || workers < 1 ||
+                   workers > squeeze_parallel_max_workers ||
+                   squeeze_sizeof(win_bits, map_bits, len_bits) == 0)) {
+        r = EINVAL;
+    }
+    if (r == 0 && (records == null || *n < count)) {
+        *n = count;
+        return E2BIG;
+    }
+    bool index = false; // only
+    uint64_t sum = 0;
+    for (size_t k = 0; k < count && r == 0; k++) {
+        records[k].bytes = bitstream.read_bits(&bs, 32);
+        records[k].size  = bitstream.read_bits(&bs, 32);
+        records[k].error = 0;
+        sum += records[k].bytes;
+        if (records[k].output == null) { index = true; }
+        r = bs.error;
+    }
+    uint64_t position = bs.read; // the rest of the index word is padding
+    for (size_t k = 0; k < count && r == 0; k++) {
+        records[k].position = position;
+        position += records[k].size;
+        if (position > bytes || records[k].size % 8 != 0) { r = EINVAL; }
+    }
+    if (r == 0 && sum != total) { r = EINVAL; }
+    if (r == 0) { *n = count; }
+    if (r == 0 && !index && count > 0) {
+        squeeze_batch_worker_type w[squeeze_parallel_max_workers];
+        for (int32_t k = 0; k < workers; k++) {
+            w[k] = (squeeze_batch_worker_type){
+                .b = b, .records = records, .n = count, .worker = k,
+                .workers = workers, .bits = { win_bits, map_bits, len_bits },
+                .flags = flags, .options = options, .id = id,
+                .batch = (const uint8_t*)batch
+            };
+        }
+        r = squeeze_batch_workers_run(w, workers,
+                                      squeeze_batch_worker_decompress);
     }
+    if (owned != null) { squeeze_dispose_batch(owned); }
+    return r;
 }
 
 squeeze_interface squeeze = {
+    .init         = squeeze_init,
+    .new          = squeeze_new,
+    .new_in       = squeeze_new_in,
+    .delete       = squeeze_delete,
+    .fini         = squeeze_fini,
+    .clear        = squeeze_clear,
     .write_header = squeeze_write_header,
     .compress     = squeeze_compress,
     .read_header  = squeeze_read_header,
     .decompress   = squeeze_decompress,
+    .train        = squeeze_train,
+    .dictionary   = squeeze_dictionary,
+    .prime        = squeeze_prime,
+    .checkpoint   = squeeze_checkpoint,
+    .restore      = squeeze_restore,
+    .compress_blocks  = squeeze_compress_blocks,
+    .decompress_range = squeeze_decompress_range,
+    .stats            = squeeze_stats,
+    .trace            = squeeze_trace,
+    .tune             = squeeze_tune,
+    .compress_batch   = squeeze_compress_batch,
+    .decompress_batch = squeeze_decompress_batch,
+    .dispose_batch    = squeeze_dispose_batch
 };
 
 #endif // squeeze_implementation
@@ -16,68 +16,18 @@
 #define max(x, y)      rt_max(x, y)
 #define swap(a, b)     rt_swap(a, b)
 
+#include "arena.h"
 #include "bitstream.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "filter.h"
 #include "map.h"
 #include "squeeze.h"
 #include "file.h"
 
-static errno_t squeeze_init_with(squeeze_type* s, void* memory, size_t size,
-                                 uint8_t win_bits, uint8_t map_bits,
-                                 uint8_t len_bits) {
-    errno_t r = 0;
-    assert(squeeze_min_win_bits <= win_bits && win_bits <= squeeze_max_win_bits);
-    assert(squeeze_min_map_bits <= map_bits && map_bits <= squeeze_max_map_bits);
-    assert(squeeze_min_len_bits <= len_bits && len_bits <= squeeze_max_len_bits);
-    size_t expected = squeeze_sizeof(win_bits, map_bits, len_bits);
-    // 167,936,192 bytes for (win_bits = 11, map_bits = 19)
-    assert(size == expected);
-    if (expected == 0 || memory == null || size != expected) {
-        r = EINVAL;
-    } else {
-        uint8_t* p = (uint8_t*)memory;
-        memset(memory, 0, sizeof(squeeze_type));
-        p += sizeof(squeeze_type);
-        const size_t map_n = ((size_t)1U) << map_bits;
-        const size_t dic_n = map_n;
-        const size_t sym_n = 256; // always 256
-        const size_t pos_n = ((size_t)1U) << win_bits;
-        const size_t len_n = ((size_t)1U) << len_bits;
-        const size_t dic_m = dic_n * 2 - 1;
-        const size_t sym_m = sym_n * 2 - 1;
-        const size_t pos_m = pos_n * 2 - 1;
-        const size_t len_m = len_n * 2 - 1;
-        s->map_entries = (map_entry_t*)p; p += sizeof(map_entry_t) * map_n;
-        s->dic_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * dic_m;
-        s->sym_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * sym_m;
-        s->pos_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * pos_m;
-        s->len_nodes = (huffman_node_type*)p; p += sizeof(huffman_node_type) * len_m;
-        assert(p == (uint8_t*)memory + size);
-        map.init(&s->map,     s->map_entries, map_n);
-        huffman.init(&s->sym, s->sym_nodes, sym_m);
-        huffman.init(&s->dic, s->dic_nodes, dic_m);
-        huffman.init(&s->pos, s->pos_nodes, pos_m);
-        huffman.init(&s->len, s->len_nodes, len_m);
-    }
-    return r;
-}
-
-static squeeze_type* squeeze_new(bitstream_type* bs, uint8_t win_bits,
-                                 uint8_t map_bits, uint8_t len_bits) {
-    const uint64_t bytes = squeeze_sizeof(win_bits, map_bits, len_bits);
-    squeeze_type* s = (squeeze_type*)calloc(1, (size_t)bytes);
-    if (s != null) {
-        squeeze_init_with(s, s, bytes, win_bits, map_bits, len_bits);
-        s->bs = bs;
-    }
-    return s;
-}
-
-static void squeeze_delete(squeeze_type* s) {
-    free(s);
-}
-
 static errno_t compress(const char* from, const char* to,
-                        const uint8_t* data, uint64_t bytes) {
+                        const uint8_t* data, uint64_t bytes, uint16_t flags,
+                        uint32_t options) {
     enum { bits_win = 12, bits_map = 19, bits_len = 4 };
     FILE* out = null; // compressed file
     errno_t r = fopen_s(&out, to, "wb") != 0;
@@ -86,22 +36,35 @@ static errno_t compress(const char* from, const char* to,
         return r;
     }
     squeeze_type* s = null;
-    bitstream_type bs = { .file = out };
-    squeeze.write_header(&bs, bytes, bits_win, bits_map, bits_len);
-    if (bs.error != 0) {
-        r = bs.error;
+    bitstream_io_type io = {0};
+    bitstream_type bs = {0};
+    r = bitstream.open(&bs, &io, out, true, 0);
+    if (r == 0) {
+        squeeze.write_header(&bs, bytes, bits_win, bits_map, bits_len,
+                             flags, 0);
+    }
+    if (r != 0 || bs.error != 0) {
+        if (r == 0) { r = bs.error; }
         printf("Failed to create \"%s\": %s\n", to, strerror(r));
     } else {
-        s = squeeze_new(&bs, bits_win, bits_map, bits_len);
+        s = squeeze.new(&bs, bits_win, bits_map, bits_len, options);
         if (s != null) {
+            s->flags = flags;
             squeeze.compress(s, data, bytes);
             assert(s->error == 0);
         } else {
             r = ENOMEM;
-            printf("squeeze_new() failed.\n");
+            printf("squeeze.new() failed.\n");
             assert(false);
         }
     }
+    if (bs.io != null) { // writes the buffered rest
+        errno_t rc = bitstream.close(&bs);
+        if (rc != 0) {
+            printf("Failed to write \"%s\": %s\n", to, strerror(rc));
+            if (r == 0) { r = rc; }
+        }
+    }
     errno_t rc = fclose(out) == 0 ? 0 : errno; // error writing buffered output
     if (rc != 0) {
         printf("Failed to flush on file close: %s\n", strerror(rc));
@@ -126,46 +89,54 @@ static errno_t compress(const char* from, const char* to,
         }
     }
     if (s != null) {
-        squeeze_delete(s); s = null;
+        squeeze.delete(s); s = null;
     }
     return r;
 }
 
-static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
+static errno_t verify(const char* fn, const uint8_t* input, size_t size,
+                      uint32_t options) {
     // decompress and compare
     FILE* in = null; // compressed file
     errno_t r = fopen_s(&in, fn, "rb");
     if (r != 0 || in == null) {
         printf("Failed to open \"%s\"\n", fn);
     }
-    bitstream_type bs = { .file = in };
+    bitstream_io_type io = {0};
+    bitstream_type bs = {0};
+    if (r == 0) { r = bitstream.open(&bs, &io, in, false, 0); }
     uint64_t bytes = 0;
     uint8_t win_bits = 0;
     uint8_t map_bits = 0;
     uint8_t len_bits = 0;
+    uint16_t flags = 0;
+    uint32_t id = 0;
     if (r == 0) {
-        squeeze.read_header(&bs, &bytes, &win_bits, &map_bits, &len_bits);
+        squeeze.read_header(&bs, &bytes, &win_bits, &map_bits, &len_bits,
+                            &flags, &id);
         if (bs.error != 0) {
             printf("Failed to read header from \"%s\"\n", fn);
             r = bs.error;
         }
     }
     if (r == 0) {
-        squeeze_type* s = squeeze_new(&bs, win_bits, map_bits, len_bits);
+        squeeze_type* s = squeeze.new(&bs, win_bits, map_bits, len_bits,
+                                      options);
         if (s == null) {
             r = ENOMEM;
-            printf("squeeze_new() failed.\n");
+            printf("squeeze.new() failed.\n");
             assert(false);
         } else {
             assert(s->error == 0 && bytes == size && win_bits == win_bits);
+            s->flags = flags;
             uint8_t* data = (uint8_t*)calloc(1, (size_t)bytes);
             if (data == null) {
                 printf("Failed to allocate memory for decompressed data\n");
+                bitstream.close(&bs);
                 fclose(in);
                 return ENOMEM;
             }
             squeeze.decompress(s, data, bytes);
-            fclose(in);
             assert(s->error == 0);
             if (s->error == 0) {
                 const bool same = size == bytes && memcmp(input, data, bytes) == 0;
@@ -182,29 +153,1111 @@ static errno_t verify(const char* fn, const uint8_t* input, size_t size) {
             if (r != 0) {
                 printf("Failed to decompress\n");
             }
-            squeeze_delete(s); s = null;
+            squeeze.delete(s); s = null;
         }
     }
+    if (bs.io != null) {
+        errno_t rc = bitstream.close(&bs);
+        if (r == 0) { r = rc; }
+    }
+    if (in != null) { fclose(in); }
     return r;
 }
 
 const char* compressed = "~compressed~.bin";
 
-static errno_t test(const char* fn, const uint8_t* data, size_t bytes) {
-    errno_t r = compress(fn, compressed, data, bytes);
+// deepest leaf bits of the subtree by a full walk
+
+static int32_t test_huffman_deep(const huffman_tree_type* t, int32_t i) {
+    const huffman_node_type* n = &t->node[i];
+    if (n->lix == -1) { return n->bits; }
+    const int32_t l = test_huffman_deep(t, n->lix);
+    const int32_t r = test_huffman_deep(t, n->rix);
+    return l > r ? l : r;
+}
+
+// Fibonacci frequencies would grow the tree far deeper than
+// huffman_max_bits; the kept subtree depths must match a full walk
+
+static errno_t test_huffman_depth(void) {
+    enum { n = 64, m = n * 2 - 1 };
+    static huffman_node_type nodes[m];
+    huffman_tree_type t = {0};
+    huffman.init(&t, nodes, m);
+    enum { symbols = 34 }; // unbound code would be 33 bits long
+    uint64_t f[symbols] = { 1, 1 };
+    for (int32_t i = 2; i < symbols; i++) { f[i] = f[i - 1] + f[i - 2]; }
+    for (int32_t i = symbols - 1; i >= 0; i--) { // rarest symbols last
+        for (uint64_t j = 0; j < f[i]; j++) { huffman.inc_frequency(&t, i); }
+    }
+    errno_t r = t.depth == huffman_max_bits ? 0 : ERANGE;
+    for (int32_t i = n; i < m && r == 0; i++) {
+        if (nodes[i].deep != test_huffman_deep(&t, i)) { r = EINVAL; }
+    }
+    assert(r == 0);
+    if (r == 0) { printf("huffman depth limited to %d\n", t.depth); }
+    return r;
+}
+
+// Words of up to 255 bytes exhaust the prefix index nodes: it must stay
+// attached and map.best() must agree with a map probing every length,
+// also after map.clear() (used slots list and a new index epoch)
+
+static errno_t test_map_long(const uint8_t* data, size_t bytes) {
+    enum { n = 1024 };
+    static map_entry_t entries[2][n];
+    static map_node_t nodes[n * 4];
+    static int32_t used[map_used_n(n)];
+    map_type m[2];
+    map.init(&m[0], entries[0], n);
+    map.init(&m[1], entries[1], n);
+    map.index(&m[0], nodes, n * 4);
+    map.track(&m[0], used, countof(used));
+    uint64_t seed = 1;
+    errno_t r = bytes > 512 ? 0 : EINVAL;
+    int32_t found = 0;
+    for (int32_t round = 0; round < 2 && r == 0; round++) {
+        if (round > 0) { map.clear(&m[0]); map.clear(&m[1]); }
+        for (int32_t i = 0; i < n && r == 0; i++) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            const uint8_t b = (uint8_t)(2 + (seed >> 33) % 254);
+            const size_t at = (size_t)((seed >> 13) % (bytes - 256));
+            if (map.put(&m[0], data + at, b) != map.put(&m[1], data + at, b)) {
+                r = EINVAL;
+            }
+        }
+        found = 0;
+        for (size_t at = 0; at + 256 < bytes && r == 0; at++) {
+            const int32_t best = map.best(&m[0], data + at, 255);
+            if (best != map.best(&m[1], data + at, 255)) { r = EINVAL; }
+            if (best >= 0 && map.bytes(&m[0], best) > map_index_depth) {
+                found++;
+            }
+        }
+        if (r == 0 && (!m[0].indexed || found == 0)) { r = EINVAL; }
+    }
+    assert(r == 0);
+    if (r == 0) {
+        printf("map %d words %d index nodes, %d long matches\n",
+               m[0].entries, m[0].nodes, found);
+    }
+    return r;
+}
+
+// Buffers compressed in a row through one context by copy and references
+// mode encoders must give the same stream (same dictionary) and decode
+// in order by decoders of either mode, also with small maps filling up
+
+static errno_t test_refs(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 10, bits_len = 4, parts = 4 };
+    static const uint8_t maps[] = { 8, 10 };
+    const size_t capacity = bytes * 2 + 4096;
+    uint8_t* buffer = (uint8_t*)malloc(capacity * 2 + bytes);
+    errno_t r = buffer == null ? ENOMEM : 0;
+    uint8_t* output = buffer + capacity * 2;
+    const size_t part = bytes / parts;
+    for (int32_t k = 0; k < (int32_t)countof(maps) && r == 0; k++) {
+        uint64_t written[2] = {0};
+        for (int32_t e = 0; e < 2 && r == 0; e++) { // copy, refs
+            bitstream_type bs = { .data = buffer + capacity * e,
+                                  .capacity = capacity };
+            squeeze_type* s = squeeze.new(&bs, bits_win, maps[k], bits_len,
+                                          e == 0 ? 0 : squeeze_option_refs);
+            if (s == null) { r = ENOMEM; }
+            for (int32_t i = 0; i < parts && r == 0; i++) {
+                const size_t n = i == parts - 1 ? bytes - part * i : part;
+                squeeze.compress(s, data + part * i, n);
+                r = s->error;
+            }
+            if (s != null) { squeeze.delete(s); }
+            written[e] = bs.bytes;
+        }
+        if (r == 0 && (written[0] != written[1] ||
+                       memcmp(buffer, buffer + capacity, written[0]) != 0)) {
+            r = EINVAL;
+        }
+        for (int32_t d = 0; d < 2 && r == 0; d++) { // crossed: refs, copy
+            bitstream_type bs = { .data = buffer + capacity * d,
+                                  .bytes = written[d] };
+            squeeze_type* s = squeeze.new(&bs, bits_win, maps[k], bits_len,
+                                          d == 0 ? squeeze_option_refs : 0);
+            if (s == null) { r = ENOMEM; }
+            memset(output, 0, bytes);
+            for (int32_t i = 0; i < parts && r == 0; i++) {
+                const size_t n = i == parts - 1 ? bytes - part * i : part;
+                squeeze.decompress(s, output + part * i, n);
+                r = s->error;
+            }
+            if (r == 0 && memcmp(output, data, bytes) != 0) { r = EINVAL; }
+            if (s != null) { squeeze.delete(s); }
+        }
+        if (r == 0) {
+            printf("refs map_bits %d %d parts %lld -> %lld bytes\n", maps[k],
+                   parts, (uint64_t)bytes, written[0]);
+        }
+    }
+    free(buffer);
+    assert(r == 0);
+    return r;
+}
+
+static errno_t test(const char* fn, const uint8_t* data, size_t bytes,
+                    uint16_t flags, uint32_t options) {
+    errno_t r = compress(fn, compressed, data, bytes, flags, options);
     if (r == 0) {
-        r = verify(compressed, data, bytes);
+        r = verify(compressed, data, bytes, options);
     }
     (void)remove(compressed);
     return r;
 }
 
-static errno_t test_compression(const char* fn) {
+// Parallel search workers are started once per context and reused for
+// every chunk and every compress() call, also when `workers` changes.
+// The stream must be the same as the serial one.
+
+static errno_t test_workers(const uint8_t* sample, size_t size) {
+    enum { bits_win = 11, bits_map = 16, bits_len = 4, copies = 4 };
+    static const int32_t workers[] = { 4, 2, 6 };
+    const size_t bytes = size * copies;
+    const size_t capacity = bytes * 2 + 4096;
+    uint8_t* buffer = (uint8_t*)malloc(capacity * 2 + bytes);
+    errno_t r = buffer == null ? ENOMEM : 0;
+    uint8_t* data = buffer + capacity * 2;
+    for (int32_t i = 0; i < copies && r == 0; i++) {
+        memcpy(data + size * i, sample, size);
+        data[size * i + (size_t)i * 7] ^= 0x20;
+    }
+    assert(bytes > squeeze_parallel_chunk * 2);
+    uint64_t written[2] = {0};
+    bool reused = true; // the same pool for all compress() calls
+    for (int32_t e = 0; e < 2 && r == 0; e++) { // serial, parallel
+        bitstream_type bs = { .data = buffer + capacity * e,
+                              .capacity = capacity };
+        squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len,
+                                      e == 0 ? 0 : squeeze_option_parallel);
+        if (s == null) { r = ENOMEM; }
+        const void* pool = null;
+        for (int32_t i = 0; i < (int32_t)countof(workers) && r == 0; i++) {
+            if (e == 1) { s->workers = workers[i]; }
+            squeeze.compress(s, data, bytes);
+            r = s->error;
+            if (e == 1 && i == 0) { pool = s->pool; }
+            if (e == 1 && (pool == null || s->pool != pool)) { reused = false; }
+        }
+        if (s != null) { squeeze.delete(s); }
+        written[e] = bs.bytes;
+    }
+    if (r == 0 && (written[0] != written[1] || !reused ||
+                   memcmp(buffer, buffer + capacity, written[0]) != 0)) {
+        r = EINVAL;
+    }
+    if (r == 0) {
+        printf("workers %lld bytes -> %lld bytes\n",
+               (uint64_t)bytes * countof(workers), written[1]);
+    }
+    free(buffer);
+    assert(r == 0);
+    return r;
+}
+
+static errno_t test_compression(const char* fn, uint16_t flags,
+                                uint32_t options) {
     uint8_t* data = null;
     size_t bytes = 0;
     errno_t r = file.read_fully(fn, &data, &bytes);
     if (r != 0) { return r; }
-    return test(fn, data, bytes);
+    r = test(fn, data, bytes, flags, options);
+    free(data);
+    return r;
+}
+
+// RPC sized message compressed cold and with a dictionary trained on
+// `sample`: payload (stream without the header) must be smaller primed
+
+static errno_t test_dictionary(const uint8_t* sample, size_t size,
+                               const char* message) {
+    enum { bits_win = 10, bits_map = 10, bits_len = 4, id = 0x5EED };
+    const size_t bytes = strlen(message);
+    uint8_t compressed[2][1024];
+    uint64_t written[2] = {0};
+    uint64_t payload[2] = {0}; // bytes without the header
+    void* image = null;
+    size_t image_bytes = 0;
+    squeeze_type* s = squeeze.new(null, bits_win, bits_map, bits_len, 0);
+    errno_t r = s == null ? ENOMEM : 0;
+    if (r == 0) {
+        squeeze.train(s, sample, size);
+        image_bytes = squeeze.dictionary(s, id, null, 0);
+        image = malloc(image_bytes);
+        r = s->error != 0 ? s->error : (image == null ? ENOMEM : 0);
+    }
+    if (r == 0) {
+        squeeze.dictionary(s, id, image, image_bytes);
+        squeeze.delete(s);
+        s = null;
+    }
+    for (int32_t i = 0; i < 2 && r == 0; i++) { // cold, primed
+        const uint16_t flags = i == 0 ? 0 : squeeze_flag_dictionary;
+        bitstream_type bs = { .data = compressed[i],
+                              .capacity = sizeof(compressed[i]) };
+        squeeze.write_header(&bs, bytes, bits_win, bits_map, bits_len,
+                             flags, i == 0 ? 0 : id);
+        const uint64_t header = bs.bytes * 8 + (uint64_t)bs.bits; // bits
+        s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+        if (s == null) { r = ENOMEM; break; }
+        if (i == 1) { r = squeeze.prime(s, image, image_bytes); }
+        s->flags = flags;
+        if (r == 0) { squeeze.compress(s, (const uint8_t*)message, bytes); }
+        if (r == 0) { r = s->error; }
+        written[i] = bs.bytes;
+        payload[i] = (bs.bytes * 8 - header) / 8;
+        squeeze.delete(s);
+        s = null;
+    }
+    if (r == 0 && payload[1] >= payload[0]) { r = EINVAL; }
+    for (int32_t k = 0; k < 3 && r == 0; k++) { // malformed `sym` tree
+        uint8_t* copy = (uint8_t*)malloc(image_bytes);
+        if (copy == null) { r = ENOMEM; break; }
+        memcpy(copy, image, image_bytes);
+        huffman_node_type* node = (huffman_node_type*)(copy +
+            sizeof(squeeze_dictionary_type) + sizeof(uint32_t) * 2);
+        const int32_t root = 256 * 2 - 2;
+        if (k == 0) { node[root].lix = root; }         // cycle
+        if (k == 1) { node[7].pix = 3; }               // leaf parent
+        if (k == 2) { node[node[root].lix].bits = 2; } // depth
+        s = squeeze.new(null, bits_win, bits_map, bits_len, 0);
+        if (s == null) { r = ENOMEM; }
+        if (r == 0 && squeeze.prime(s, copy, image_bytes) != EINVAL) {
+            r = EINVAL;
+        }
+        if (s != null) { squeeze.delete(s); s = null; }
+        free(copy);
+    }
+    if (r == 0) { // decompress primed
+        bitstream_type bs = { .data = compressed[1], .bytes = written[1] };
+        uint64_t n = 0;
+        uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+        uint16_t flags = 0;
+        uint32_t stream_id = 0;
+        squeeze.read_header(&bs, &n, &win_bits, &map_bits, &len_bits,
+                            &flags, &stream_id);
+        r = bs.error != 0 ? bs.error : (stream_id != id ? EINVAL : 0);
+        if (r == 0) {
+            s = squeeze.new(&bs, win_bits, map_bits, len_bits, 0);
+            r = s == null ? ENOMEM : squeeze.prime(s, image, image_bytes);
+        }
+        uint8_t data[1024];
+        if (r == 0 && n <= sizeof(data)) {
+            s->flags = flags;
+            squeeze.decompress(s, data, n);
+            r = s->error;
+            if (r == 0 && (n != bytes || memcmp(data, message, bytes) != 0)) {
+                r = ENODATA;
+            }
+        }
+        if (s != null) { squeeze.delete(s); }
+    }
+    assert(r == 0);
+    if (r == 0) {
+        printf("%7lld -> %7lld cold, %lld primed by %lld bytes dictionary"
+               " (payload %lld, %lld)\n", (uint64_t)bytes, written[0],
+               written[1], (uint64_t)image_bytes, payload[0], payload[1]);
+    }
+    free(image);
+    return r;
+}
+
+// Compresses data in `parts` appended to the same file each by a new
+// context restored from the checkpoint of the previous one
+
+static errno_t test_append(const uint8_t* data, size_t bytes, int32_t parts) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4 };
+    void* image = null;
+    size_t image_bytes = 0;
+    size_t done = 0;
+    errno_t r = 0;
+    for (int32_t part = 0; part < parts && r == 0; part++) {
+        const size_t n = part == parts - 1 ? bytes - done : bytes / parts;
+        FILE* out = null;
+        r = fopen_s(&out, compressed, part == 0 ? "wb" : "r+b");
+        if (r != 0 || out == null) { return r != 0 ? r : EIO; }
+        bitstream_type bs = { .file = out };
+        squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len,
+                                      squeeze_option_resume);
+        if (s == null) { r = ENOMEM; }
+        if (r == 0 && part == 0) {
+            squeeze.write_header(&bs, n, bits_win, bits_map, bits_len, 0, 0);
+            r = bs.error;
+        } else if (r == 0) {
+            r = squeeze.restore(s, image, image_bytes);
+            if (r == 0) {
+                r = file.seek(out, (int64_t)s->resume.bytes, SEEK_SET);
+            }
+        }
+        if (r == 0) {
+            squeeze.compress(s, data + done, n);
+            r = s->error;
+        }
+        if (r == 0) {
+            done += n;
+            free(image);
+            image_bytes = squeeze.checkpoint(s, null, 0);
+            image = malloc(image_bytes);
+            if (image == null) { r = ENOMEM; }
+        }
+        if (r == 0) {
+            squeeze.checkpoint(s, image, image_bytes);
+            assert(s->resume.total == done);
+            bitstream_type header = { .file = out }; // total bytes
+            if (fseek(out, 0, SEEK_SET) != 0) { r = errno; }
+            if (r == 0) {
+                bitstream.write_bits(&header, s->resume.total, 64);
+                r = header.error;
+            }
+        }
+        if (s != null) { squeeze.delete(s); }
+        if (fclose(out) != 0 && r == 0) { r = errno; }
+    }
+    free(image);
+    if (r == 0) { r = verify(compressed, data, bytes, 0); }
+    (void)remove(compressed);
+    assert(r == 0);
+    return r;
+}
+
+// Checksummed stream round trip, then decoded without the delta filter
+// flag: tokens and block CRCs of the coded data match but the CRC of the
+// whole input does not
+
+static errno_t test_checksum(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4 };
+    static const char* check = "123456789";
+    if (checksum.crc32c(0, check, 9) != 0xE3069283 ||
+        checksum.crc32c(checksum.crc32c(0, check, 4), check + 4, 5) !=
+        0xE3069283 ||
+        checksum.combine(checksum.crc32c(0, check, 4),
+                         checksum.crc32c(0, check + 4, 5), 5) != 0xE3069283 ||
+        checksum.combine(checksum.crc32c(0, data, bytes / 3),
+                         checksum.crc32c(0, data + bytes / 3, bytes - bytes / 3),
+                         bytes - bytes / 3) != checksum.crc32c(0, data, bytes)) {
+        assert(false);
+        return EINVAL;
+    }
+    const uint16_t flags = squeeze_flag_checksum | squeeze_flag_stride(1);
+    const size_t capacity = bytes * 2 + 1024;
+    uint8_t* buffer = (uint8_t*)malloc(capacity + bytes);
+    if (buffer == null) { return ENOMEM; }
+    uint8_t* output = buffer + capacity;
+    bitstream_type bs = { .data = buffer, .capacity = capacity };
+    squeeze.write_header(&bs, bytes, bits_win, bits_map, bits_len, flags, 0);
+    squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+    errno_t r = s == null ? ENOMEM : bs.error;
+    if (r == 0) {
+        s->flags = flags;
+        squeeze.compress(s, data, bytes);
+        r = s->error;
+    }
+    if (s != null) { squeeze.delete(s); }
+    const uint64_t written = bs.bytes;
+    for (int32_t i = 0; i < 2 && r == 0; i++) { // as written, without delta
+        bitstream_type in = { .data = buffer, .bytes = written };
+        uint64_t n = 0;
+        uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+        uint16_t f = 0;
+        uint32_t id = 0;
+        squeeze.read_header(&in, &n, &win_bits, &map_bits, &len_bits, &f, &id);
+        r = in.error != 0 ? in.error : (f != flags || n != bytes ? EINVAL : 0);
+        s = r == 0 ? squeeze.new(&in, win_bits, map_bits, len_bits, 0) : null;
+        if (r == 0 && s == null) { r = ENOMEM; }
+        if (r == 0) {
+            s->flags = i == 0 ? f : (uint16_t)(f & ~squeeze_flags_filter);
+            squeeze.decompress(s, output, n);
+            if (i == 0) {
+                r = s->error != 0 ? s->error :
+                    (memcmp(output, data, bytes) != 0 ? EINVAL : 0);
+            } else {
+                r = s->error == EBADMSG ? 0 : EINVAL;
+            }
+        }
+        if (s != null) { squeeze.delete(s); }
+    }
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) {
+        printf("%7lld -> %7lld with checksums\n", (uint64_t)bytes, written);
+    }
+    return r;
+}
+
+// Decoding truncated and bit flipped streams must fail or produce some
+// output but never touch memory outside of the output buffer. Header of
+// another format version must be rejected.
+
+static errno_t test_corrupt(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4, flips = 64 };
+    const size_t capacity = bytes * 2 + 1024;
+    uint8_t* buffer = (uint8_t*)malloc(capacity * 2 + bytes);
+    if (buffer == null) { return ENOMEM; }
+    uint8_t* corrupt = buffer + capacity;
+    uint8_t* output = corrupt + capacity;
+    bitstream_type bs = { .data = buffer, .capacity = capacity };
+    squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+    errno_t r = s == null ? ENOMEM : 0;
+    if (r == 0) {
+        squeeze.compress(s, data, bytes);
+        r = s->error;
+        squeeze.delete(s);
+    }
+    for (int32_t version = 0; version < 2 && r == 0; version++) {
+        uint8_t h[32] = {0};
+        bitstream_type hb = { .data = h, .capacity = sizeof(h) };
+        squeeze.write_header(&hb, bytes, bits_win, bits_map, bits_len, 0, 0);
+        bitstream.flush(&hb);
+        if (version > 0) { h[11]--; } // version byte of squeeze_magic
+        bitstream_type in = { .data = h, .bytes = hb.bytes };
+        uint64_t n = 0;
+        uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+        uint16_t flags = 0;
+        uint32_t id = 0;
+        squeeze.read_header(&in, &n, &win_bits, &map_bits, &len_bits,
+                            &flags, &id);
+        if (in.error != (version > 0 ? EINVAL : 0)) { r = EINVAL; }
+    }
+    int32_t rejected = 0;
+    for (int32_t i = 0; i <= flips * 2 + 1 && r == 0; i++) {
+        const uint16_t flags = i <= flips ? 0 : squeeze_flag_streams;
+        if (i == flips + 1) { // the same data coded into sub-streams
+            bs = (bitstream_type){ .data = buffer, .capacity = capacity };
+            s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+            if (s == null) { r = ENOMEM; break; }
+            s->flags = flags;
+            squeeze.compress(s, data, bytes);
+            r = s->error;
+            squeeze.delete(s);
+            if (r != 0) { break; }
+        }
+        const int32_t k = i % (flips + 1);
+        memcpy(corrupt, buffer, (size_t)bs.bytes);
+        // k == flips: truncated in the middle
+        const uint64_t written = k < flips ? bs.bytes : bs.bytes / 2;
+        if (k < flips) {
+            const uint64_t bit = (bs.bytes * 8 * (uint64_t)k) / flips;
+            corrupt[bit / 8] ^= (uint8_t)(1U << (bit % 8));
+        }
+        bitstream_type in = { .data = corrupt, .bytes = written };
+        s = squeeze.new(&in, bits_win, bits_map, bits_len, 0);
+        if (s == null) { r = ENOMEM; break; }
+        s->flags = flags;
+        squeeze.decompress(s, output, bytes);
+        if (s->error != 0) { rejected++; }
+        if (k == flips && s->error == 0) { r = EINVAL; }
+        squeeze.delete(s);
+    }
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) {
+        printf("%d of %d corrupt streams rejected\n", rejected,
+               (flips + 1) * 2);
+    }
+    return r;
+}
+
+// Compressor and decompressor see the same tokens: their counters must
+// be equal and cover every byte of the input
+
+static errno_t test_stats(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4 };
+    const size_t capacity = bytes * 2 + 1024;
+    uint8_t* buffer = (uint8_t*)malloc(capacity + bytes);
+    if (buffer == null) { return ENOMEM; }
+    uint8_t* output = buffer + capacity;
+    squeeze_stats_type encoded = {0};
+    squeeze_stats_type decoded = {0};
+    bitstream_type bs = { .data = buffer, .capacity = capacity };
+    squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len,
+                                  squeeze_option_stats);
+    errno_t r = s == null ? ENOMEM : 0;
+    if (r == 0) {
+        squeeze.compress(s, data, bytes);
+        r = s->error;
+        squeeze.stats(s, &encoded);
+        squeeze.delete(s);
+    }
+    bitstream_type in = { .data = buffer, .bytes = bs.bytes };
+    s = r == 0 ? squeeze.new(&in, bits_win, bits_map, bits_len,
+                             squeeze_option_stats) : null;
+    if (r == 0 && s == null) { r = ENOMEM; }
+    if (r == 0) {
+        squeeze.decompress(s, output, bytes);
+        r = s->error;
+        squeeze.stats(s, &decoded);
+        squeeze.delete(s);
+    }
+    if (r == 0) {
+        const bool same = encoded.literals == decoded.literals &&
+            encoded.matches == decoded.matches &&
+            encoded.words == decoded.words &&
+            encoded.escapes == decoded.escapes &&
+            memcmp(encoded.length, decoded.length,
+                   sizeof(encoded.length)) == 0 &&
+            memcmp(encoded.distance, decoded.distance,
+                   sizeof(encoded.distance)) == 0;
+        r = same && encoded.bytes == bytes && decoded.bytes == bytes &&
+            encoded.bits == bs.bytes * 8 && encoded.entries > 0 ?
+            0 : EINVAL;
+    }
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) {
+        printf("%lld literals %lld matches %lld words %.2f bits/token "
+               "%.1f%% hits %.1f%% dictionary load\n",
+               encoded.literals, encoded.matches, encoded.words,
+               encoded.bits_per_token, encoded.hit_rate * 100,
+               encoded.load * 100);
+    }
+    return r;
+}
+
+// Pipelined compression records events of both coder and finder threads
+// with sampled stage times and exports them as trace JSON. Events of each
+// thread must be of its kind, follow each other in time without overlap
+// and cover the whole input; JSON must name both threads and all events.
+
+static errno_t test_trace_json(const char* fn, uint64_t n) {
+    uint8_t* data = null;
+    size_t bytes = 0;
+    errno_t r = file.read_fully(fn, &data, &bytes);
+    char* json = r == 0 ? (char*)malloc(bytes + 1) : null;
+    if (r == 0 && json == null) { r = ENOMEM; }
+    if (r == 0) {
+        memcpy(json, data, bytes);
+        json[bytes] = 0;
+        char other[128];
+        snprintf(other, sizeof(other), "\"otherData\":{\"events\":%lld,"
+                 "\"dropped\":0}}\n", (long long)n);
+        int32_t braces = 0;
+        int32_t brackets = 0;
+        for (size_t i = 0; i < bytes && braces >= 0 && brackets >= 0; i++) {
+            braces   += json[i] == '{' ? 1 : json[i] == '}' ? -1 : 0;
+            brackets += json[i] == '[' ? 1 : json[i] == ']' ? -1 : 0;
+        }
+        const size_t tail = strlen(other);
+        if (strncmp(json, "{\"traceEvents\":[\n", 16) != 0 ||
+            braces != 0 || brackets != 0 || bytes < tail ||
+            strcmp(json + bytes - tail, other) != 0 ||
+            strstr(json, "{\"name\":\"compress\",\"cat\":\"squeeze\","
+                         "\"ph\":\"X\",\"pid\":1,\"tid\":0,") == null ||
+            strstr(json, "{\"name\":\"search\",\"cat\":\"squeeze\","
+                         "\"ph\":\"X\",\"pid\":1,\"tid\":1,") == null ||
+            strstr(json, "\"tid\":0,\"args\":{\"name\":\"coder\"}") == null ||
+            strstr(json, "\"tid\":1,\"args\":{\"name\":\"finder\"}") == null ||
+            strstr(json, "\"search_us\":") == null ||
+            strstr(json, "\"ph\":\"C\"") == null) {
+            r = EINVAL;
+        }
+    }
+    free(json);
+    free(data);
+    return r;
+}
+
+static errno_t test_trace(const uint8_t* sample, size_t size) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4, events = 256 };
+    enum { copies = 3 }; // several squeeze_trace_block events per thread
+    static squeeze_event_type event[events];
+    const size_t bytes = size * copies;
+    const size_t capacity = bytes * 2 + 1024;
+    uint8_t* buffer = (uint8_t*)malloc(capacity + bytes);
+    if (buffer == null) { return ENOMEM; }
+    uint8_t* data = buffer + capacity;
+    for (int32_t i = 0; i < copies; i++) {
+        memcpy(data + size * i, sample, size);
+    }
+    bitstream_type bs = { .data = buffer, .capacity = capacity };
+    squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len,
+                                  squeeze_option_pipeline |
+                                  squeeze_option_trace);
+    errno_t r = s == null ? ENOMEM : 0;
+    if (r == 0) {
+        s->trace.event = event;
+        s->trace.capacity = events;
+        squeeze.compress(s, data, bytes);
+        r = s->error;
+    }
+    static const uint32_t kinds[] = { // by thread
+        squeeze_event_compress, squeeze_event_search
+    };
+    uint64_t n = 0;
+    uint64_t covered[2] = {0}; // bytes by coder and finder
+    uint64_t end[2] = {0};     // of the previous event of the thread
+    uint64_t count[2] = {0};
+    uint64_t sampled = 0;
+    if (r == 0) {
+        n = atomic_load(&s->trace.count);
+        for (uint64_t i = 0; i < n && i < events && r == 0; i++) {
+            const squeeze_event_type* e = &event[i];
+            const uint32_t t = e->thread;
+            if (t > squeeze_thread_finder || e->kind != kinds[t] ||
+                e->bytes == 0 || e->start < end[t] || e->duration == 0) {
+                r = EINVAL;
+            } else {
+                covered[t] += e->bytes;
+                end[t] = e->start + e->duration;
+                count[t]++;
+            }
+            for (int32_t k = 0; k < squeeze_stages; k++) {
+                sampled += e->stage[k];
+            }
+        }
+        if (r == 0) {
+            r = n > 0 && n <= events && covered[0] == bytes &&
+                covered[1] == bytes && count[0] > 1 && count[1] > 1 &&
+                sampled > 0 ? 0 : EINVAL;
+        }
+    }
+    FILE* f = null;
+    if (r == 0) { r = fopen_s(&f, compressed, "w"); }
+    if (r == 0 && f == null) { r = EIO; }
+    if (r == 0) {
+        r = squeeze.trace(s, f);
+        if (fclose(f) != 0 && r == 0) { r = errno; }
+        if (r == 0) { r = test_trace_json(compressed, n); }
+        (void)remove(compressed);
+    }
+    if (s != null) { squeeze.delete(s); }
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) { printf("%lld trace events\n", n); }
+    return r;
+}
+
+// Contexts carved from an arena: the first one gets never used (zero)
+// memory, the next one reuses it and must clear it
+
+static errno_t test_arena(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4 };
+    const size_t size = squeeze_sizeof(bits_win, bits_map, bits_len);
+    const size_t capacity = bytes * 2 + 1024;
+    uint8_t* buffer = (uint8_t*)malloc(capacity + bytes);
+    if (buffer == null) { return ENOMEM; }
+    uint8_t* output = buffer + capacity;
+    arena_type a = {0};
+    errno_t r = arena.create(&a, size, arena_flag_huge, -1);
+    bitstream_type bs = { .data = buffer, .capacity = capacity };
+    squeeze_type* s = r == 0 ?
+        squeeze.new_in(&a, &bs, bits_win, bits_map, bits_len, 0) : null;
+    if (r == 0 && s == null) { r = ENOMEM; }
+    const bool zeroed = s != null && (s->options & squeeze_option_zeroed);
+    if (r == 0 && zeroed) { // init() must not write prefix index and trees
+        const uint8_t* p = (const uint8_t*)s->map_nodes;
+        const uint8_t* e = (const uint8_t*)(s->len_nodes + s->len.n * 2 - 1);
+        while (p < e && *p == 0) { p++; }
+        if (p != e || s->dic.built || !s->map.indexed) { r = EINVAL; }
+    }
+    if (r == 0) {
+        squeeze.compress(s, data, bytes);
+        r = s->error;
+        squeeze.delete(s);
+    }
+    bitstream_type in = { .data = buffer, .bytes = bs.bytes };
+    squeeze_type* d = r == 0 ?
+        squeeze.new_in(&a, &in, bits_win, bits_map, bits_len, 0) : null;
+    if (r == 0 && d == null) { r = ENOMEM; }
+    if (r == 0) {
+        r = d == s && zeroed && !(d->options & squeeze_option_zeroed) ?
+            0 : EINVAL;
+    }
+    if (r == 0) {
+        squeeze.decompress(d, output, bytes);
+        r = d->error != 0 ? d->error :
+            (memcmp(output, data, bytes) != 0 ? EINVAL : 0);
+    }
+    if (d != null) { squeeze.delete(d); }
+    const bool huge = a.huge;
+    arena.dispose(&a);
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) {
+        printf("arena of %lld bytes%s\n", (uint64_t)size,
+               huge ? " in huge pages" : "");
+    }
+    return r;
+}
+
+static errno_t test_tune(const uint8_t* data, size_t bytes) {
+    // sample smaller than data: slices and scaled down map are used
+    const size_t capacity = bytes * 2 + 1024;
+    uint8_t* buffer = (uint8_t*)malloc(capacity + bytes);
+    errno_t r = buffer == null ? ENOMEM : 0;
+    uint8_t* output = buffer + capacity;
+    bitstream_type bs = { .data = buffer, .capacity = capacity };
+    squeeze_tune_type t = {
+        .memory = squeeze_sizeof(14, 16, 6), .sample = bytes / 4, .bs = &bs
+    };
+    if (r == 0) { r = squeeze.tune(data, bytes, &t); } // writes the header
+    const size_t size = squeeze_sizeof(t.win_bits, t.map_bits, t.len_bits);
+    if (r == 0 && (size == 0 || size > t.memory || t.compressed == 0)) {
+        r = EINVAL;
+    }
+    squeeze_type* s = null;
+    if (r == 0) {
+        s = squeeze.new(&bs, t.win_bits, t.map_bits, t.len_bits, 0);
+        if (s == null) { r = ENOMEM; }
+    }
+    if (r == 0) {
+        squeeze.compress(s, data, bytes);
+        r = s->error;
+        squeeze.delete(s);
+    }
+    if (r == 0) { // decoder learns the choice from the header
+        bitstream_type in = { .data = buffer, .bytes = bs.bytes };
+        uint64_t n = 0;
+        uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+        uint16_t flags = 0;
+        uint32_t id = 0;
+        squeeze.read_header(&in, &n, &win_bits, &map_bits, &len_bits,
+                            &flags, &id);
+        s = in.error == 0 ? squeeze.new(&in, win_bits, map_bits, len_bits, 0) :
+                            null;
+        r = in.error != 0 ? in.error : (s == null ? ENOMEM : 0);
+        if (r == 0) {
+            squeeze.decompress(s, output, bytes);
+            r = s->error != 0 ? s->error :
+                (memcmp(output, data, bytes) != 0 ? EINVAL : 0);
+        }
+        if (s != null) { squeeze.delete(s); }
+    }
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) {
+        printf("tuned win_bits: %d map_bits: %d len_bits: %d "
+               "%lld -> %lld of %d candidates\n", t.win_bits, t.map_bits,
+               t.len_bits, t.sampled, t.compressed, t.candidates);
+    }
+    return r;
+}
+
+// Records of 0..299 bytes of `data` in a batch of 3 workers: cold and
+// primed with a dictionary trained on the first half of the data, then
+// cold again. One batch object keeps the worker contexts for all calls
+// and must give the same batch as the first cold call. Options are not
+// in the batch: decoded with the batch object's and without (none).
+
+static errno_t test_batch(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 10, bits_map = 10, bits_len = 4, id = 0xBA7C };
+    enum { records = 256 };
+    squeeze_record_type* rec = (squeeze_record_type*)
+        calloc(records, sizeof(squeeze_record_type));
+    const size_t capacity = bytes * 3 + 4096;
+    uint8_t* buffer = (uint8_t*)malloc(capacity + bytes);
+    errno_t r = rec == null || buffer == null ? ENOMEM : 0;
+    uint8_t* output = buffer + capacity;
+    size_t n = 0; // records
+    uint64_t total = 0;
+    for (size_t i = 0, k = 0; r == 0 && n < records; k++) {
+        const size_t b = (k * 37) % 300;
+        if (i + b > bytes) { break; }
+        rec[n++] = (squeeze_record_type){ .data = data + i, .bytes = b };
+        i += b;
+        total += b;
+    }
+    void* image = null;
+    size_t image_bytes = 0;
+    squeeze_type* s = r == 0 ?
+        squeeze.new(null, bits_win, bits_map, bits_len, 0) : null;
+    if (r == 0 && s == null) { r = ENOMEM; }
+    if (r == 0) {
+        squeeze.train(s, data, bytes / 2);
+        image_bytes = squeeze.dictionary(s, id, null, 0);
+        image = malloc(image_bytes);
+        r = s->error != 0 ? s->error : (image == null ? ENOMEM : 0);
+        if (r == 0) { squeeze.dictionary(s, id, image, image_bytes); }
+        squeeze.delete(s);
+    }
+    uint64_t written[3] = {0};
+    uint32_t crc[3] = {0};
+    squeeze_batch_type b = {
+        .win_bits = bits_win, .map_bits = bits_map, .len_bits = bits_len,
+        .options = squeeze_option_refs, .workers = 3,
+        .image = image, .image_bytes = image_bytes
+    };
+    squeeze_type* context = null; // of the first worker
+    for (int32_t i = 0; i < 3 && r == 0; i++) { // cold, primed, cold
+        b.flags = i == 1 ? squeeze_flag_dictionary : 0;
+        bitstream_type bs = { .data = buffer, .capacity = capacity };
+        r = squeeze.compress_batch(&bs, &b, rec, n);
+        written[i] = bs.bytes;
+        crc[i] = checksum.crc32c(0, buffer, (size_t)bs.bytes);
+        if (i == 0) { context = b.context[0]; }
+        if (r == 0 && (context == null || b.context[0] != context ||
+                       (i == 2 && (written[2] != written[0] ||
+                                   crc[2] != crc[0])))) {
+            r = EINVAL;
+        }
+        size_t count = 0;
+        if (r == 0) { // number of records
+            r = squeeze.decompress_batch(&b, buffer, bs.bytes, null, &count)
+                == E2BIG && count == n ? 0 : EINVAL;
+        }
+        uint64_t at = 0;
+        for (size_t k = 0; k < n; k++) {
+            rec[k].output = output + at;
+            at += rec[k].bytes;
+        }
+        memset(output, 0, bytes);
+        if (r == 0) { // refs of `b` while primed, no options otherwise
+            squeeze_batch_type* d = i == 1 ? &b : null;
+            r = squeeze.decompress_batch(d, buffer, bs.bytes, rec, &count);
+        }
+        if (r == 0 && memcmp(output, data, (size_t)total) != 0) { r = EINVAL; }
+        for (size_t k = 0; k < n; k++) { rec[k].output = null; }
+    }
+    squeeze.dispose_batch(&b);
+    free(image);
+    free(buffer);
+    free(rec);
+    assert(r == 0);
+    if (r == 0) {
+        printf("batch of %lld records %lld -> cold %lld primed %lld bytes\n",
+               (uint64_t)n, total, written[0], written[1]);
+    }
+    return r;
+}
+
+// removes chunks of the recipe from the store (twice for duplicates)
+
+static void test_dedup_remove(dedup_type* d, const uint8_t* recipe,
+                              uint64_t bytes) {
+    bitstream_type bs = { .data = (uint8_t*)recipe, .bytes = bytes };
+    uint64_t total = 0, chunks = 0;
+    errno_t r = dedup.read_header(&bs, &total, &chunks);
+    for (uint64_t c = 0; c < chunks && r == 0; c++) {
+        uint32_t k = 0;
+        uint8_t hash[checksum_sha256_bytes];
+        char path[dedup_path];
+        r = dedup.chunk(&bs, &k, hash);
+        if (r == 0) { r = dedup.path(d, hash, path, sizeof(path)); }
+        if (r == 0) { (void)remove(path); }
+    }
+}
+
+// Input stored, then again with an insertion in the middle: only chunks
+// around the insertion are new, both decompressed by another instance
+
+static errno_t test_dedup(const uint8_t* data, size_t bytes) {
+    static const uint8_t abc[] = { // SHA-256 of "abc" and of two blocks
+        0xBA, 0x78, 0x16, 0xBF, 0x8F, 0x01, 0xCF, 0xEA,
+        0x41, 0x41, 0x40, 0xDE, 0x5D, 0xAE, 0x22, 0x23,
+        0xB0, 0x03, 0x61, 0xA3, 0x96, 0x17, 0x7A, 0x9C,
+        0xB4, 0x10, 0xFF, 0x61, 0xF2, 0x00, 0x15, 0xAD
+    };
+    static const uint8_t two[] = {
+        0x24, 0x8D, 0x6A, 0x61, 0xD2, 0x06, 0x38, 0xB8,
+        0xE5, 0xC0, 0x26, 0x93, 0x0C, 0x3E, 0x60, 0x39,
+        0xA3, 0x3C, 0xE4, 0x59, 0x64, 0xFF, 0x21, 0x67,
+        0xF6, 0xEC, 0xED, 0xD4, 0x19, 0xDB, 0x06, 0xC1
+    };
+    uint8_t digest[2][checksum_sha256_bytes];
+    checksum.sha256("abc", 3, digest[0]);
+    checksum.sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                    56, digest[1]);
+    if (memcmp(digest[0], abc, sizeof(abc)) != 0 ||
+        memcmp(digest[1], two, sizeof(two)) != 0) {
+        assert(false);
+        return EINVAL;
+    }
+    enum { inserted = 100 };
+    const char* store = "~chunks~";
+    const size_t capacity = bytes + 4096; // recipe
+    uint8_t* buffer = (uint8_t*)malloc(capacity * 2 + (bytes + inserted) * 2);
+    if (buffer == null) { return ENOMEM; }
+    uint8_t* recipe[2] = { buffer, buffer + capacity };
+    uint8_t* input[2] = { (uint8_t*)data, buffer + capacity * 2 };
+    uint8_t* output = input[1] + bytes + inserted;
+    const size_t half = bytes / 2;
+    const size_t size[2] = { bytes, bytes + inserted };
+    memcpy(input[1], data, half);
+    memset(input[1] + half, '#', inserted);
+    memcpy(input[1] + half + inserted, data + half, bytes - half);
+    dedup_type d = {
+        .store = store, .min = 256, .avg = 1024, .max = 4096,
+        .win_bits = 10, .map_bits = 10, .len_bits = 4
+    };
+    uint64_t written[2] = {0};
+    uint64_t chunks[2] = {0};
+    uint64_t duplicates[2] = {0};
+    errno_t r = file.mkdir(store);
+    for (int32_t i = 0; i < 2 && r == 0; i++) {
+        const uint64_t c = d.chunks;
+        const uint64_t k = d.duplicates;
+        bitstream_type bs = { .data = recipe[i], .capacity = capacity };
+        r = dedup.compress(&d, &bs, input[i], size[i]);
+        written[i] = bs.bytes;
+        chunks[i] = d.chunks - c;
+        duplicates[i] = d.duplicates - k;
+    }
+    dedup_type e = { .store = store }; // another run
+    for (int32_t i = 0; i < 2 && r == 0; i++) {
+        bitstream_type bs = { .data = recipe[i], .bytes = written[i] };
+        uint64_t total = 0, n = 0;
+        r = dedup.read_header(&bs, &total, &n);
+        if (r == 0 && (total != size[i] || n != chunks[i])) { r = EINVAL; }
+        if (r == 0) { r = dedup.decompress(&e, &bs, n, output, size[i]); }
+        if (r == 0 && memcmp(output, input[i], size[i]) != 0) { r = EINVAL; }
+    }
+    // the insertion changes at most a few chunks around it
+    if (r == 0 && duplicates[1] + 4 < chunks[1]) { r = EINVAL; }
+    for (int32_t i = 0; i < 2; i++) {
+        test_dedup_remove(&d, recipe[i], written[i]);
+    }
+    if (file.exist(store)) { (void)file.rmdir(store); }
+    dedup.dispose(&d);
+    dedup.dispose(&e);
+    free(buffer);
+    assert(r == 0);
+    if (r == 0) {
+        printf("dedup %lld chunks %lld -> %lld bytes stored, "
+               "%lld of %lld chunks are duplicates after insertion\n",
+               chunks[0], (uint64_t)bytes, d.written, duplicates[1],
+               chunks[1]);
+    }
+    return r;
+}
+
+// Compressed to a file and back through asynchronous I/O with small
+// buffers so that the coder and the thread swap them many times
+
+static errno_t test_io(const uint8_t* data, size_t bytes) {
+    enum { bits_win = 10, bits_map = 12, bits_len = 4, capacity = 4096 };
+    bitstream_io_type io = {0};
+    FILE* out = null;
+    errno_t r = fopen_s(&out, compressed, "wb");
+    if (r != 0 || out == null) { return r != 0 ? r : EIO; }
+    bitstream_type bs = {0};
+    r = bitstream.open(&bs, &io, out, true, capacity);
+    squeeze_type* s = null;
+    if (r == 0) {
+        squeeze.write_header(&bs, bytes, bits_win, bits_map, bits_len, 0, 0);
+        s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+        if (s == null) { r = ENOMEM; }
+    }
+    if (r == 0) { squeeze.compress(s, data, bytes); }
+    if (s != null) { squeeze.delete(s); s = null; }
+    if (bs.io != null) {
+        errno_t rc = bitstream.close(&bs);
+        if (r == 0) { r = rc; }
+    }
+    const uint64_t written = bs.bytes;
+    int64_t eof = 0;
+    if (r == 0) { r = file.seek(out, 0, SEEK_END); }
+    if (r == 0) { r = file.tell(out, &eof); }
+    if (r == 0 && (uint64_t)eof != written) { r = EIO; }
+    static const char tail[] = "tail"; // must be where reader close() left
+    if (r == 0 && fwrite(tail, 1, 4, out) != 4) { r = errno; }
+    if (fclose(out) != 0 && r == 0) { r = errno; }
+    uint8_t* output = r == 0 ? (uint8_t*)malloc(bytes) : null;
+    if (r == 0 && output == null) { r = ENOMEM; }
+    FILE* in = null;
+    if (r == 0) { r = fopen_s(&in, compressed, "rb"); }
+    if (r == 0 && in == null) { r = EIO; }
+    if (r == 0) { r = bitstream.open(&bs, &io, in, false, capacity); }
+    if (r == 0) {
+        uint64_t n = 0;
+        uint8_t win_bits = 0, map_bits = 0, len_bits = 0;
+        uint16_t flags = 0;
+        uint32_t id = 0;
+        squeeze.read_header(&bs, &n, &win_bits, &map_bits, &len_bits,
+                            &flags, &id);
+        r = bs.error != 0 ? bs.error : (n != bytes ? EINVAL : 0);
+        if (r == 0) {
+            s = squeeze.new(&bs, win_bits, map_bits, len_bits, 0);
+            if (s == null) { r = ENOMEM; }
+        }
+        if (r == 0) {
+            squeeze.decompress(s, output, bytes);
+            r = s->error;
+        }
+        if (r == 0 && memcmp(output, data, bytes) != 0) { r = EINVAL; }
+        if (s != null) { squeeze.delete(s); }
+        errno_t rc = bitstream.close(&bs);
+        if (r == 0) { r = rc; }
+        char t[4] = {0};
+        if (r == 0 && (fread(t, 1, 4, in) != 4 || memcmp(t, tail, 4) != 0)) {
+            r = EIO;
+        }
+    }
+    if (in != null) { fclose(in); }
+    free(output);
+    (void)remove(compressed);
+    assert(r == 0);
+    if (r == 0) {
+        printf("io %lld -> %lld bytes in %d byte buffers\n",
+               (uint64_t)bytes, written, (int)capacity);
+    }
+    return r;
+}
+
+static errno_t test_seekable(const uint8_t* data, size_t bytes, size_t block) {
+    enum { bits_win = 12, bits_map = 12, bits_len = 4 };
+    FILE* out = null;
+    errno_t r = fopen_s(&out, compressed, "wb");
+    if (r != 0 || out == null) { return r != 0 ? r : EIO; }
+    bitstream_type bs = { .file = out };
+    squeeze_type* s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+    if (s == null) { r = ENOMEM; }
+    if (r == 0) {
+        squeeze.compress_blocks(s, data, bytes, block);
+        r = s->error;
+    }
+    if (s != null) { squeeze.delete(s); }
+    if (fclose(out) != 0 && r == 0) { r = errno; }
+    uint8_t* range = r == 0 ? (uint8_t*)malloc(bytes) : null;
+    if (r == 0 && range == null) { r = ENOMEM; }
+    FILE* in = null;
+    if (r == 0) { r = fopen_s(&in, compressed, "rb"); }
+    if (r == 0 && in == null) { r = EIO; }
+    if (r == 0) {
+        bitstream_type bs = { .file = in };
+        s = squeeze.new(&bs, bits_win, bits_map, bits_len, 0);
+        if (s == null) { r = ENOMEM; }
+        const size_t ranges[][2] = { // offset, bytes
+            { bytes / 2, block / 3 }, { block - 1, block + 2 },
+            { bytes - bytes % block, bytes % block }, { 0, bytes }
+        };
+        for (int32_t i = 0; i < (int32_t)countof(ranges) && r == 0; i++) {
+            const size_t offset = ranges[i][0];
+            const size_t n = ranges[i][1];
+            r = squeeze.decompress_range(s, offset, range, n);
+            if (r == 0 && memcmp(data + offset, range, n) != 0) { r = EINVAL; }
+        }
+        if (r == 0) { // past the end of data
+            r = squeeze.decompress_range(s, bytes, range, 1) == ERANGE ?
+                0 : EINVAL;
+        }
+        if (s != null) { squeeze.delete(s); }
+        printf("seekable %lld blocks of %lld bytes\n",
+               (long long)((bytes + block - 1) / block), (long long)block);
+    }
+    if (in != null) { fclose(in); }
+    free(range);
+    (void)remove(compressed);
+    assert(r == 0);
+    return r;
+}
+
+static uint8_t test_filters(const char* fn) { // filters advised for file
+    uint8_t* data = null;
+    size_t bytes = 0;
+    int32_t machine = filter_machine_none;
+    int32_t stride = 0;
+    if (file.read_fully(fn, &data, &bytes) == 0) {
+        machine = filter.machine(data, bytes);
+        stride = machine == filter_machine_none ? filter.stride(data, bytes) : 0;
+        free(data);
+    }
+    return machine == filter_machine_x86   ? squeeze_flag_x86 :
+           machine == filter_machine_arm64 ? squeeze_flag_arm64 :
+           stride > 0 ? squeeze_flag_stride(stride) : 0;
 }
 
 static errno_t locate_test_folder(void) {
@@ -212,36 +1265,136 @@ static errno_t locate_test_folder(void) {
     // and is run from root of repository... On Windows with
     // MSVC it is buried inside bin/... folder depths
     // on X Code in MacOS it can be completely out of tree.
-    // So we need to find the test files.
-    for (;;) {
-        if (file.exist("test/bible.txt")) { return 0; }
+    // So we need to find the test files. chdir("..") succeeds at the
+    // root of the file system, hence the depth limit.
+    // test/bible.txt is downloaded, test/laozi.txt is in the repository.
+    for (int32_t depth = 0; depth < 16; depth++) {
+        if (file.exist("test/laozi.txt")) { return 0; }
         if (file.chdir("..") != 0) { return errno; }
     }
+    return ENOENT;
 }
 
 int main(int argc, const char* argv[]) {
     (void)argc; (void)argv; // unused
     errno_t r = locate_test_folder();
+    if (r == 0) { r = test_huffman_depth(); }
     if (r == 0) {
         const char* data = "Hello World Hello.World Hello World";
         size_t bytes = strlen((const char*)data);
-        r = test(null, (const uint8_t*)data, bytes);
+        r = test(null, (const uint8_t*)data, bytes, 0, 0);
+        if (r == 0) {
+            r = test(null, (const uint8_t*)data, bytes, 0, squeeze_option_refs);
+        }
     }
     if (r == 0) {
         uint8_t data[4 * 1024] = {0};
-        r = test(null, data, sizeof(data));
+        r = test(null, data, sizeof(data), 0, 0);
+        if (r == 0) {
+            r = test(null, data, sizeof(data), 0, squeeze_option_parallel);
+        }
         // lz77 deals with run length encoding in amazing overlapped way
-        for (int32_t i = 0; i < sizeof(data); i += 4) {
+        for (int32_t i = 0; i < (int32_t)sizeof(data); i += 4) {
             memcpy(data + i, "\x01\x02\x03\x04", 4);
         }
-        r = test(null, data, sizeof(data));
+        if (r == 0) { r = test(null, data, sizeof(data), 0, 0); }
+        // short overlapping distances of all periods around copy widths
+        for (int32_t p = 1; p <= 33 && r == 0; p++) {
+            for (int32_t i = 0; i < (int32_t)sizeof(data); i++) {
+                data[i] = (uint8_t)('a' + i % p);
+            }
+            r = test(null, data, sizeof(data), 0, 0);
+        }
+    }
+    if (r == 0) { // repeats far beyond the window
+        enum { block = 64 * 1024, blocks = 4 };
+        uint8_t* data = (uint8_t*)malloc(block * blocks);
+        if (data == null) { return ENOMEM; }
+        uint32_t seed = 1;
+        for (int32_t i = 0; i < block; i++) {
+            seed = seed * 1103515245 + 12345;
+            data[i] = (uint8_t)(seed >> 16);
+        }
+        for (int32_t i = 1; i < blocks; i++) {
+            memcpy(data + block * i, data, block);
+            data[block * i + i * 1000] ^= 0xFF; // a break inside the repeat
+        }
+        r = test(null, data, block * blocks, squeeze_flag_long,
+                 squeeze_option_long);
+        if (r == 0) {
+            r = test(null, data, block * blocks, squeeze_flag_long,
+                     squeeze_option_long | squeeze_option_parallel);
+        }
+        if (r == 0) {
+            r = test(null, data, block * blocks,
+                     squeeze_flag_long | squeeze_flag_streams,
+                     squeeze_option_long);
+        }
+        free(data);
+    }
+    if (r == 0 && file.exist(__FILE__)) { // dictionary trained on test.c
+        uint8_t* sample = null;
+        size_t size = 0;
+        r = file.read_fully(__FILE__, &sample, &size);
+        if (r == 0) {
+            r = test_dictionary(sample, size,
+                "{\"method\": \"squeeze.compress\", \"id\": 17, \"params\": "
+                "{\"win_bits\": 10, \"map_bits\": 10, \"len_bits\": 4, "
+                "\"flags\": 0, \"options\": 0, \"bytes\": 4096}, "
+                "\"data\": \"static errno_t test(const char* fn, "
+                "const uint8_t* data, size_t bytes, uint16_t flags, "
+                "uint32_t options)\"}");
+            if (r == 0) { r = test_map_long(sample, size); }
+            if (r == 0) { r = test_refs(sample, size); }
+            if (r == 0) { r = test_workers(sample, size); }
+            if (r == 0) { r = test_append(sample, size, 3); }
+            if (r == 0) { r = test_seekable(sample, size, 4096); }
+            if (r == 0) { r = test_checksum(sample, size); }
+            if (r == 0) { r = test_corrupt(sample, size); }
+            if (r == 0) { r = test_stats(sample, size); }
+            if (r == 0) { r = test_trace(sample, size); }
+            if (r == 0) { r = test_arena(sample, size); }
+            if (r == 0) { r = test_tune(sample, size); }
+            if (r == 0) { r = test_batch(sample, size); }
+            if (r == 0) { r = test_dedup(sample, size); }
+            if (r == 0) { r = test_io(sample, size); }
+            free(sample);
+        }
     }
     if (r == 0 && file.exist(__FILE__)) { // test.c source code:
-        r = test_compression(__FILE__);
+        r = test_compression(__FILE__, 0, 0);
+        if (r == 0) { r = test_compression(__FILE__, 0, squeeze_option_refs); }
+        if (r == 0) {
+            r = test_compression(__FILE__, 0, squeeze_option_pipeline);
+        }
+        if (r == 0) {
+            r = test_compression(__FILE__, 0, squeeze_option_parallel);
+        }
+        if (r == 0) { r = test_compression(__FILE__, squeeze_flag_streams, 0); }
     }
     // argv[0] executable filepath (Windows) or possibly name (Unix)
     if (r == 0 && file.exist(argv[0])) {
-        r = test_compression(argv[0]);
+        r = test_compression(argv[0], 0, 0);
+        if (r == 0) { r = test_compression(argv[0], 0, squeeze_option_refs); }
+        if (r == 0) {
+            r = test_compression(argv[0], 0, squeeze_option_pipeline);
+        }
+        if (r == 0) {
+            r = test_compression(argv[0], 0, squeeze_option_pipeline |
+                                             squeeze_option_parallel);
+        }
+        if (r == 0) {
+            r = test_compression(argv[0], squeeze_flag_checksum,
+                                 squeeze_option_pipeline);
+        }
+        if (r == 0) {
+            r = test_compression(argv[0], squeeze_flag_checksum, 0);
+        }
+        if (r == 0) {
+            r = test_compression(argv[0], squeeze_flag_streams |
+                                 squeeze_flag_checksum,
+                                 squeeze_option_pipeline);
+        }
     }
     static const char* test_files[] = {
         "test/bible.txt",     // bits len:3.01 pos:10.73 #words:91320 #lens:112
@@ -254,29 +1407,51 @@ int main(int argc, const char* argv[]) {
         "test/mandrill.bmp",
         "test/mandrill.png",
     };
-    for (int i = 0; i < countof(test_files) && r == 0; i++) {
+    for (int i = 0; i < (int)countof(test_files) && r == 0; i++) {
         if (file.exist(test_files[i])) {
-            r = test_compression(test_files[i]);
+            r = test_compression(test_files[i], 0, 0);
+        }
+        if (r == 0 && file.exist(test_files[i])) {
+            const uint8_t filters = test_filters(test_files[i]);
+            if (filters != 0) { r = test_compression(test_files[i], filters, 0); }
+        }
+        if (r == 0 && i == 0 && file.exist(test_files[i])) {
+            r = test_compression(test_files[i], squeeze_flag_streams, 0);
         }
     }
     return r;
 }
 
+#define arena_implementation
+#include "arena.h"
+
 #define map_implementation
 #include "map.h"
 
 #define bitstream_implementation
 #include "bitstream.h"
 
+#define checksum_implementation
+#include "checksum.h"
+
+#define filter_implementation
+#include "filter.h"
+
 #define huffman_implementation
 #include "huffman.h"
 
 #define file_implementation
 #include "file.h"
 
+#define ring_implementation
+#include "ring.h"
+
 #define squeeze_implementation
 #include "squeeze.h"
 
+#define dedup_implementation
+#include "dedup.h"
+
 #if 0
 
 WITHOUT HUFFMAN: